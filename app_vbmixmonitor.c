@@ -53,12 +53,16 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375484 $")
 #include "asterisk/manager.h"
 #include "asterisk/test.h"
 #include "asterisk/utils.h"
+#include "asterisk/strings.h"
 #include "asterisk/config.h"
 #include <ifaddrs.h>
 //#include "asterisk/config_options.h"
 #include <curl/curl.h>
 #include "cJSON.h"
+#include "vb_platform.h"
 #include "voicebase.h"
+#include "vb_stats.h"
+#include "vb_probes.h"
 
 #define ast_alloca(size) __builtin_alloca(size)
 
@@ -115,6 +119,18 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375484 $")
 			<para>Records the audio on the current channel to the specified file.</para>
 			<para>This application does not automatically answer and should be preceeded by
 			an application such as Answer or Progress().</para>
+			<para>The application argument is a JSON object with the upload parameters. The
+			<literal>v</literal>, <literal>V</literal> and <literal>W</literal> options are
+			passed in its <literal>options</literal> key, e.g.
+			<literal>{"options":"v(2)V(-1)"}</literal>.</para>
+			<para>A profile section of <filename>vbmixmonitor.conf</filename> is selected by passing
+			its name instead of the JSON object, e.g. <literal>VBMixMonitor(acme)</literal>, or with
+			the <literal>profile</literal> key, e.g. <literal>{"profile":"acme","externalId":"4711"}</literal>.
+			Keys of the JSON object override the profile.</para>
+			<para>The manager events <literal>VBSegmentClosed</literal>, <literal>VBSegmentUploaded</literal>
+			and <literal>VBSegmentFailed</literal> (class <literal>call</literal>, with the channel, callID,
+			segment number, size, queue wait and upload time in milliseconds) follow every segment
+			through the upload, <literal>VBMonitorStopped</literal> is sent when the recording ends.</para>
 			<note><para>MixMonitor runs as an audiohook. In order to keep it running through
 			a transfer, AUDIOHOOK_INHERIT must be set for the channel which ran mixmonitor.
 			For more information, including dialplan configuration set for using
@@ -167,11 +183,45 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375484 $")
 			<para>This action may be used to mute a MixMonitor recording.</para>
 		</description>
 	</manager>
+	<manager name="VBMixMonitorExportStats" language="en_US">
+		<synopsis>
+			Write the VBMixMonitor counters and latency histograms to a file.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="File" required="true">
+				<para>Full path of the file to write, in the Prometheus text format.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>The file is replaced atomically, so it can be read by the node exporter
+			textfile collector at any time.</para>
+		</description>
+	</manager>
 
  ***/
 
 #define get_volfactor(x) x ? ((x > 0) ? (1 << x) : ((1 << abs(x)) * -1)) : 0
 
+enum mixmonitor_flags {
+	MUXFLAG_VOLUME = (1 << 3),
+	MUXFLAG_READVOLUME = (1 << 4),
+	MUXFLAG_WRITEVOLUME = (1 << 5),
+};
+
+enum mixmonitor_args {
+	OPT_ARG_READVOLUME = 0,
+	OPT_ARG_WRITEVOLUME,
+	OPT_ARG_VOLUME,
+	OPT_ARG_ARRAY_SIZE,	/* Always last element of the enum */
+};
+
+AST_APP_OPTIONS(mixmonitor_opts, {
+	AST_APP_OPTION_ARG('v', MUXFLAG_READVOLUME, OPT_ARG_READVOLUME),
+	AST_APP_OPTION_ARG('V', MUXFLAG_WRITEVOLUME, OPT_ARG_WRITEVOLUME),
+	AST_APP_OPTION_ARG('W', MUXFLAG_VOLUME, OPT_ARG_VOLUME),
+});
+
 static const char * const app = "VBMixMonitor";
 
 static const char * const stop_app = "StopVBMixMonitor";
@@ -182,12 +232,27 @@ struct mixmonitor {
 	struct ast_audiohook audiohook;
 	char*	name;
 
-	struct cJSON *params;
+	char*	params;
+	int		read_volume;
+	int		write_volume;
 
 	struct ast_autochan *autochan;
 	struct mixmonitor_ds *mixmonitor_ds;
+
+	/* Set while the monitor is listed in the monitors list */
+	pthread_t thread;
+	struct mem_storage_t *mem_storage;
+	AST_RWLIST_ENTRY(mixmonitor) list;
+
+	/* Audiohook backlog in samples, kept by the capture thread: the listing can't
+	 * take the audiohook lock, the capture thread takes the list lock with it held */
+	unsigned int read_backlog;
+	unsigned int write_backlog;
 };
 
+/*! \brief Running monitors, for "vbmixmonitor show channels" */
+static AST_RWLIST_HEAD_STATIC(monitors, mixmonitor);
+
 
 struct mixmonitor_ds {
 	unsigned int destruction_ok;
@@ -263,6 +328,68 @@ static int startmon(struct ast_channel *chan, struct ast_audiohook *audiohook)
 
 #define SAMPLES_PER_FRAME 160
 
+/*!
+ * \internal
+ * \brief Check whether a read/write frame pair can be taken from the audiohook
+ * \pre audiohook must be locked
+ *
+ * Both legs are normally consumed together. When one leg carries no media at
+ * all (one-way audio, hold) the other one is not stalled: once it has buffered
+ * more than a frame ahead, the missing leg is recorded as silence.
+ */
+static int stereo_frames_ready(struct ast_audiohook *audiohook, size_t samples)
+{
+	unsigned int read_avail = ast_slinfactory_available(&audiohook->read_factory);
+	unsigned int write_avail = ast_slinfactory_available(&audiohook->write_factory);
+
+	if (read_avail >= samples && write_avail >= samples) {
+		return 1;
+	}
+	return read_avail >= 2 * samples || write_avail >= 2 * samples;
+}
+
+static int parse_volume(const char *value, const char *what)
+{
+	int x;
+
+	if (ast_strlen_zero(value)) {
+		ast_log(LOG_WARNING, "No volume level was provided for the %s volume option.\n", what);
+	} else if ((sscanf(value, "%2d", &x) != 1) || (x < -4) || (x > 4)) {
+		ast_log(LOG_NOTICE, "%s volume must be a number between -4 and 4, not '%s'\n", what, value);
+	} else {
+		return get_volfactor(x);
+	}
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Parse the v/V/W options passed in the "options" key of the params
+ */
+static void parse_volume_options(struct mixmonitor *mixmonitor, const char *options)
+{
+	struct ast_flags flags = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	char *parse;
+
+	if (ast_strlen_zero(options)) {
+		return;
+	}
+
+	parse = ast_strdupa(options);
+	ast_app_parse_options(mixmonitor_opts, &flags, opts, parse);
+
+	if (ast_test_flag(&flags, MUXFLAG_READVOLUME)) {
+		mixmonitor->read_volume = parse_volume(opts[OPT_ARG_READVOLUME], "Heard");
+	}
+	if (ast_test_flag(&flags, MUXFLAG_WRITEVOLUME)) {
+		mixmonitor->write_volume = parse_volume(opts[OPT_ARG_WRITEVOLUME], "Spoken");
+	}
+	if (ast_test_flag(&flags, MUXFLAG_VOLUME)) {
+		mixmonitor->read_volume = mixmonitor->write_volume = parse_volume(opts[OPT_ARG_VOLUME], "Combined");
+	}
+}
+
 static void mixmonitor_free(struct mixmonitor *mixmonitor)
 {
 	if (mixmonitor) {
@@ -277,26 +404,89 @@ static void mixmonitor_free(struct mixmonitor *mixmonitor)
 		ast_free(mixmonitor);
 	}
 }
+
+/*!
+ * \internal
+ * \brief Signed linear samples of an audiohook frame, NULL for a missing leg
+ */
+static const short *frame_samples(struct ast_frame *fr)
+{
+	return fr ? fr->data.ptr : NULL;
+}
+
+static int frame_num_samples(struct ast_frame *fr)
+{
+	return fr ? ast_codec_get_samples(fr) : 0;
+}
+
+/*!
+ * \internal
+ * \brief Close the current segment once it is long enough and make sure one is open
+ * \note The closed segment is submitted with submit_closed_segments() after the
+ * datastore lock is released, the pipeline may block while its queues are full
+ */
+static void prepare_segment(struct mixmonitor *mixmonitor, struct mem_storage_t *mem_storage, long int cts, long int *prev_ts, int *count)
+{
+	if (segment_should_close(mem_storage, cts - *prev_ts)) {
+		/* handed to the pipeline by the caller once the datastore is unlocked */
+		close_mem_storage_deferred(mem_storage, 0);
+		*prev_ts = cts;
+		++(*count);
+	}
+
+	/* Initialize the file if not already done so */
+	if (!is_opened(mem_storage)) {
+		open_mem_storage(mem_storage, mixmonitor->autochan->chan->name, *count, cts);
+	}
+}
+
 static void *mixmonitor_thread(void *obj)
 {
 	struct mixmonitor *mixmonitor = obj;
 	long int prev_ts = 0;
 	int count = 0;
 	long int cts = 0;
+	int stereo;
+	int separate_legs;
 	struct mem_storage_t mem_storage;
+	struct vb_capture_stats capture_stats = { 0, };
+	struct timeval read_time;
 
 	ast_verb(2, "Begin VBMixMonitor Recording %s\n", mixmonitor->name);
 
 	if (!create_mem_storage(&mem_storage, mixmonitor->params)){
 		ast_log(LOG_ERROR, "Can't allocate memory for segment data storage\n");
 	}
+	stereo = (mem_storage.num_of_channels == 2);
+
+	mixmonitor->thread = pthread_self();
+	mixmonitor->mem_storage = &mem_storage;
+	AST_RWLIST_WRLOCK(&monitors);
+	AST_RWLIST_INSERT_TAIL(&monitors, mixmonitor, list);
+	AST_RWLIST_UNLOCK(&monitors);
+
+	/* Volume is adjusted per leg, so the legs are read separately and mixed here
+	 * instead of letting the core mix them with the scalar ast_frame_adjust_volume() */
+	parse_volume_options(mixmonitor, get_safe_object_strings(mem_storage.params, "options", NULL));
+	separate_legs = stereo || mixmonitor->read_volume || mixmonitor->write_volume;
 
 	/* The audiohook must enter and exit the loop locked */
 	ast_audiohook_lock(&mixmonitor->audiohook);
 	while (mixmonitor->audiohook.status == AST_AUDIOHOOK_STATUS_RUNNING && !mixmonitor->mixmonitor_ds->fs_quit) {
 		struct ast_frame *fr = NULL;
+		struct ast_frame *write_fr = NULL;
+
+		if (separate_legs) {
+			/* Read and write legs go to separate channels of the segment or get their own gain */
+			if (stereo_frames_ready(&mixmonitor->audiohook, SAMPLES_PER_FRAME)) {
+				fr = ast_audiohook_read_frame(&mixmonitor->audiohook, SAMPLES_PER_FRAME, AST_AUDIOHOOK_DIRECTION_READ, AST_FORMAT_SLINEAR);
+				write_fr = ast_audiohook_read_frame(&mixmonitor->audiohook, SAMPLES_PER_FRAME, AST_AUDIOHOOK_DIRECTION_WRITE, AST_FORMAT_SLINEAR);
+			}
+		} else {
+			fr = ast_audiohook_read_frame(&mixmonitor->audiohook, SAMPLES_PER_FRAME, AST_AUDIOHOOK_DIRECTION_BOTH, AST_FORMAT_SLINEAR);
+		}
 
-		if (!(fr = ast_audiohook_read_frame(&mixmonitor->audiohook, SAMPLES_PER_FRAME, AST_AUDIOHOOK_DIRECTION_BOTH, AST_FORMAT_SLINEAR))) {
+		if (!fr && !write_fr) {
 			ast_audiohook_trigger_wait(&mixmonitor->audiohook);
 
 			if (mixmonitor->audiohook.status != AST_AUDIOHOOK_STATUS_RUNNING) {
@@ -305,60 +495,104 @@ static void *mixmonitor_thread(void *obj)
 			continue;
 		}
 
+		read_time = ast_tvnow();
+		__atomic_store_n(&mixmonitor->read_backlog, ast_slinfactory_available(&mixmonitor->audiohook.read_factory), __ATOMIC_RELAXED);
+		__atomic_store_n(&mixmonitor->write_backlog, ast_slinfactory_available(&mixmonitor->audiohook.write_factory), __ATOMIC_RELAXED);
+		/* probe arguments are evaluated whether a tracer is attached or not, so only fields are read */
+		VB_PROBE2(frame__read, fr ? fr->samples : 0, write_fr ? write_fr->samples : 0);
+
 		/* audiohook lock is not required for the next block.
 		 * Unlock it, but remember to lock it before looping or exiting */
 		ast_audiohook_unlock(&mixmonitor->audiohook);
 
-		if ( 1 ) {
-			struct ast_frame *cur;
+		if (separate_legs) {
+			int samples = fr ? ast_codec_get_samples(fr) : ast_codec_get_samples(write_fr);
 
-			ast_mutex_lock(&mixmonitor->mixmonitor_ds->lock);
+			if (fr) {
+				vb_capture_stats_add(&capture_stats, fr->datalen);
+			}
+			if (write_fr) {
+				vb_capture_stats_add(&capture_stats, write_fr->datalen);
+			}
+			if (fr && mixmonitor->read_volume) {
+				vb_gain_s16(fr->data.ptr, ast_codec_get_samples(fr), mixmonitor->read_volume);
+			}
+			if (write_fr && mixmonitor->write_volume) {
+				vb_gain_s16(write_fr->data.ptr, ast_codec_get_samples(write_fr), mixmonitor->write_volume);
+			}
 
-			for (cur = fr; cur && !mixmonitor->mixmonitor_ds->fs_quit; cur = AST_LIST_NEXT(cur, frame_list)) {
+			ast_mutex_lock(&mixmonitor->mixmonitor_ds->lock);
 
-				if (cts - prev_ts > get_vb_segment_duration() * 1000 && (is_opened(&mem_storage))){
-					close_mem_storage(&mem_storage, 0);
-					ast_log(LOG_WARNING, "Closed file storage\n");
-					prev_ts = cts;
-					++count;
+			if (!mixmonitor->mixmonitor_ds->fs_quit) {
+				prepare_segment(mixmonitor, &mem_storage, cts, &prev_ts, &count);
+				if (stereo) {
+					put_data_stereo(&mem_storage, frame_samples(fr), frame_num_samples(fr),
+									frame_samples(write_fr), frame_num_samples(write_fr));
+				} else {
+					put_data_mixed(&mem_storage, frame_samples(fr), frame_num_samples(fr),
+								   frame_samples(write_fr), frame_num_samples(write_fr));
 				}
 
-				/* Initialize the file if not already done so */
-				if (!is_opened(&mem_storage)) {
-					open_mem_storage(&mem_storage, mixmonitor->autochan->chan->name, count, cts);
-				}
+				cts += samples * 1000 / 8000;
+			}
+
+			ast_mutex_unlock(&mixmonitor->mixmonitor_ds->lock);
+			submit_closed_segments(&mem_storage);
+		} else {
+			struct ast_frame *cur;
+
+			ast_mutex_lock(&mixmonitor->mixmonitor_ds->lock);
+
+			for (cur = fr; cur && !mixmonitor->mixmonitor_ds->fs_quit; cur = AST_LIST_NEXT(cur, frame_list)) {
+				vb_capture_stats_add(&capture_stats, cur->datalen);
 
-				put_data(&mem_storage, cur);
+				prepare_segment(mixmonitor, &mem_storage, cts, &prev_ts, &count);
+				put_data(&mem_storage, frame_samples(cur), frame_num_samples(cur));
 
 				cts += ast_codec_get_samples(cur) * 1000 / 8000; //we assume here that simple wav format always has 8kHz sample rate
 																	//and this is true while we ask AST_FORMAT_SLINEAR from hook
 			}
 
 			ast_mutex_unlock(&mixmonitor->mixmonitor_ds->lock);
+			submit_closed_segments(&mem_storage);
 		}
+		vb_histogram_record(&vb_hist_frame_store, ast_tvdiff_us(ast_tvnow(), read_time));
+
 		/* All done! free it. */
-		ast_frame_free(fr, 0);
+		if (fr) {
+			ast_frame_free(fr, 0);
+		}
+		if (write_fr) {
+			ast_frame_free(write_fr, 0);
+		}
 
 		ast_audiohook_lock(&mixmonitor->audiohook);
 	}
 
+	/* The listing locks the datastore, which is not held here */
+	AST_RWLIST_WRLOCK(&monitors);
+	AST_RWLIST_REMOVE(&monitors, mixmonitor, list);
+	AST_RWLIST_UNLOCK(&monitors);
+
 	if (!is_opened(&mem_storage)) {
 		open_mem_storage(&mem_storage, mixmonitor->autochan->chan->name, count,cts);
 		put_silence(&mem_storage, 8000);
 	}
 
 	if (is_opened(&mem_storage)){
-		close_mem_storage(&mem_storage, 1);
+		close_mem_storage_deferred(&mem_storage, 1);
 	}
 
-	destroy_mem_storage(&mem_storage);
-
 	/* Test Event */
 	ast_test_suite_event_notify("VBMIXMONITOR_END", "Channel: %s\r\n",
 									mixmonitor->autochan->chan->name);
 
 	ast_audiohook_unlock(&mixmonitor->audiohook);
 
+	/* submits the last segment, which may wait for the pipeline */
+	destroy_mem_storage(&mem_storage);
+	vb_capture_stats_flush(&capture_stats);
+
 	ast_autochan_destroy(mixmonitor->autochan);
 
 	/* Datastore cleanup.  close the filestream and wait for ds destruction */
@@ -372,6 +606,7 @@ static void *mixmonitor_thread(void *obj)
 	/* kill the audiohook */
 	destroy_monitor_audiohook(mixmonitor);
 
+	VB_PROBE2(monitor__stop, mixmonitor->name, count);
 	ast_verb(2, "End VBMixMonitor Recording %s\n", mixmonitor->name);
 	mixmonitor_free(mixmonitor);
 	return NULL;
@@ -407,7 +642,7 @@ static int setup_mixmonitor_ds(struct mixmonitor *mixmonitor, struct ast_channel
 	return 0;
 }
 
-static void launch_monitor_thread(struct ast_channel *chan, char* command_line)
+static void launch_monitor_thread(struct ast_channel *chan, const char* command_line)
 {
 	pthread_t thread;
 	struct mixmonitor *mixmonitor;
@@ -453,6 +688,7 @@ static void launch_monitor_thread(struct ast_channel *chan, char* command_line)
 		return;
 	}
 
+	VB_PROBE1(monitor__start, mixmonitor->name);
 	ast_pthread_create_detached_background(&thread, NULL, mixmonitor_thread, mixmonitor);
 }
 
@@ -501,6 +737,152 @@ static int stop_mixmonitor_exec(struct ast_channel *chan, const char *data)
 	return 0;
 }
 
+/*! \brief Segment events waiting for the manager event thread, at most this many */
+#define MANAGER_EVENT_QUEUE_LIMIT 1024
+
+struct segment_event {
+	struct vb_event event;
+	char channel[256];
+	char call_id[256];
+	AST_LIST_ENTRY(segment_event) list;
+};
+
+static AST_LIST_HEAD_NOLOCK(, segment_event) segment_events;
+AST_MUTEX_DEFINE_STATIC(segment_events_lock);
+static ast_cond_t segment_events_cond;
+static pthread_t segment_events_thread = AST_PTHREADT_NULL;
+static int segment_events_queued;
+static int segment_events_stop;
+static long long segment_events_dropped;
+
+/*!
+ * \internal
+ * \brief Event handler of the voicebase library
+ *
+ * Runs on the capture and upload threads. manager_event() takes the manager
+ * session locks and writes to every connected session, so the event is only
+ * copied here and sent by segment_events_main(). When the manager falls
+ * behind, events are dropped instead of holding up the caller.
+ */
+static void queue_segment_event(const struct vb_event *event)
+{
+	struct segment_event *queued;
+
+	if (!(queued = ast_calloc(1, sizeof(*queued)))) {
+		__atomic_fetch_add(&segment_events_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	queued->event = *event;
+	ast_copy_string(queued->channel, event->channel, sizeof(queued->channel));
+	ast_copy_string(queued->call_id, event->call_id, sizeof(queued->call_id));
+	queued->event.channel = queued->channel;
+	queued->event.call_id = queued->call_id;
+
+	ast_mutex_lock(&segment_events_lock);
+	if (segment_events_queued >= MANAGER_EVENT_QUEUE_LIMIT) {
+		ast_mutex_unlock(&segment_events_lock);
+		__atomic_fetch_add(&segment_events_dropped, 1, __ATOMIC_RELAXED);
+		ast_free(queued);
+		return;
+	}
+	AST_LIST_INSERT_TAIL(&segment_events, queued, list);
+	++segment_events_queued;
+	ast_cond_signal(&segment_events_cond);
+	ast_mutex_unlock(&segment_events_lock);
+}
+
+static void send_segment_event(const struct vb_event *event)
+{
+	switch (event->type) {
+	case VB_EVENT_SEGMENT_CLOSED:
+		manager_event(EVENT_FLAG_CALL, "VBSegmentClosed",
+			"Channel: %s\r\n"
+			"CallID: %s\r\n"
+			"Segment: %d\r\n"
+			"Final: %s\r\n"
+			"Bytes: %lld\r\n",
+			event->channel, event->call_id, event->segment, event->last ? "yes" : "no", event->bytes);
+		break;
+	case VB_EVENT_SEGMENT_UPLOADED:
+	case VB_EVENT_SEGMENT_FAILED:
+		manager_event(EVENT_FLAG_CALL, event->type == VB_EVENT_SEGMENT_UPLOADED ? "VBSegmentUploaded" : "VBSegmentFailed",
+			"Channel: %s\r\n"
+			"CallID: %s\r\n"
+			"Segment: %d\r\n"
+			"Final: %s\r\n"
+			"Bytes: %lld\r\n"
+			"QueueWait: %.3f\r\n"
+			"UploadTime: %.3f\r\n"
+			"CurlResult: %d\r\n"
+			"HTTPStatus: %ld\r\n",
+			event->channel, event->call_id, event->segment, event->last ? "yes" : "no", event->bytes,
+			event->queue_wait_us / 1000.0, event->upload_us / 1000.0, event->curl_result, event->http_status);
+		break;
+	case VB_EVENT_MONITOR_STOPPED:
+		manager_event(EVENT_FLAG_CALL, "VBMonitorStopped",
+			"Channel: %s\r\n"
+			"CallID: %s\r\n"
+			"Segments: %d\r\n"
+			"BytesUploaded: %lld\r\n"
+			"UploadsPending: %d\r\n",
+			event->channel, event->call_id, event->segment, event->bytes, event->uploads_in_flight);
+		break;
+	}
+}
+
+static void *segment_events_main(void *data)
+{
+	struct segment_event *queued;
+
+	ast_mutex_lock(&segment_events_lock);
+	for (;;) {
+		while (AST_LIST_EMPTY(&segment_events) && !segment_events_stop) {
+			ast_cond_wait(&segment_events_cond, &segment_events_lock);
+		}
+		/* Stop only once the queue is drained */
+		if (!(queued = AST_LIST_REMOVE_HEAD(&segment_events, list))) {
+			break;
+		}
+		--segment_events_queued;
+		ast_mutex_unlock(&segment_events_lock);
+
+		send_segment_event(&queued->event);
+		ast_free(queued);
+
+		ast_mutex_lock(&segment_events_lock);
+	}
+	ast_mutex_unlock(&segment_events_lock);
+	return NULL;
+}
+
+static void segment_events_start(void)
+{
+	ast_cond_init(&segment_events_cond, NULL);
+	segment_events_stop = 0;
+	if (ast_pthread_create_background(&segment_events_thread, NULL, segment_events_main, NULL)) {
+		ast_log(LOG_WARNING, "Failed to start the manager event thread, no segment events will be sent\n");
+		segment_events_thread = AST_PTHREADT_NULL;
+		return;
+	}
+	set_vb_event_handler(queue_segment_event);
+}
+
+static void segment_events_shutdown(void)
+{
+	set_vb_event_handler(NULL);
+	if (segment_events_thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	ast_mutex_lock(&segment_events_lock);
+	segment_events_stop = 1;
+	ast_cond_signal(&segment_events_cond);
+	ast_mutex_unlock(&segment_events_lock);
+	pthread_join(segment_events_thread, NULL);
+	segment_events_thread = AST_PTHREADT_NULL;
+	ast_cond_destroy(&segment_events_cond);
+}
+
+
 static char *handle_cli_mixmonitor(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	struct ast_channel *chan;
@@ -608,10 +990,280 @@ static int manager_mute_mixmonitor(struct mansession *s, const struct message *m
 	return AMI_SUCCESS;
 }
 
+static char *handle_cli_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct vb_stats stats;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "vbmixmonitor show stats";
+		e->usage =
+			"Usage: vbmixmonitor show stats\n"
+			"       Shows the module wide capture, segment and upload counters.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	vb_stats_snapshot(&stats);
+	ast_cli(a->fd, "Active monitors:     %lld\n", stats.active_monitors);
+	ast_cli(a->fd, "Frames captured:     %lld\n", stats.frames_captured);
+	ast_cli(a->fd, "Bytes captured:      %lld\n", stats.bytes_captured);
+	ast_cli(a->fd, "Segments opened:     %lld\n", stats.segments_opened);
+	ast_cli(a->fd, "Segments closed:     %lld\n", stats.segments_closed);
+	ast_cli(a->fd, "Segments uploaded:   %lld\n", stats.segments_uploaded);
+	ast_cli(a->fd, "Segments failed:     %lld\n", stats.segments_failed);
+	ast_cli(a->fd, "Bytes uploaded:      %lld\n", stats.bytes_uploaded);
+	ast_cli(a->fd, "Bytes truncated:     %lld\n", stats.bytes_truncated);
+	ast_cli(a->fd, "Buffered bytes:      %lld\n", stats.buffered_bytes);
+	ast_cli(a->fd, "Segment length:      %lld.%03lld s%s\n", stats.segment_length_ms / 1000, stats.segment_length_ms % 1000,
+			stats.segment_adaptive ? " (adaptive)" : "");
+	ast_cli(a->fd, "AMI events dropped:  %lld\n", __atomic_load_n(&segment_events_dropped, __ATOMIC_RELAXED));
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_show_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "vbmixmonitor show latency";
+		e->usage =
+			"Usage: vbmixmonitor show latency\n"
+			"       Shows percentiles of the capture, queue and upload latency\n"
+			"       histograms in milliseconds.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "%-32s %10s %10s %10s %10s %10s %10s\n", "Histogram", "Count", "p50", "p90", "p99", "p99.9", "Max");
+	for (i = 0; i < vb_num_histograms; ++i) {
+		const struct vb_histogram *hist = vb_histograms[i];
+		ast_cli(a->fd, "%-32s %10lld %10.3f %10.3f %10.3f %10.3f %10.3f\n", hist->name, hist->count,
+			vb_histogram_quantile(hist, 0.5) / 1000.0, vb_histogram_quantile(hist, 0.9) / 1000.0,
+			vb_histogram_quantile(hist, 0.99) / 1000.0, vb_histogram_quantile(hist, 0.999) / 1000.0,
+			hist->max / 1000.0);
+	}
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_export_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "vbmixmonitor export stats";
+		e->usage =
+			"Usage: vbmixmonitor export stats <file>\n"
+			"       Writes the counters and latency histograms in the Prometheus\n"
+			"       text format for the node exporter textfile collector, e.g.\n"
+			"       from cron: asterisk -rx \"vbmixmonitor export stats\n"
+			"       /var/lib/node_exporter/vbmixmonitor.prom\"\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	if (vb_stats_export_prometheus(a->argv[3])) {
+		ast_cli(a->fd, "Failed to write %s\n", a->argv[3]);
+		return CLI_FAILURE;
+	}
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_show_channels(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct mixmonitor *mixmonitor;
+	int count = 0;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "vbmixmonitor show channels";
+		e->usage =
+			"Usage: vbmixmonitor show channels\n"
+			"       Lists the running monitors with their current segment,\n"
+			"       segment buffer fill, audiohook backlog (read/write, in ms),\n"
+			"       segments waiting for upload, capture thread CPU time and\n"
+			"       bytes uploaded so far.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "%-32s %-24s %5s %5s %13s %8s %9s %12s\n",
+		"Channel", "Session", "Seg", "Fill", "Backlog", "Inflight", "CPU(s)", "Uploaded");
+
+	AST_RWLIST_RDLOCK(&monitors);
+	AST_RWLIST_TRAVERSE(&monitors, mixmonitor, list) {
+		struct mem_storage_t *mem_storage = mixmonitor->mem_storage;
+		char session_id[25];
+		char backlog[32];
+		int segment;
+		int fill;
+		int in_flight;
+		long long uploaded;
+		double cpu = -1;
+		clockid_t cid;
+		struct timespec ts;
+
+		/* The capture thread only touches the storage with the datastore locked */
+		ast_mutex_lock(&mixmonitor->mixmonitor_ds->lock);
+		ast_copy_string(session_id, mem_storage->session_id, sizeof(session_id));
+		segment = mem_storage->count;
+		fill = (is_opened(mem_storage) && mem_storage->buf_size) ? (int)((long long)mem_storage->pos * 100 / mem_storage->buf_size) : 0;
+		get_upload_stats(mem_storage, &in_flight, &uploaded);
+		ast_mutex_unlock(&mixmonitor->mixmonitor_ds->lock);
+
+		/* as of the last frame read */
+		snprintf(backlog, sizeof(backlog), "%u/%u",
+			__atomic_load_n(&mixmonitor->read_backlog, __ATOMIC_RELAXED) / 8,
+			__atomic_load_n(&mixmonitor->write_backlog, __ATOMIC_RELAXED) / 8);
+
+		if (!pthread_getcpuclockid(mixmonitor->thread, &cid) && !clock_gettime(cid, &ts)) {
+			cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+		}
+
+		ast_cli(a->fd, "%-32.32s %-24s %5d %4d%% %13s %8d %9.3f %12lld\n",
+			mixmonitor->name, session_id, segment, fill, backlog, in_flight, cpu, uploaded);
+		++count;
+	}
+	AST_RWLIST_UNLOCK(&monitors);
+
+	ast_cli(a->fd, "%d active monitor%s\n", count, count == 1 ? "" : "s");
+
+	return CLI_SUCCESS;
+}
+
+static void show_stage(int fd, const char *name, const struct vb_stage_stats *stats)
+{
+	ast_cli(fd, "%-8s %7d %7d %7d %12lu\n", name, stats->workers, stats->busy, stats->queued, stats->processed);
+}
+
+static char *handle_cli_show_pipeline(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct vb_stage_stats encode;
+	struct vb_stage_stats upload;
+	struct vb_tenant_stats tenants[32];
+	int num_tenants;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "vbmixmonitor show pipeline";
+		e->usage =
+			"Usage: vbmixmonitor show pipeline\n"
+			"       Shows the worker pools that encode and upload closed\n"
+			"       segments, with their busy workers and queue depth, and\n"
+			"       the uploads queued and running for each API key.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	vb_pipeline_get_stats(&encode, &upload);
+	ast_cli(a->fd, "%-8s %7s %7s %7s %12s\n", "Stage", "Workers", "Busy", "Queued", "Processed");
+	show_stage(a->fd, "encode", &encode);
+	show_stage(a->fd, "upload", &upload);
+
+	num_tenants = vb_pipeline_get_tenants(tenants, ARRAY_LEN(tenants));
+	if (num_tenants) {
+		ast_cli(a->fd, "\n%-12s %7s %7s %12s\n", "API key", "Queued", "Running", "KB running");
+		for (i = 0; i < num_tenants && i < ARRAY_LEN(tenants); ++i) {
+			ast_cli(a->fd, "%-12s %7d %7d %12lld\n", tenants[i].label, tenants[i].queued, tenants[i].running, tenants[i].running_cost / 1024);
+		}
+		if (num_tenants > ARRAY_LEN(tenants)) {
+			ast_cli(a->fd, "... and %d more\n", num_tenants - (int) ARRAY_LEN(tenants));
+		}
+	}
+
+	return CLI_SUCCESS;
+}
+
+/*! \brief Write the counters and histograms to a Prometheus textfile */
+static int manager_export_stats(struct mansession *s, const struct message *m)
+{
+	const char *file = astman_get_header(m, "File");
+
+	if (ast_strlen_zero(file)) {
+		astman_send_error(s, m, "No file specified");
+		return AMI_SUCCESS;
+	}
+
+	if (vb_stats_export_prometheus(file)) {
+		astman_send_error(s, m, "Cannot write file");
+		return AMI_SUCCESS;
+	}
+
+	astman_send_ack(s, m, "Statistics exported");
+
+	return AMI_SUCCESS;
+}
+
 static struct ast_cli_entry cli_mixmonitor[] = {
-	AST_CLI_DEFINE(handle_cli_mixmonitor, "Execute a VBMixMonitor command")
+	AST_CLI_DEFINE(handle_cli_mixmonitor, "Execute a VBMixMonitor command"),
+	AST_CLI_DEFINE(handle_cli_show_pipeline, "Show the VBMixMonitor segment pipeline"),
+	AST_CLI_DEFINE(handle_cli_show_stats, "Show VBMixMonitor statistics"),
+	AST_CLI_DEFINE(handle_cli_show_channels, "List the running VBMixMonitors"),
+	AST_CLI_DEFINE(handle_cli_show_latency, "Show VBMixMonitor latency percentiles"),
+	AST_CLI_DEFINE(handle_cli_export_stats, "Export VBMixMonitor statistics for Prometheus")
 };
 
+/*!
+ * \internal
+ * \brief Platform services of the voicebase library, routed to the Asterisk allocator and logger
+ */
+static void *vb_ast_calloc(size_t num, size_t size)
+{
+	return ast_calloc(num, size);
+}
+
+static void *vb_ast_malloc(size_t size)
+{
+	return ast_malloc(size);
+}
+
+static void vb_ast_free(void *ptr)
+{
+	ast_free(ptr);
+}
+
+static void vb_ast_log(int level, const char *file, int line, const char *function, const char *fmt, va_list ap)
+{
+	char *msg;
+
+	/* the VB_LOG_* levels are the __LOG_* levels */
+	if (ast_vasprintf(&msg, fmt, ap) < 0) {
+		return;
+	}
+	ast_log(level, file, line, function, "%s", msg);
+	ast_free(msg);
+}
+
+static const struct vb_platform vb_ast_platform = {
+	.calloc_fn = vb_ast_calloc,
+	.malloc_fn = vb_ast_malloc,
+	.free_fn = vb_ast_free,
+	.log_fn = vb_ast_log,
+};
 
 /*!
  * \internal \brief Load the configuration information
@@ -646,7 +1298,7 @@ static int load_configuration(int reload)
        in a single pass. */
     while ((cat = ast_category_browse(cfg, cat))) {
 
-        /* Our config file only has a general section for now */
+        /* Profiles are compiled below, once the general settings they inherit are known */
         if (strcasecmp(cat, "general")) {
             continue;
         }
@@ -679,6 +1331,158 @@ static int load_configuration(int reload)
             	set_vb_api_url(var->value);
             } else if (!strcasecmp(var->name, "title")) {
             	set_vb_title(var->value);
+            } else if (!strcasecmp(var->name, "stereo")) {
+            	set_vb_stereo(ast_true(var->value));
+            } else if (!strcasecmp(var->name, "segment_mode")) {
+            	set_vb_segment_mode(parse_segment_mode(var->value));
+            } else if (!strcasecmp(var->name, "segment_min_length")) {
+                int sl_temp;
+                if (sscanf(var->value, "%30d", &sl_temp) != 1 || sl_temp < 1 || sl_temp > 600) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for segment_min_length: must be between %d and %d\n",
+                    		var->value, 1, 600);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_segment_min_duration(sl_temp);
+            } else if (!strcasecmp(var->name, "segment_pause_ms")) {
+                int pause_temp;
+                if (sscanf(var->value, "%30d", &pause_temp) != 1 || pause_temp < 0 || pause_temp > 5000) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for segment_pause_ms: must be between %d and %d\n",
+                    		var->value, 0, 5000);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_segment_pause_ms(pause_temp);
+            } else if (!strcasecmp(var->name, "segment_stagger")) {
+            	set_vb_segment_stagger(ast_true(var->value));
+            } else if (!strcasecmp(var->name, "segment_adaptive")) {
+            	set_vb_segment_adaptive(ast_true(var->value));
+            } else if (!strcasecmp(var->name, "segment_adaptive_min")) {
+                int sl_temp;
+                if (sscanf(var->value, "%30d", &sl_temp) != 1 || sl_temp < 1 || sl_temp > 600) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for segment_adaptive_min: must be between %d and %d\n",
+                    		var->value, 1, 600);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_segment_adaptive_min(sl_temp);
+            } else if (!strcasecmp(var->name, "segment_adaptive_max")) {
+                int sl_temp;
+                if (sscanf(var->value, "%30d", &sl_temp) != 1 || sl_temp < 1 || sl_temp > 600) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for segment_adaptive_max: must be between %d and %d\n",
+                    		var->value, 1, 600);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_segment_adaptive_max(sl_temp);
+            } else if (!strcasecmp(var->name, "silence_elision")) {
+            	set_vb_silence_elision(parse_silence_elision(var->value));
+            } else if (!strcasecmp(var->name, "silence_keep_ms")) {
+                int keep_temp;
+                if (sscanf(var->value, "%30d", &keep_temp) != 1 || keep_temp < 0 || keep_temp > 10000) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for silence_keep_ms: must be between %d and %d\n",
+                    		var->value, 0, 10000);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_silence_keep_ms(keep_temp);
+            } else if (!strcasecmp(var->name, "hold_detection")) {
+            	set_vb_hold_detection(ast_true(var->value));
+            } else if (!strcasecmp(var->name, "hold_detect_ms")) {
+                int hold_temp;
+                if (sscanf(var->value, "%30d", &hold_temp) != 1 || hold_temp < 500 || hold_temp > 60000) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for hold_detect_ms: must be between %d and %d\n",
+                    		var->value, 500, 60000);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_hold_detect_ms(hold_temp);
+            } else if (!strcasecmp(var->name, "vad_threshold")) {
+                int thr_temp;
+                if (sscanf(var->value, "%30d", &thr_temp) != 1 || thr_temp < -90 || thr_temp > 0) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for vad_threshold: must be between %d and %d dBFS\n",
+                    		var->value, -90, 0);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_vad_threshold(thr_temp);
+            } else if (!strcasecmp(var->name, "sample_rate")) {
+                int rate_temp;
+                if (sscanf(var->value, "%30d", &rate_temp) != 1 || rate_temp < VB_MIN_SAMPLE_RATE || rate_temp > VB_MAX_SAMPLE_RATE) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for sample_rate: must be between %d and %d Hz\n",
+                    		var->value, VB_MIN_SAMPLE_RATE, VB_MAX_SAMPLE_RATE);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_sample_rate(rate_temp);
+            } else if (!strcasecmp(var->name, "encode_workers")) {
+                int workers_temp;
+                if (sscanf(var->value, "%30d", &workers_temp) != 1 || workers_temp < 1 || workers_temp > 64) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for encode_workers: must be between %d and %d\n",
+                    		var->value, 1, 64);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_encode_workers(workers_temp);
+            } else if (!strcasecmp(var->name, "upload_workers")) {
+                int workers_temp;
+                if (sscanf(var->value, "%30d", &workers_temp) != 1 || workers_temp < 1 || workers_temp > 256) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for upload_workers: must be between %d and %d\n",
+                    		var->value, 1, 256);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_upload_workers(workers_temp);
+            } else if (!strcasecmp(var->name, "pipeline_queue_limit")) {
+                int limit_temp;
+                if (sscanf(var->value, "%30d", &limit_temp) != 1 || limit_temp < 1 || limit_temp > 4096) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for pipeline_queue_limit: must be between %d and %d\n",
+                    		var->value, 1, 4096);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_pipeline_queue_limit(limit_temp);
+            } else if (!strcasecmp(var->name, "upload_max_per_key")) {
+                int uploads_temp;
+                if (sscanf(var->value, "%30d", &uploads_temp) != 1 || uploads_temp < 0 || uploads_temp > 256) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for upload_max_per_key: must be between %d and %d\n",
+                    		var->value, 0, 256);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_upload_max_per_key(uploads_temp);
+            } else if (!strcasecmp(var->name, "upload_max_bytes_per_key")) {
+                int bytes_temp;
+                if (sscanf(var->value, "%30d", &bytes_temp) != 1 || bytes_temp < 0) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for upload_max_bytes_per_key: must be 0 or more\n", var->value);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_upload_max_bytes_per_key(bytes_temp);
+            } else if (!strcasecmp(var->name, "trace_level")) {
+                int level_temp = parse_trace_level(var->value);
+                if (level_temp < 0) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for trace_level: must be off, call, segment or debug\n", var->value);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_trace_level(level_temp);
+            } else if (!strcasecmp(var->name, "trace_summary_interval")) {
+                int interval_temp;
+                if (sscanf(var->value, "%30d", &interval_temp) != 1 || interval_temp < 0 || interval_temp > 86400) {
+                    ast_log(AST_LOG_WARNING, "Invalid value %s for trace_summary_interval: must be between %d and %d\n",
+                    		var->value, 0, 86400);
+                    res = 1;
+                    goto cleanup;
+                }
+                set_vb_trace_summary_interval(interval_temp);
+            } else if (!strcasecmp(var->name, "trace_timeline")) {
+            	set_vb_trace_timeline(ast_true(var->value));
+            } else if (!strcasecmp(var->name, "trace_dir")) {
+            	set_vb_trace_dir(var->value);
+            	if (!ast_strlen_zero(var->value) && ast_mkdir(var->value, 0755)) {
+            		ast_log(AST_LOG_WARNING, "Can't create trace_dir %s, timelines will not be written\n", var->value);
+            	}
             } else {
                 ast_log(AST_LOG_WARNING, "Unknown configuration key %s\n", var->name);
             }
@@ -687,8 +1491,62 @@ static int load_configuration(int reload)
         }
     }
 
+    /* Every other section is a profile, selected by the dialplan with its name */
+    cat = NULL;
+    while ((cat = ast_category_browse(cfg, cat))) {
+        struct vb_profile profile;
+
+        if (!strcasecmp(cat, "general")) {
+            continue;
+        }
+        if (strlen(cat) >= sizeof(profile.name) || *cat == '{') {
+            ast_log(AST_LOG_WARNING, "Invalid profile name [%s]\n", cat);
+            res = 1;
+            goto cleanup;
+        }
+
+        init_vb_profile(&profile, cat);
+        for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+            if (!strcasecmp(var->name, "api_key")) {
+                ast_copy_string(profile.api_key, var->value, sizeof(profile.api_key));
+            } else if (!strcasecmp(var->name, "password")) {
+                ast_copy_string(profile.password, var->value, sizeof(profile.password));
+            } else if (!strcasecmp(var->name, "public")) {
+                ast_copy_string(profile.pub, var->value, sizeof(profile.pub));
+            } else if (!strcasecmp(var->name, "callback_url")) {
+                ast_copy_string(profile.callback_url, var->value, sizeof(profile.callback_url));
+            } else if (!strcasecmp(var->name, "api_url")) {
+                ast_copy_string(profile.api_url, var->value, sizeof(profile.api_url));
+            } else if (!strcasecmp(var->name, "title")) {
+                ast_copy_string(profile.title, var->value, sizeof(profile.title));
+            } else if (!strcasecmp(var->name, "transcript_type")) {
+                ast_copy_string(profile.transcript_type, var->value, sizeof(profile.transcript_type));
+            } else if (!strcasecmp(var->name, "lang")) {
+                ast_copy_string(profile.lang, var->value, sizeof(profile.lang));
+            } else {
+                ast_log(AST_LOG_WARNING, "Unknown configuration key %s in profile [%s]\n", var->name, cat);
+            }
+        }
+        if (add_vb_profile(&profile)) {
+            ast_log(AST_LOG_WARNING, "Failed to add profile [%s]\n", cat);
+            res = 1;
+            goto cleanup;
+        }
+    }
+
 cleanup:
     ast_config_destroy(cfg);
+    if (!res) {
+        /* Calls started from now on use the new settings, running ones keep theirs */
+        res = vb_config_apply();
+    }
+    if (res) {
+        if (reload) {
+            ast_log(LOG_WARNING, "Keeping the previous VBMixMonitor configuration\n");
+        }
+        /* Drops the rejected settings, nothing reads them before the next load */
+        set_defaults();
+    }
     return res;
 }
 
@@ -700,29 +1558,48 @@ static int unload_module(void)
 	res = ast_unregister_application(stop_app);
 	res |= ast_unregister_application(app);
 	res |= ast_manager_unregister("VBMixMonitorMute");
+	res |= ast_manager_unregister("VBMixMonitorExportStats");
+
+	/* Waits for the queued segments to be uploaded */
+	vb_pipeline_stop();
+	segment_events_shutdown();
 
 	return res;
 }
 
+static int reload_module(void)
+{
+	return load_configuration(1);
+}
+
 static int load_module(void)
 {
 	int res;
 	
+	vb_platform_set(&vb_ast_platform);
+
+	/* Nothing is registered or started without a valid configuration */
+	if (load_configuration(0)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
 	ast_log(LOG_NOTICE,"VBMixMonitor loaded\n");
 
+	curl_global_init(CURL_GLOBAL_ALL);
+	segment_events_start();
+	vb_pipeline_start();
+
 	ast_cli_register_multiple(cli_mixmonitor, ARRAY_LEN(cli_mixmonitor));
 	res = ast_register_application_xml(app, mixmonitor_exec);
 	res |= ast_register_application_xml(stop_app, stop_mixmonitor_exec);
 	res |= ast_manager_register_xml("VBMixMonitorMute", 0, manager_mute_mixmonitor);
-
-	if (load_configuration(0)) {
-		res |= AST_MODULE_LOAD_DECLINE;
-	}else
-		res |= AST_MODULE_LOAD_SUCCESS;
-		
-	curl_global_init(CURL_GLOBAL_ALL);
+	res |= ast_manager_register_xml("VBMixMonitorExportStats", EVENT_FLAG_SYSTEM, manager_export_stats);
+	res |= AST_MODULE_LOAD_SUCCESS;
 
 	return res;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Voicebase Mixed Audio Monitoring Application");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Voicebase Mixed Audio Monitoring Application",
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+);
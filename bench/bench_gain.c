@@ -0,0 +1,70 @@
+/* Gain kernel benchmark: vb_gain_s16() against the scalar loop of
+ * ast_frame_adjust_volume() on 20ms (160 sample) slin frames.
+ *
+ * gcc -O2 -I.. -o bench_gain bench_gain.c ../vb_dsp.c -lm && ./bench_gain
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vb_dsp.h"
+
+#define FRAME_SAMPLES	160
+#define ITERATIONS		2000000
+
+/* copy of the sample loop in ast_frame_adjust_volume() */
+static void adjust_volume_scalar(short* samples, int num_samples, int adjustment){
+	int count;
+	for (count = 0; count < num_samples; count++){
+		if (adjustment > 0){
+			int res = samples[count] * abs(adjustment);
+			samples[count] = res > 32767 ? 32767 : (res < -32768 ? -32768 : res);
+		}else{
+			samples[count] = samples[count] / abs(adjustment);
+		}
+	}
+}
+
+static double now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void fill(short* s, int n){
+	int i;
+	for (i = 0; i < n; ++i)
+		s[i] = (short)(rand() % 65536 - 32768);
+}
+
+int main(void){
+	static const int factors[] = {2, 4, 16, -2, -16};
+	short frame[FRAME_SAMPLES];
+	unsigned i, f;
+	volatile short sink = 0;
+
+	srand(1);
+	printf("%-8s %14s %14s %8s\n", "factor", "scalar ns/fr", "simd ns/fr", "speedup");
+	for (f = 0; f < sizeof(factors) / sizeof(factors[0]); ++f){
+		double t0, scalar, simd;
+
+		fill(frame, FRAME_SAMPLES);
+		t0 = now_ns();
+		for (i = 0; i < ITERATIONS; ++i){
+			adjust_volume_scalar(frame, FRAME_SAMPLES, factors[f]);
+			sink ^= frame[i % FRAME_SAMPLES];
+		}
+		scalar = (now_ns() - t0) / ITERATIONS;
+
+		fill(frame, FRAME_SAMPLES);
+		t0 = now_ns();
+		for (i = 0; i < ITERATIONS; ++i){
+			vb_gain_s16(frame, FRAME_SAMPLES, factors[f]);
+			sink ^= frame[i % FRAME_SAMPLES];
+		}
+		simd = (now_ns() - t0) / ITERATIONS;
+
+		printf("%-8d %14.1f %14.1f %7.1fx\n", factors[f], scalar, simd, scalar / simd);
+	}
+	return sink & 0;
+}
@@ -0,0 +1,142 @@
+/* cJSON benchmark: cJSON_Parse against cJSON_ParseArena (parse and delete)
+ * on the call params and on a larger response-like document, and key lookups
+ * by scan against the index of cJSON_IndexObject on objects of growing size.
+ * "params resolve" is what a call start does: parse the params and look up
+ * every key the module reads.
+ *
+ * make bench && ./bench/bench_json
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+
+#define ITERATIONS		200000
+#define LOOKUPS			1000000
+
+static const char* params_json =
+	"{\"apikey\":\"0123456789abcdef\",\"pw\":\"secret\",\"title\":\"Support call\","
+	"\"callId\":\"SIP/provider-00000a1b\",\"public\":\"false\",\"rtCallbackUrl\":\"https://example.com/voicebase/callback\","
+	"\"lang\":\"en\",\"externalId\":\"ticket-4711\",\"ownerId\":\"agent42\",\"transcriptType\":\"machine\","
+	"\"stereo\":false,\"segmentMode\":\"pause\",\"silenceElision\":\"compress\",\"options\":\"v(1)\"}";
+
+/* the keys create_mem_storage() and the upload form read */
+static const char* const params_keys[] = {
+	"profile", "trace", "traceTimeline", "stereo", "segmentMode", "silenceElision", "holdDetection",
+	"sampleRate", "apikey", "pw", "title", "callId", "public", "rtCallbackUrl", "desc", "lang",
+	"sourceUrl", "recordedDate", "externalId", "ownerId", "autoCreate", "humanRush", "transcriptType",
+};
+#define NUM_PARAMS_KEYS	(sizeof(params_keys) / sizeof(params_keys[0]))
+
+static char response_json[16384];
+static char object_json[65536];
+
+static double now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* like an API answer: status, a few fields and an array of word objects */
+static void build_response(){
+	int len, i;
+
+	len = snprintf(response_json, sizeof(response_json),
+			"{\"requestStatus\":\"SUCCESS\",\"statusMessage\":\"The request was processed successfully\","
+			"\"mediaId\":\"0f1e2d3c4b5a69788796a5b4c3d2e1f0\",\"fileUrl\":\"https://example.com/media/0f1e2d3c\",\"words\":[");
+	for (i = 0; i < 60; ++i)
+		len += snprintf(response_json + len, sizeof(response_json) - len, "%s{\"w\":\"word%d\",\"s\":%d.%03d,\"e\":%d.%03d,\"c\":0.9%d}",
+				i ? "," : "", i, i / 2, i * 37 % 1000, i / 2, i * 53 % 1000, i % 10);
+	snprintf(response_json + len, sizeof(response_json) - len, "]}");
+}
+
+static void build_object(int keys){
+	int len, i;
+
+	len = snprintf(object_json, sizeof(object_json), "{");
+	for (i = 0; i < keys; ++i)
+		len += snprintf(object_json + len, sizeof(object_json) - len, "%s\"someField%d\":\"value %d\"", i ? "," : "", i, i);
+	snprintf(object_json + len, sizeof(object_json) - len, "}");
+}
+
+static double bench_parse(const char* json, cJSON* (*parse)(const char*)){
+	double start = now_ns();
+	int i;
+
+	for (i = 0; i < ITERATIONS; ++i)
+		cJSON_Delete(parse(json));
+	return (now_ns() - start) / ITERATIONS;
+}
+
+static double bench_resolve(cJSON* (*parse)(const char*), int index){
+	double start = now_ns();
+	volatile long found = 0;
+	unsigned i, k;
+
+	for (i = 0; i < ITERATIONS; ++i){
+		cJSON* params = parse(params_json);
+		if (index)
+			cJSON_IndexObject(params);
+		for (k = 0; k < NUM_PARAMS_KEYS; ++k)
+			found += cJSON_GetObjectItem(params, params_keys[k]) != NULL;
+		cJSON_Delete(params);
+	}
+	return (now_ns() - start) / ITERATIONS;
+}
+
+/* looks up every key in turn, plus one that is missing */
+static double bench_lookup(cJSON* object, int keys){
+	char names[257][32];
+	volatile long found = 0;
+	double start;
+	int i;
+
+	for (i = 0; i < keys; ++i)
+		snprintf(names[i], sizeof(names[i]), "somefield%d", i);
+	snprintf(names[keys], sizeof(names[keys]), "missing");
+	start = now_ns();
+	for (i = 0; i < LOOKUPS; ++i)
+		found += cJSON_GetObjectItem(object, names[i % (keys + 1)]) != NULL;
+	return (now_ns() - start) / LOOKUPS;
+}
+
+int main(void){
+	static const int sizes[] = {4, 16, 64, 256};
+	double heap, arena, plain, indexed;
+	unsigned i;
+
+	build_response();
+
+	printf("%-22s %12s %12s %8s\n", "parse + delete", "malloc ns", "arena ns", "speedup");
+	heap = bench_parse(params_json, cJSON_Parse);
+	arena = bench_parse(params_json, cJSON_ParseArena);
+	printf("%-22s %12.1f %12.1f %7.2fx\n", "params", heap, arena, heap / arena);
+	heap = bench_parse(response_json, cJSON_Parse);
+	arena = bench_parse(response_json, cJSON_ParseArena);
+	printf("%-22s %12.1f %12.1f %7.2fx\n", "response", heap, arena, heap / arena);
+
+	printf("\n%-22s %12s %12s %8s\n", "params resolve", "scan ns", "index ns", "speedup");
+	plain = bench_resolve(cJSON_Parse, 0);
+	printf("%-22s %12.1f %12s %8s\n", "malloc", plain, "", "");
+	arena = bench_resolve(cJSON_ParseArena, 0);
+	indexed = bench_resolve(cJSON_ParseArena, 1);
+	printf("%-22s %12.1f %12.1f %7.2fx\n", "arena", arena, indexed, arena / indexed);
+
+	printf("\n%-22s %12s %12s %8s\n", "lookup", "scan ns", "index ns", "speedup");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i){
+		cJSON* object;
+		char name[32];
+
+		build_object(sizes[i]);
+		object = cJSON_ParseArena(object_json);
+		plain = bench_lookup(object, sizes[i]);
+		cJSON_IndexObject(object);
+		indexed = bench_lookup(object, sizes[i]);
+		cJSON_Delete(object);
+		snprintf(name, sizeof(name), "%d keys", sizes[i]);
+		printf("%-22s %12.1f %12.1f %7.2fx\n", name, plain, indexed, plain / indexed);
+	}
+	return 0;
+}
@@ -0,0 +1,258 @@
+/* Segment storage benchmark: the per frame capture path (put_data*, put_silence),
+ * the WAV header writer, segment open/close with a no-op transport, the
+ * multipart template of a call, the form of each upload and the parsing of
+ * the call params.
+ *
+ * Every case runs warm (the same buffers over and over, so they stay in cache)
+ * and cold (the caches are swept before each operation, like a capture thread
+ * woken up among thousands of other calls). Reports ns per operation and the
+ * bytes/s of audio (JSON for the params case) it handles. The library logger is
+ * silenced, so the numbers do not include log formatting.
+ *
+ * make bench && ./bench/bench_storage
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+#include "vb_platform.h"
+#include "voicebase.h"
+
+#define FRAME_SAMPLES		160			//20ms at 8 kHz
+#define WARM_ITERATIONS		200000
+#define COLD_ITERATIONS		500
+#define EVICT_SIZE			(32 << 20)	//larger than the last level cache
+#define SEGMENT_SECONDS		10			//audio in the segments of the open/close and form cases
+
+static const char* params_json =
+	"{\"apikey\":\"0123456789abcdef\",\"pw\":\"secret\",\"title\":\"Support call\","
+	"\"callId\":\"SIP/provider-00000a1b\",\"public\":\"false\",\"rtCallbackUrl\":\"https://example.com/voicebase/callback\","
+	"\"lang\":\"en\",\"externalId\":\"ticket-4711\",\"ownerId\":\"agent42\",\"transcriptType\":\"machine\","
+	"\"stereo\":false,\"segmentMode\":\"pause\",\"silenceElision\":\"compress\",\"options\":\"v(1)\"}";
+
+static short frame[2][FRAME_SAMPLES];
+static char* evict_buf;
+static struct mem_storage_t storage;
+static char* wav;
+static int wav_size;
+static char header[64];
+static struct vb_upload_form form;
+
+static int noop_transport(const struct vb_upload_form* form, char* status_str, int status_max_size, long* http_status){
+	status_str[0] = 0;
+	*http_status = 200;
+	return 0;
+}
+
+static void quiet_log(int level, const char* file, int line, const char* function, const char* fmt, va_list ap){
+}
+
+static long long now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void evict_caches(){
+	int i;
+	for (i = 0; i < EVICT_SIZE; i += 64)
+		evict_buf[i]++;
+}
+
+static void open_storage(const char* params){
+	set_vb_segment_duration(120);
+	vb_config_apply();
+	create_mem_storage(&storage, params);
+	open_mem_storage(&storage, "SIP/bench-00000001", 0, 0);
+}
+
+//keeps the capture cases from running into the end of the segment buffer
+static void rewind_storage(){
+	if (storage.pos + FRAME_SAMPLES * 2 * 2 * 6 > storage.buf_size)
+		storage.pos = storage.wav_header_size;
+}
+
+static void setup_mono()		{ open_storage("{}"); }
+static void setup_resample()	{ open_storage("{\"sampleRate\":16000}"); }
+static void setup_stereo()		{ open_storage("{\"stereo\":true}"); }
+static void setup_elision()		{ open_storage("{\"silenceElision\":\"compress\",\"holdDetection\":true}"); }
+static void teardown_storage()	{ destroy_mem_storage(&storage); }
+
+static void run_put_data(){
+	rewind_storage();
+	put_data(&storage, frame[0], FRAME_SAMPLES);
+}
+
+static void run_put_data_mixed(){
+	rewind_storage();
+	put_data_mixed(&storage, frame[0], FRAME_SAMPLES, frame[1], FRAME_SAMPLES);
+}
+
+static void run_put_data_stereo(){
+	rewind_storage();
+	put_data_stereo(&storage, frame[0], FRAME_SAMPLES, frame[1], FRAME_SAMPLES);
+}
+
+static void run_put_silence(){
+	rewind_storage();
+	put_silence(&storage, FRAME_SAMPLES);
+}
+
+static void run_wav_header(){
+	int size = write_wav_header(header, sizeof(header), 8000, 16, 1);
+	wav_header_data_size_fix(header, size + FRAME_SAMPLES * 2);
+}
+
+static void setup_segment(){
+	set_vb_segment_duration(SEGMENT_SECONDS);
+	vb_config_apply();
+	create_mem_storage(&storage, params_json);
+}
+
+static void run_open_close(){
+	open_mem_storage(&storage, "SIP/bench-00000001", 1, 0);
+	storage.pos = storage.buf_size - 8000 * 2;		//as if SEGMENT_SECONDS of audio were captured
+	close_mem_storage(&storage, 0);
+}
+
+static void setup_form(){
+	wav_size = SEGMENT_SECONDS * 8000 * 2 + 44;
+	wav = calloc(1, wav_size);
+	write_wav_header(wav, wav_size, 8000, 16, 1);
+
+	form.version 		= "1.1";
+	form.apikey 		= "0123456789abcdef";
+	form.password 		= "secret";
+	form.action 		= "uploadMedia";
+	form.callID 		= "bench-00000001_10.0.0.1_1700000000";
+	form.segmentNumber 	= "3";
+	form.finalSegment 	= "false";
+	form.rtCallbackURL 	= "https://example.com/voicebase/callback";
+	form.content_name 	= "bench-00000001_10.0.0.1_1700000000_3.wav";
+	form.content_buff 	= wav;
+	form.content_size 	= wav_size;
+	form.pub 			= "false";
+	form.title 			= "Support call";
+	form.time_str 		= "360.0";
+	form.lang 			= "en";
+	form.externalId 	= "ticket-4711";
+	form.ownerId 		= "agent42";
+	form.transcriptType = "machine";
+	form.offsetMap 		= "[[1200,4800],[52000,61000]]";
+}
+
+static void teardown_form(){
+	free(wav);
+}
+
+static void setup_template(){
+	setup_form();
+	form.tmpl = vb_form_template_create(&form);
+}
+
+static void teardown_template(){
+	vb_form_template_free((struct vb_form_template*)form.tmpl);
+	form.tmpl = NULL;
+	teardown_form();
+}
+
+static void run_form_template(){
+	vb_form_template_free(vb_form_template_create(&form));
+}
+
+static void run_form(){
+	struct vb_upload_body body;
+	vb_upload_body_init(&body, form.tmpl, &form);
+}
+
+static void run_params(){
+	cJSON* params = cJSON_ParseArena(params_json);
+	cJSON_IndexObject(params);
+	get_safe_object_strings(params, "apikey", NULL);
+	get_safe_object_strings(params, "callId", NULL);
+	get_safe_object_strings(params, "rtCallbackUrl", NULL);
+	get_safe_object_strings(params, "transcriptType", NULL);
+	cJSON_Delete(params);
+}
+
+struct bench_case{
+	const char*	name;
+	void		(*setup)();
+	void		(*run)();
+	void		(*teardown)();
+	long		bytes;		//handled by one run
+};
+
+static void run_case(const struct bench_case* c, int cold){
+	int iterations = cold ? COLD_ITERATIONS : WARM_ITERATIONS;
+	long long total = 0;
+	long long start;
+	double ns;
+	int i;
+
+	if (c->setup)
+		c->setup();
+	for (i = 0; i < 100; ++i)
+		c->run();
+
+	if (cold){
+		for (i = 0; i < iterations; ++i){
+			evict_caches();
+			start = now_ns();
+			c->run();
+			total += now_ns() - start;
+		}
+	}else{
+		start = now_ns();
+		for (i = 0; i < iterations; ++i)
+			c->run();
+		total = now_ns() - start;
+	}
+	if (c->teardown)
+		c->teardown();
+
+	ns = (double)total / iterations;
+	printf("%-24s %-5s %10.1f ns/op %10.1f MB/s\n", c->name, cold ? "cold" : "warm", ns, c->bytes / ns * 1e3);
+}
+
+int main(){
+	static const struct vb_platform platform = { NULL, NULL, NULL, quiet_log };
+	struct bench_case cases[] = {
+		{ "put_data", 				setup_mono, 	run_put_data, 			teardown_storage, 	FRAME_SAMPLES * 2 },
+		{ "put_data 16kHz", 		setup_resample, run_put_data, 			teardown_storage, 	FRAME_SAMPLES * 2 },
+		{ "put_data elision+hold", 	setup_elision, 	run_put_data, 			teardown_storage, 	FRAME_SAMPLES * 2 },
+		{ "put_data_mixed", 		setup_mono, 	run_put_data_mixed, 	teardown_storage, 	FRAME_SAMPLES * 4 },
+		{ "put_data_stereo", 		setup_stereo, 	run_put_data_stereo, 	teardown_storage, 	FRAME_SAMPLES * 4 },
+		{ "put_silence", 			setup_mono, 	run_put_silence, 		teardown_storage, 	FRAME_SAMPLES * 2 },
+		{ "wav header", 			NULL, 			run_wav_header, 		NULL, 				44 },
+		{ "segment open/close", 	setup_segment, 	run_open_close, 		teardown_storage, 	SEGMENT_SECONDS * 8000 * 2 },
+		{ "form template", 			setup_form, 	run_form_template, 		teardown_form, 		0 },
+		{ "upload form", 			setup_template, run_form, 				teardown_template, 	SEGMENT_SECONDS * 8000 * 2 + 44 },
+		{ "params parse", 			NULL, 			run_params, 			NULL, 				0 },
+	};
+	int i;
+
+	vb_platform_set(&platform);
+	set_defaults();
+	set_vb_transport(noop_transport);
+	evict_buf = calloc(1, EVICT_SIZE);
+
+	srand(1);
+	for (i = 0; i < FRAME_SAMPLES; ++i){
+		frame[0][i] = (short)((rand() % 8192) - 4096);
+		frame[1][i] = (short)((rand() % 8192) - 4096);
+	}
+
+	//the params, the last case, are measured in bytes of JSON
+	cases[sizeof(cases) / sizeof(cases[0]) - 1].bytes = strlen(params_json);
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i){
+		run_case(&cases[i], 0);
+		run_case(&cases[i], 1);
+	}
+
+	free(evict_buf);
+	return 0;
+}
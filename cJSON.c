@@ -77,6 +77,41 @@ static cJSON *cJSON_New_Item()
 	return node;
 }
 
+/* Block of a document parsed by cJSON_ParseArena: the root item first, then the other items and the strings as they are parsed. */
+typedef struct {char *next,*end;} cJSON_Arena;
+#define ARENA_ITEM	1
+#define ARENA_ROOT	2	/* the item is the start of the block */
+
+/* The parser allocates from the arena when there is one, from the heap otherwise. */
+static void *parse_alloc(cJSON_Arena *arena,size_t sz)
+{
+	char *p;
+	if (!arena) return cJSON_malloc(sz);
+	sz=(sz+7)&~(size_t)7;
+	if ((size_t)(arena->end-arena->next)<sz) return 0;
+	p=arena->next;arena->next+=sz;
+	return p;
+}
+
+static cJSON *parse_new_item(cJSON_Arena *arena)
+{
+	cJSON* node = (cJSON*)parse_alloc(arena,sizeof(cJSON));
+	if (node) {memset(node,0,sizeof(cJSON));if (arena) node->arena=ARENA_ITEM;}
+	return node;
+}
+
+/* Open addressing table of the items of an object. Like the scan, the first of duplicate keys wins. */
+struct cJSON_Index {unsigned mask;cJSON *slots[1];};
+
+static unsigned cJSON_strcasehash(const char *s)
+{
+	unsigned h=2166136261u;
+	for (;*s;s++) h=(h^(unsigned)tolower(*s))*16777619u;
+	return h;
+}
+
+static void drop_index(cJSON *object) {if (object->index) {cJSON_free(object->index);object->index=0;}}
+
 /* Delete a cJSON structure. */
 void cJSON_Delete(cJSON *c)
 {
@@ -85,9 +120,14 @@ void cJSON_Delete(cJSON *c)
 	{
 		next=c->next;
 		if (!(c->type&cJSON_IsReference) && c->child) cJSON_Delete(c->child);
-		if (!(c->type&cJSON_IsReference) && c->valuestring) cJSON_free(c->valuestring);
-		if (c->string) cJSON_free(c->string);
-		cJSON_free(c);
+		if (c->index) cJSON_free(c->index);
+		if (!c->arena)
+		{
+			if (!(c->type&cJSON_IsReference) && c->valuestring) cJSON_free(c->valuestring);
+			if (c->string) cJSON_free(c->string);
+			cJSON_free(c);
+		}
+		else if (c->arena==ARENA_ROOT) cJSON_free(c);	/* the whole document */
 		c=next;
 	}
 }
@@ -140,14 +180,14 @@ static char *print_number(cJSON *item)
 
 /* Parse the input text into an unescaped cstring, and populate item. */
 static const unsigned char firstByteMark[7] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC };
-static const char *parse_string(cJSON *item,const char *str)
+static const char *parse_string(cJSON *item,const char *str,cJSON_Arena *arena)
 {
 	const char *ptr=str+1;char *ptr2;char *out;int len=0;unsigned uc;
 	if (*str!='\"') {ep=str;return 0;}	/* not a string! */
 	
 	while (*ptr!='\"' && *ptr && ++len) if (*ptr++ == '\\') ptr++;	/* Skip escaped quotes. */
 	
-	out=(char*)cJSON_malloc(len+1);	/* This is how long we need for the string, roughly. */
+	out=(char*)parse_alloc(arena,len+1);	/* This is how long we need for the string, roughly. */
 	if (!out) return 0;
 	
 	ptr=str+1;ptr2=out;
@@ -226,11 +266,11 @@ static char *print_string_ptr(const char *str)
 static char *print_string(cJSON *item)	{return print_string_ptr(item->valuestring);}
 
 /* Predeclare these prototypes. */
-static const char *parse_value(cJSON *item,const char *value);
+static const char *parse_value(cJSON *item,const char *value,cJSON_Arena *arena);
 static char *print_value(cJSON *item,int depth,int fmt);
-static const char *parse_array(cJSON *item,const char *value);
+static const char *parse_array(cJSON *item,const char *value,cJSON_Arena *arena);
 static char *print_array(cJSON *item,int depth,int fmt);
-static const char *parse_object(cJSON *item,const char *value);
+static const char *parse_object(cJSON *item,const char *value,cJSON_Arena *arena);
 static char *print_object(cJSON *item,int depth,int fmt);
 
 /* Utility to jump whitespace and cr/lf */
@@ -243,7 +283,41 @@ cJSON *cJSON_Parse(const char *value)
 	ep=0;
 	if (!c) return 0;       /* memory fail */
 
-	if (!parse_value(c,skip(value))) {cJSON_Delete(c);return 0;}
+	if (!parse_value(c,skip(value),0)) {cJSON_Delete(c);return 0;}
+	return c;
+}
+
+/* Upper bound of the arena of a document: every item but the root follows a comma or an opening bracket,
+   and a string never takes more than its quoted text (plus the alignment). */
+static size_t arena_size(const char *value)
+{
+	size_t items=1,strings=0;const char *p=value;
+	for (;*p;p++)
+	{
+		if (*p=='\"')
+		{
+			strings++;
+			for (p++;*p && *p!='\"';p++) if (*p=='\\' && p[1]) p++;
+			if (!*p) break;
+		}
+		else if (*p==',' || *p=='[' || *p=='{') items++;
+	}
+	return items*sizeof(cJSON)+(p-value)+strings*8;
+}
+
+cJSON *cJSON_ParseArena(const char *value)
+{
+	cJSON_Arena arena;cJSON *c;char *block;size_t size;
+	ep=0;
+	if (!value) return 0;
+	size=arena_size(value);
+	if (!(block=(char*)cJSON_malloc(size))) return 0;       /* memory fail */
+	arena.next=block;arena.end=block+size;
+
+	c=parse_new_item(&arena);
+	if (!c) {cJSON_free(block);return 0;}       /* block too small for the root */
+	c->arena=ARENA_ROOT;
+	if (!parse_value(c,skip(value),&arena)) {cJSON_Delete(c);return 0;}
 	return c;
 }
 
@@ -252,16 +326,16 @@ char *cJSON_Print(cJSON *item)				{return print_value(item,0,1);}
 char *cJSON_PrintUnformatted(cJSON *item)	{return print_value(item,0,0);}
 
 /* Parser core - when encountering text, process appropriately. */
-static const char *parse_value(cJSON *item,const char *value)
+static const char *parse_value(cJSON *item,const char *value,cJSON_Arena *arena)
 {
 	if (!value)						return 0;	/* Fail on null. */
 	if (!strncmp(value,"null",4))	{ item->type=cJSON_NULL;  return value+4; }
 	if (!strncmp(value,"false",5))	{ item->type=cJSON_False; return value+5; }
 	if (!strncmp(value,"true",4))	{ item->type=cJSON_True; item->valueint=1;	return value+4; }
-	if (*value=='\"')				{ return parse_string(item,value); }
+	if (*value=='\"')				{ return parse_string(item,value,arena); }
 	if (*value=='-' || (*value>='0' && *value<='9'))	{ return parse_number(item,value); }
-	if (*value=='[')				{ return parse_array(item,value); }
-	if (*value=='{')				{ return parse_object(item,value); }
+	if (*value=='[')				{ return parse_array(item,value,arena); }
+	if (*value=='{')				{ return parse_object(item,value,arena); }
 
 	ep=value;return 0;	/* failure. */
 }
@@ -285,7 +359,7 @@ static char *print_value(cJSON *item,int depth,int fmt)
 }
 
 /* Build an array from input text. */
-static const char *parse_array(cJSON *item,const char *value)
+static const char *parse_array(cJSON *item,const char *value,cJSON_Arena *arena)
 {
 	cJSON *child;
 	if (*value!='[')	{ep=value;return 0;}	/* not an array! */
@@ -294,17 +368,17 @@ static const char *parse_array(cJSON *item,const char *value)
 	value=skip(value+1);
 	if (*value==']') return value+1;	/* empty array. */
 
-	item->child=child=cJSON_New_Item();
+	item->child=child=parse_new_item(arena);
 	if (!item->child) return 0;		 /* memory fail */
-	value=skip(parse_value(child,skip(value)));	/* skip any spacing, get the value. */
+	value=skip(parse_value(child,skip(value),arena));	/* skip any spacing, get the value. */
 	if (!value) return 0;
 
 	while (*value==',')
 	{
 		cJSON *new_item;
-		if (!(new_item=cJSON_New_Item())) return 0; 	/* memory fail */
+		if (!(new_item=parse_new_item(arena))) return 0; 	/* memory fail */
 		child->next=new_item;new_item->prev=child;child=new_item;
-		value=skip(parse_value(child,skip(value+1)));
+		value=skip(parse_value(child,skip(value+1),arena));
 		if (!value) return 0;	/* memory fail */
 	}
 
@@ -364,7 +438,7 @@ static char *print_array(cJSON *item,int depth,int fmt)
 }
 
 /* Build an object from the text. */
-static const char *parse_object(cJSON *item,const char *value)
+static const char *parse_object(cJSON *item,const char *value,cJSON_Arena *arena)
 {
 	cJSON *child;
 	if (*value!='{')	{ep=value;return 0;}	/* not an object! */
@@ -373,25 +447,25 @@ static const char *parse_object(cJSON *item,const char *value)
 	value=skip(value+1);
 	if (*value=='}') return value+1;	/* empty array. */
 	
-	item->child=child=cJSON_New_Item();
+	item->child=child=parse_new_item(arena);
 	if (!item->child) return 0;
-	value=skip(parse_string(child,skip(value)));
+	value=skip(parse_string(child,skip(value),arena));
 	if (!value) return 0;
 	child->string=child->valuestring;child->valuestring=0;
 	if (*value!=':') {ep=value;return 0;}	/* fail! */
-	value=skip(parse_value(child,skip(value+1)));	/* skip any spacing, get the value. */
+	value=skip(parse_value(child,skip(value+1),arena));	/* skip any spacing, get the value. */
 	if (!value) return 0;
 	
 	while (*value==',')
 	{
 		cJSON *new_item;
-		if (!(new_item=cJSON_New_Item()))	return 0; /* memory fail */
+		if (!(new_item=parse_new_item(arena)))	return 0; /* memory fail */
 		child->next=new_item;new_item->prev=child;child=new_item;
-		value=skip(parse_string(child,skip(value+1)));
+		value=skip(parse_string(child,skip(value+1),arena));
 		if (!value) return 0;
 		child->string=child->valuestring;child->valuestring=0;
 		if (*value!=':') {ep=value;return 0;}	/* fail! */
-		value=skip(parse_value(child,skip(value+1)));	/* skip any spacing, get the value. */
+		value=skip(parse_value(child,skip(value+1),arena));	/* skip any spacing, get the value. */
 		if (!value) return 0;
 	}
 	
@@ -460,27 +534,57 @@ static char *print_object(cJSON *item,int depth,int fmt)
 /* Get Array size/item / object item. */
 int    cJSON_GetArraySize(cJSON *array)							{cJSON *c=array->child;int i=0;while(c)i++,c=c->next;return i;}
 cJSON *cJSON_GetArrayItem(cJSON *array,int item)				{cJSON *c=array->child;  while (c && item>0) item--,c=c->next; return c;}
-cJSON *cJSON_GetObjectItem(cJSON *object,const char *string)	{cJSON *c=object->child; while (c && cJSON_strcasecmp(c->string,string)) c=c->next; return c;}
+cJSON *cJSON_GetObjectItem(cJSON *object,const char *string)
+{
+	cJSON *c;unsigned i;
+	if (object->index && string)
+	{
+		for (i=cJSON_strcasehash(string)&object->index->mask;(c=object->index->slots[i]);i=(i+1)&object->index->mask)
+			if (!cJSON_strcasecmp(c->string,string)) return c;
+		return 0;
+	}
+	c=object->child; while (c && cJSON_strcasecmp(c->string,string)) c=c->next; return c;
+}
+
+int cJSON_IndexObject(cJSON *object)
+{
+	cJSON *c;unsigned size=8,count=0,i;struct cJSON_Index *index;
+	drop_index(object);
+	for (c=object->child;c;c=c->next) count++;
+	while (size<count*2) size<<=1;		/* at most half full */
+	index=(struct cJSON_Index*)cJSON_malloc(sizeof(struct cJSON_Index)+(size-1)*sizeof(cJSON*));
+	if (!index) return 0;
+	memset(index->slots,0,size*sizeof(cJSON*));index->mask=size-1;
+	for (c=object->child;c;c=c->next)
+	{
+		if (!c->string) continue;
+		for (i=cJSON_strcasehash(c->string)&index->mask;index->slots[i];i=(i+1)&index->mask)
+			if (!cJSON_strcasecmp(index->slots[i]->string,c->string)) break;
+		if (!index->slots[i]) index->slots[i]=c;
+	}
+	object->index=index;
+	return 1;
+}
 
 /* Utility for array list handling. */
 static void suffix_object(cJSON *prev,cJSON *item) {prev->next=item;item->prev=prev;}
 /* Utility for handling references. */
-static cJSON *create_reference(cJSON *item) {cJSON *ref=cJSON_New_Item();if (!ref) return 0;memcpy(ref,item,sizeof(cJSON));ref->string=0;ref->type|=cJSON_IsReference;ref->next=ref->prev=0;return ref;}
+static cJSON *create_reference(cJSON *item) {cJSON *ref=cJSON_New_Item();if (!ref) return 0;memcpy(ref,item,sizeof(cJSON));ref->string=0;ref->type|=cJSON_IsReference;ref->next=ref->prev=0;ref->arena=0;ref->index=0;return ref;}
 
 /* Add item to array/object. */
-void   cJSON_AddItemToArray(cJSON *array, cJSON *item)						{cJSON *c=array->child;if (!item) return; if (!c) {array->child=item;} else {while (c && c->next) c=c->next; suffix_object(c,item);}}
-void   cJSON_AddItemToObject(cJSON *object,const char *string,cJSON *item)	{if (!item) return; if (item->string) cJSON_free(item->string);item->string=cJSON_strdup(string);cJSON_AddItemToArray(object,item);}
+void   cJSON_AddItemToArray(cJSON *array, cJSON *item)						{cJSON *c=array->child;if (!item) return; drop_index(array); if (!c) {array->child=item;} else {while (c && c->next) c=c->next; suffix_object(c,item);}}
+void   cJSON_AddItemToObject(cJSON *object,const char *string,cJSON *item)	{if (!item) return; if (item->string && !item->arena) cJSON_free(item->string);item->string=cJSON_strdup(string);cJSON_AddItemToArray(object,item);}
 void	cJSON_AddItemReferenceToArray(cJSON *array, cJSON *item)						{cJSON_AddItemToArray(array,create_reference(item));}
 void	cJSON_AddItemReferenceToObject(cJSON *object,const char *string,cJSON *item)	{cJSON_AddItemToObject(object,string,create_reference(item));}
 
-cJSON *cJSON_DetachItemFromArray(cJSON *array,int which)			{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return 0;
+cJSON *cJSON_DetachItemFromArray(cJSON *array,int which)			{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return 0;drop_index(array);
 	if (c->prev) c->prev->next=c->next;if (c->next) c->next->prev=c->prev;if (c==array->child) array->child=c->next;c->prev=c->next=0;return c;}
 void   cJSON_DeleteItemFromArray(cJSON *array,int which)			{cJSON_Delete(cJSON_DetachItemFromArray(array,which));}
 cJSON *cJSON_DetachItemFromObject(cJSON *object,const char *string) {int i=0;cJSON *c=object->child;while (c && cJSON_strcasecmp(c->string,string)) i++,c=c->next;if (c) return cJSON_DetachItemFromArray(object,i);return 0;}
 void   cJSON_DeleteItemFromObject(cJSON *object,const char *string) {cJSON_Delete(cJSON_DetachItemFromObject(object,string));}
 
 /* Replace array/object items with new ones. */
-void   cJSON_ReplaceItemInArray(cJSON *array,int which,cJSON *newitem)		{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return;
+void   cJSON_ReplaceItemInArray(cJSON *array,int which,cJSON *newitem)		{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return;drop_index(array);
 	newitem->next=c->next;newitem->prev=c->prev;if (newitem->next) newitem->next->prev=newitem;
 	if (c==array->child) array->child=newitem; else newitem->prev->next=newitem;c->next=c->prev=0;cJSON_Delete(c);}
 void   cJSON_ReplaceItemInObject(cJSON *object,const char *string,cJSON *newitem){int i=0;cJSON *c=object->child;while(c && cJSON_strcasecmp(c->string,string))i++,c=c->next;if(c){newitem->string=cJSON_strdup(string);cJSON_ReplaceItemInArray(object,i,newitem);}}
@@ -40,6 +40,7 @@ extern "C"
 #define cJSON_IsReference 256
 
 /* The cJSON structure: */
+/* Unlike upstream cJSON it ends with the arena and index members, so code built against an upstream cJSON.h can't share items with this one. */
 typedef struct cJSON {
 	struct cJSON *next,*prev;	/* next/prev allow you to walk array/object chains. Alternatively, use GetArraySize/GetArrayItem/GetObjectItem */
 	struct cJSON *child;		/* An array or object item will have a child pointer pointing to a chain of the items in the array/object. */
@@ -51,6 +52,9 @@ typedef struct cJSON {
 	double valuedouble;			/* The item's number, if type==cJSON_Number */
 
 	char *string;				/* The item's name string, if this item is the child of, or is in the list of subitems of an object. */
+
+	int arena;					/* Non zero when the item was allocated by cJSON_ParseArena. */
+	struct cJSON_Index *index;	/* Lookup table of an object, see cJSON_IndexObject. */
 } cJSON;
 
 typedef struct cJSON_Hooks {
@@ -64,6 +68,9 @@ extern void cJSON_InitHooks(cJSON_Hooks* hooks);
 
 /* Supply a block of JSON, and this returns a cJSON object you can interrogate. Call cJSON_Delete when finished. */
 extern cJSON *cJSON_Parse(const char *value);
+/* Like cJSON_Parse, but the whole document is a single allocation: cJSON_Delete on the result frees it in one go.
+   Items of the document can't be moved to another one; detached items stay valid until the document is deleted. */
+extern cJSON *cJSON_ParseArena(const char *value);
 /* Render a cJSON entity to text for transfer/storage. Free the char* when finished. */
 extern char  *cJSON_Print(cJSON *item);
 /* Render a cJSON entity to text for transfer/storage without any formatting. Free the char* when finished. */
@@ -77,6 +84,9 @@ extern int	  cJSON_GetArraySize(cJSON *array);
 extern cJSON *cJSON_GetArrayItem(cJSON *array,int item);
 /* Get item "string" from object. Case insensitive. */
 extern cJSON *cJSON_GetObjectItem(cJSON *object,const char *string);
+/* Builds a hash index of the keys of object, so cJSON_GetObjectItem doesn't scan them. Worth it for objects with many keys.
+   Adding, detaching or replacing items drops the index. Returns 0 when out of memory, the object is still usable. */
+extern int	  cJSON_IndexObject(cJSON *object);
 
 /* For analysing failed parses. This returns a pointer to the parse error. You'll probably need to look a few chars back to make sense of it. Defined when cJSON_Parse() returns 0. 0 when cJSON_Parse() succeeds. */
 extern const char *cJSON_GetErrorPtr();
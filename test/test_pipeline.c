@@ -0,0 +1,126 @@
+/* Fair stage test: a tenant at its limits with a full backlog holds back its
+ * own submits only, another tenant's submit goes through and its job runs.
+ *
+ * make test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vb_platform.h"
+#include "vb_pipeline.h"
+
+#define NUM_A		4		//one running, two waiting, one over the share
+#define TIMEOUT_MS	5000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static int gate_open;		//jobs of tenant A run once it is set
+static int done_a;
+static int done_b;
+static int extra_submitted;
+
+static struct vb_job jobs_a[NUM_A];
+static struct vb_job job_b;
+
+static void process(struct vb_job* job){
+	pthread_mutex_lock(&lock);
+	if (job == &job_b){
+		++done_b;
+	}else{
+		while (!gate_open)
+			pthread_cond_wait(&changed, &lock);
+		++done_a;
+	}
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+static void* submit_extra(void* data){
+	vb_stage_submit(data, &jobs_a[NUM_A - 1]);
+	pthread_mutex_lock(&lock);
+	extra_submitted = 1;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* waits up to TIMEOUT_MS for *value to reach want, lock held */
+static int wait_for(int* value, int want){
+	long long deadline = vb_now_us() + TIMEOUT_MS * 1000LL;
+
+	while (*value < want && vb_now_us() < deadline){
+		pthread_mutex_unlock(&lock);
+		usleep(1000);
+		pthread_mutex_lock(&lock);
+	}
+	return *value >= want;
+}
+
+static int fail(const char* what){
+	fprintf(stderr, "FAIL: %s\n", what);
+	return 1;
+}
+
+int main(void){
+	//one job per key at a time, a queue of one per worker: a share of two for a single tenant
+	struct vb_fair_limits limits = {1, 0};
+	struct vb_stage* stage;
+	pthread_t extra;
+	int i;
+
+	//a submit blocked for good fails the test instead of hanging it
+	alarm(TIMEOUT_MS / 1000 * 2);
+	if (!(stage = vb_fair_stage_create("test", 2, 1, &limits, process, NULL)))
+		return fail("can't create the stage");
+
+	//tenant A: one job running and held there, its share queued behind it
+	for (i = 0; i < NUM_A; ++i){
+		jobs_a[i].route = i;
+		jobs_a[i].tenant = "key-a";
+		jobs_a[i].cost = 1;
+	}
+	for (i = 0; i < NUM_A - 1; ++i)
+		vb_stage_submit(stage, &jobs_a[i]);
+	//one more is over the share and must wait
+	if (pthread_create(&extra, NULL, submit_extra, stage))
+		return fail("can't start the submitting thread");
+	usleep(100 * 1000);
+	pthread_mutex_lock(&lock);
+	if (extra_submitted){
+		pthread_mutex_unlock(&lock);
+		return fail("a submit over the tenant's share did not block");
+	}
+	pthread_mutex_unlock(&lock);
+
+	//tenant B: submits and runs on the idle worker while A is held
+	job_b.route = 100;
+	job_b.tenant = "key-b";
+	job_b.cost = 1;
+	vb_stage_submit(stage, &job_b);
+	pthread_mutex_lock(&lock);
+	if (!wait_for(&done_b, 1)){
+		pthread_mutex_unlock(&lock);
+		return fail("the job of the second tenant did not run");
+	}
+	if (extra_submitted){
+		pthread_mutex_unlock(&lock);
+		return fail("the first tenant went over its share");
+	}
+
+	gate_open = 1;
+	pthread_cond_broadcast(&changed);
+	if (!wait_for(&done_a, NUM_A)){
+		pthread_mutex_unlock(&lock);
+		return fail("the jobs of the first tenant did not drain");
+	}
+	pthread_mutex_unlock(&lock);
+	pthread_join(extra, NULL);
+
+	vb_stage_destroy(stage);
+	if (done_a != NUM_A || done_b != 1)
+		return fail("jobs lost");
+	printf("ok: the second tenant submitted and ran while the first was at its share\n");
+	return 0;
+}
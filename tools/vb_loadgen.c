@@ -0,0 +1,399 @@
+/* Load generator: runs the capture loop of mixmonitor_thread() for N simulated
+ * channels, one thread per channel as in the module, fed with synthetic 20ms
+ * frames at real time (or an accelerated pace), and uploads the segments to a
+ * local HTTP sink. N ramps up in steps, each step reports:
+ *
+ *   cpu/call	process CPU per real time call in % of one core (the built-in sink
+ *   			included), so accelerated runs are divided by the pace
+ *   rss		resident set size
+ *   threads	channel, pipeline and sink threads
+ *   lag		time from a frame's due time until it is stored (wakeup + processing)
+ *   queued		segments waiting for an encode or upload worker
+ *   inflight	segments closed but not uploaded yet
+ *   segment	length segments are closed at, moves with -a
+ *
+ * make tools && ./tools/vb_loadgen -c 100,500,1000,2000 -t 30
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <curl/curl.h>
+#include "vb_platform.h"
+#include "voicebase.h"
+#include "vb_stats.h"
+
+#define FRAME_SAMPLES		160
+#define FRAME_MS			20
+#define SPEECH_SECONDS		10
+#define SPEECH_SAMPLES		(SPEECH_SECONDS * 8000)
+#define MAX_STEPS			32
+#define CHANNEL_STACK_SIZE	(256 * 1024)
+
+struct channel{
+	pthread_t	thread;
+	int			id;
+};
+
+static short speech[SPEECH_SAMPLES];
+static double speed = 1.0;
+static int stereo;
+static int verbose;
+static int num_keys = 1;
+static int stop;
+static int step;
+static struct vb_histogram lag[MAX_STEPS];
+
+static long long sink_requests;
+static long long sink_bytes;
+
+static void tool_log(int level, const char* file, int line, const char* function, const char* fmt, va_list ap){
+	if (verbose || level >= VB_LOG_ERROR)
+		vfprintf(stderr, fmt, ap);
+}
+
+/* Talk spurts and pauses of noise shaped like speech, so the VAD and the
+ * pause segmenter see a realistic mix */
+static void make_speech(){
+	int i;
+	unsigned int seed = 1;
+
+	for (i = 0; i < SPEECH_SAMPLES; ++i){
+		double t = (double)i / 8000;
+		double envelope = fmod(t, 2.3) < 1.5 ? 0.5 + 0.5 * sin(2 * M_PI * 4 * t) : 0.01;
+		double noise = (double)(rand_r(&seed) % 20001 - 10000) / 10000;
+		speech[i] = (short)(envelope * (3000 * sin(2 * M_PI * 180 * t) + 2000 * noise));
+	}
+}
+
+static void sleep_until(long long us){
+	struct timespec ts;
+	ts.tv_sec 	= us / 1000000;
+	ts.tv_nsec 	= (us % 1000000) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* same segment handling as prepare_segment() in app_vbmixmonitor.c */
+static void prepare_segment(struct mem_storage_t* mem_storage, const char* name, long int cts, long int* prev_ts, int* count){
+	if (segment_should_close(mem_storage, cts - *prev_ts)){
+		close_mem_storage(mem_storage, 0);
+		*prev_ts = cts;
+		++(*count);
+	}
+	if (!is_opened(mem_storage))
+		open_mem_storage(mem_storage, name, *count, cts);
+}
+
+static void* channel_thread(void* data){
+	struct channel* ch = data;
+	struct mem_storage_t mem_storage;
+	struct vb_capture_stats capture_stats = {0};
+	long long period = (long long)(FRAME_MS * 1000 / speed);
+	long long next;
+	long int cts = 0;
+	long int prev_ts = 0;
+	int count = 0;
+	int pos;
+	char name[64];
+	char params[128];
+
+	memset(&mem_storage, 0, sizeof(mem_storage));
+	snprintf(name, sizeof(name), "SIP/loadgen-%08x", ch->id);
+	//the calls are spread over the API keys, the first key gets half of them
+	snprintf(params, sizeof(params), "{\"stereo\":%s,\"apikey\":\"loadgen-key-%d\"}", stereo ? "true" : "false",
+			(ch->id % 2 || num_keys == 1) ? 0 : 1 + ch->id / 2 % (num_keys - 1));
+	if (!create_mem_storage(&mem_storage, params)){
+		destroy_mem_storage(&mem_storage);
+		return NULL;
+	}
+
+	//calls do not start in lock step
+	pos 	= (ch->id * 7919 % (SPEECH_SAMPLES / FRAME_SAMPLES)) * FRAME_SAMPLES;
+	next 	= vb_now_us() + ch->id * 2654435761u % period;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)){
+		const short* read 	= &speech[pos];
+		const short* write 	= &speech[(pos + SPEECH_SAMPLES / 2) % SPEECH_SAMPLES];
+
+		sleep_until(next);
+
+		vb_capture_stats_add(&capture_stats, FRAME_SAMPLES * 4);
+		prepare_segment(&mem_storage, name, cts, &prev_ts, &count);
+		if (stereo)
+			put_data_stereo(&mem_storage, read, FRAME_SAMPLES, write, FRAME_SAMPLES);
+		else
+			put_data_mixed(&mem_storage, read, FRAME_SAMPLES, write, FRAME_SAMPLES);
+		cts += FRAME_MS;
+
+		vb_histogram_record(&lag[__atomic_load_n(&step, __ATOMIC_RELAXED)], vb_now_us() - next);
+		next += period;
+		pos = (pos + FRAME_SAMPLES) % SPEECH_SAMPLES;
+	}
+
+	if (!is_opened(&mem_storage)){
+		open_mem_storage(&mem_storage, name, count, cts);
+		put_silence(&mem_storage, 8000);
+	}
+	close_mem_storage(&mem_storage, 1);
+	destroy_mem_storage(&mem_storage);
+	vb_capture_stats_flush(&capture_stats);
+	return NULL;
+}
+
+/* Minimal HTTP sink: reads one request, answers 200 and closes the connection */
+static void* sink_connection(void* data){
+	int fd = (int)(long)data;
+	char buf[16384];
+	long long body = -1;
+	long long received = 0;
+	int len = 0;
+	int n;
+
+	while (body < 0 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0){
+		char* end;
+		len += n;
+		buf[len] = 0;
+		if ((end = strstr(buf, "\r\n\r\n"))){
+			char* cl = strcasestr(buf, "\r\nContent-Length:");
+			body = cl ? atoll(cl + 17) : 0;
+			received = len - (end + 4 - buf);
+			if (strcasestr(buf, "\r\nExpect: 100-continue") && received < body)
+				n = write(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+		}else if (len == sizeof(buf) - 1){
+			break;
+		}
+	}
+	while (body >= 0 && received < body && (n = read(fd, buf, sizeof(buf))) > 0)
+		received += n;
+
+	if (body >= 0){
+		static const char response[] = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+									   "Content-Length: 22\r\nConnection: close\r\n\r\n{\"requestStatus\":\"OK\"}";
+		n = write(fd, response, sizeof(response) - 1);
+		__atomic_fetch_add(&sink_requests, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sink_bytes, received, __ATOMIC_RELAXED);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void* sink_thread(void* data){
+	int listener = (int)(long)data;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, CHANNEL_STACK_SIZE);
+	for (;;){
+		pthread_t thread;
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+			continue;
+		if (pthread_create(&thread, &attr, sink_connection, (void*)(long)fd))
+			close(fd);
+	}
+	return NULL;
+}
+
+/* returns the port of the sink on 127.0.0.1, 0 on failure */
+static int start_sink(){
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	pthread_t thread;
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family 		= AF_INET;
+	addr.sin_addr.s_addr 	= htonl(INADDR_LOOPBACK);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) || listen(listener, 1024) ||
+			getsockname(listener, (struct sockaddr*)&addr, &addr_len) ||
+			pthread_create(&thread, NULL, sink_thread, (void*)(long)listener))
+		return 0;
+	pthread_detach(thread);
+	return ntohs(addr.sin_port);
+}
+
+static long proc_status_value(const char* key){
+	char line[256];
+	long value = -1;
+	FILE* f = fopen("/proc/self/status", "r");
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, key, strlen(key))){
+			value = atol(line + strlen(key));
+			break;
+		}
+	fclose(f);
+	return value;
+}
+
+static double cpu_seconds(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void usage(const char* prog){
+	fprintf(stderr, "usage: %s [-c channels,...] [-t seconds per step] [-x speed] [-l segment seconds] [-a min,max]\n"
+					"          [-e encode workers] [-w upload workers] [-k keys] [-p uploads per key] [-u url] [-g] [-s] [-v]\n"
+					"  -c  channel counts to ramp through (default 50,100,200,500)\n"
+					"  -x  pace of the frames, 1 is real time (default 1)\n"
+					"  -a  adapt the segment length to the upload backlog between min and max seconds\n"
+					"  -k  API keys the calls are spread over, half of them on the first one (default 1)\n"
+					"  -p  uploads of one key running at once (default no limit)\n"
+					"  -u  upload to this URL instead of the built-in sink\n"
+					"  -g  stagger the first segment boundary of every call (segment_stagger)\n"
+					"  -s  stereo segments\n", prog);
+}
+
+int main(int argc, char** argv){
+	static const struct vb_platform platform = { NULL, NULL, NULL, tool_log };
+	const char* ramp = "50,100,200,500";
+	const char* url = NULL;
+	int step_seconds = 30;
+	int steps[MAX_STEPS];
+	int num_steps = 0;
+	struct channel* channels;
+	int num_channels = 0;
+	pthread_attr_t attr;
+	char sink_url[64];
+	char* list;
+	char* tok;
+	int adaptive_min;
+	int adaptive_max;
+	int opt;
+	int i;
+
+	vb_platform_set(&platform);
+	set_defaults();
+	set_vb_segment_duration(30);
+
+	while ((opt = getopt(argc, argv, "c:t:x:l:a:e:w:k:p:u:gsvh")) != -1){
+		switch (opt){
+		case 'c': ramp = optarg; break;
+		case 't': step_seconds = atoi(optarg); break;
+		case 'x': speed = atof(optarg); break;
+		case 'l': set_vb_segment_duration(atoi(optarg)); break;
+		case 'a':
+			set_vb_segment_adaptive(1);
+			if (sscanf(optarg, "%d,%d", &adaptive_min, &adaptive_max) != 2 || adaptive_min < 1 || adaptive_max < adaptive_min){
+				usage(argv[0]);
+				return 1;
+			}
+			set_vb_segment_adaptive_min(adaptive_min);
+			set_vb_segment_adaptive_max(adaptive_max);
+			break;
+		case 'e': set_vb_encode_workers(atoi(optarg)); break;
+		case 'w': set_vb_upload_workers(atoi(optarg)); break;
+		case 'k': num_keys = atoi(optarg); break;
+		case 'p': set_vb_upload_max_per_key(atoi(optarg)); break;
+		case 'u': url = optarg; break;
+		case 'g': set_vb_segment_stagger(1); break;
+		case 's': stereo = 1; break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (speed <= 0 || step_seconds <= 0 || num_keys < 1){
+		usage(argv[0]);
+		return 1;
+	}
+
+	list = strdup(ramp);
+	for (tok = strtok(list, ","); tok && num_steps < MAX_STEPS; tok = strtok(NULL, ","))
+		if ((steps[num_steps] = atoi(tok)) > (num_steps ? steps[num_steps - 1] : 0))
+			++num_steps;
+	free(list);
+	if (!num_steps){
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!url){
+		int port = start_sink();
+		if (!port){
+			fprintf(stderr, "Can't start the HTTP sink\n");
+			return 1;
+		}
+		snprintf(sink_url, sizeof(sink_url), "http://127.0.0.1:%d/", port);
+		url = sink_url;
+	}
+	set_vb_api_url(url);
+	vb_config_apply();
+
+	curl_global_init(CURL_GLOBAL_ALL);
+	vb_pipeline_start();
+	make_speech();
+
+	channels = calloc(steps[num_steps - 1], sizeof(*channels));
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, CHANNEL_STACK_SIZE);
+
+	printf("uploading %s segments of %ds to %s, %gx real time, %ds per step\n",
+		   stereo ? "stereo" : "mono", get_vb_segment_duration(), url, speed, step_seconds);
+	printf("%8s %9s %8s %7s %9s %9s %9s %9s %6s %8s %9s %8s\n",
+		   "channels", "cpu/call%", "rss MB", "threads", "lag p50", "lag p99", "lag p99.9", "lag max", "queued", "inflight", "uploaded", "segment");
+
+	for (i = 0; i < num_steps; ++i){
+		struct vb_stage_stats encode, upload;
+		struct vb_stats stats;
+		long long wall;
+		double cpu;
+
+		__atomic_store_n(&step, i, __ATOMIC_RELAXED);
+		for (; num_channels < steps[i]; ++num_channels){
+			channels[num_channels].id = num_channels;
+			if (pthread_create(&channels[num_channels].thread, &attr, channel_thread, &channels[num_channels])){
+				fprintf(stderr, "Can't start channel %d\n", num_channels);
+				break;
+			}
+		}
+
+		wall 	= vb_now_us();
+		cpu 	= cpu_seconds();
+		sleep(step_seconds);
+		wall 	= vb_now_us() - wall;
+		cpu 	= cpu_seconds() - cpu;
+
+		vb_pipeline_get_stats(&encode, &upload);
+		vb_stats_snapshot(&stats);
+		printf("%8d %9.3f %8.1f %7ld %7.2fms %7.2fms %7.2fms %7.2fms %6d %8lld %9lld %7.1fs\n",
+			   num_channels, cpu / (wall / 1e6) / num_channels / speed * 100,
+			   proc_status_value("VmRSS:") / 1024.0, proc_status_value("Threads:"),
+			   vb_histogram_quantile(&lag[i], 0.5) / 1e3, vb_histogram_quantile(&lag[i], 0.99) / 1e3,
+			   vb_histogram_quantile(&lag[i], 0.999) / 1e3, lag[i].max / 1e3,
+			   encode.queued + upload.queued, stats.segments_closed - stats.segments_uploaded - stats.segments_failed,
+			   stats.segments_uploaded, stats.segment_length_ms / 1e3);
+		fflush(stdout);
+		if (num_channels < steps[i])
+			break;
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < num_channels; ++i)
+		pthread_join(channels[i].thread, NULL);
+	vb_pipeline_stop();
+
+	{
+		struct vb_stats stats;
+		vb_stats_snapshot(&stats);
+		printf("segments uploaded %lld, failed %lld, %lld bytes; sink received %lld requests, %lld bytes\n",
+			   stats.segments_uploaded, stats.segments_failed, stats.bytes_uploaded,
+			   __atomic_load_n(&sink_requests, __ATOMIC_RELAXED), __atomic_load_n(&sink_bytes, __ATOMIC_RELAXED));
+	}
+	free(channels);
+	curl_global_cleanup();
+	return 0;
+}
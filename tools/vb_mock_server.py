@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+"""Local stand-in for the VoiceBase v1.1 uploadMedia endpoint.
+
+Accepts the multipart form posted by the module (see vb_upload_body_init() in
+voicebase.c), validates the fields and the WAV file of every segment, checks
+that the segments of a call arrive in order, and answers like the API does.
+Latency, a bandwidth cap, 5xx answers, timeouts and connection resets can be
+injected to see how the upload pipeline behaves when the API degrades.
+
+    ./tools/vb_mock_server.py --port 8080 --latency 200:50 --error-rate 0.05
+
+and point the module at it with api_url = http://127.0.0.1:8080/ in
+vbmixmonitor.conf (or -u with tools/vb_loadgen). Only the standard library is
+used. A summary is printed every --report seconds and on exit.
+"""
+
+import argparse
+import json
+import random
+import re
+import signal
+import socket
+import struct
+import sys
+import threading
+import time
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+REQUIRED_FIELDS = ("version", "apikey", "password", "action", "callID",
+                   "startTime", "segmentNumber", "finalSegment", "transcriptType")
+KNOWN_FIELDS = REQUIRED_FIELDS + ("rtCallbackUrl", "public", "title", "desc", "lang",
+                                  "sourceUrl", "recordedDate", "externalId", "ownerId",
+                                  "autoCreate", "humanRush", "offsetMap")
+MIN_SAMPLE_RATE = 8000
+MAX_SAMPLE_RATE = 48000
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counters = {}
+        self.bytes = 0
+        self.started = time.monotonic()
+
+    def count(self, name, body_bytes=0):
+        with self.lock:
+            self.counters[name] = self.counters.get(name, 0) + 1
+            self.bytes += body_bytes
+
+    def summary(self):
+        with self.lock:
+            elapsed = time.monotonic() - self.started
+            counters = " ".join("%s=%d" % item for item in sorted(self.counters.items()))
+            return "%s bytes=%d (%.2f MB/s)" % (counters, self.bytes, self.bytes / elapsed / 1e6 if elapsed else 0)
+
+
+class Bandwidth:
+    """Token bucket shared by all connections, None rate means unlimited"""
+
+    def __init__(self, rate):
+        self.rate = rate
+        self.lock = threading.Lock()
+        self.next = time.monotonic()
+
+    def consume(self, size):
+        if not self.rate:
+            return
+        with self.lock:
+            now = time.monotonic()
+            self.next = max(self.next, now) + size / self.rate
+            delay = self.next - now
+        if delay > 0:
+            time.sleep(delay)
+
+
+class Calls:
+    """Segment order per callID. Segments lost to injected faults leave gaps,
+    so a skipped number is only counted, going backwards is an error."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.calls = {}
+
+    def check(self, call_id, number, final):
+        """returns (error, gap)"""
+        with self.lock:
+            expected, finished = self.calls.get(call_id, (0, False))
+            if finished:
+                return "segment %d of %s after the final segment" % (number, call_id), False
+            if number < expected:
+                return "segment %d of %s, expected %d" % (number, call_id, expected), False
+            self.calls[call_id] = (number + 1, final)
+            return None, number > expected
+
+
+def parse_multipart(body, content_type):
+    match = re.search(r'boundary="?([^";]+)"?', content_type or "")
+    if not match or not content_type.startswith("multipart/form-data"):
+        raise ValueError("not a multipart/form-data request")
+    delimiter = b"--" + match.group(1).encode()
+    fields, files = {}, {}
+    for part in body.split(delimiter)[1:]:
+        if part.startswith(b"--"):
+            break
+        head, sep, data = part.partition(b"\r\n\r\n")
+        if not sep:
+            raise ValueError("malformed part")
+        if data.endswith(b"\r\n"):
+            data = data[:-2]
+        disposition = re.search(rb'name="([^"]*)"(?:; filename="([^"]*)")?', head)
+        if not disposition:
+            raise ValueError("part without a name")
+        name = disposition.group(1).decode()
+        if disposition.group(2) is not None:
+            files[name] = (disposition.group(2).decode(), data)
+        else:
+            fields[name] = data.decode("utf-8", "replace")
+    return fields, files
+
+
+def check_wav(data):
+    """returns (channels, sample_rate, seconds), raises ValueError"""
+    if len(data) < 44 or data[0:4] != b"RIFF" or data[8:12] != b"WAVE" or data[12:16] != b"fmt ":
+        raise ValueError("not a canonical WAV file")
+    riff_size, = struct.unpack_from("<I", data, 4)
+    fmt_size, audio_format, channels, rate, byte_rate, align, bits = struct.unpack_from("<IHHIIHH", data, 16)
+    if data[36:40] != b"data":
+        raise ValueError("no data chunk after fmt")
+    data_size, = struct.unpack_from("<I", data, 40)
+    if fmt_size != 16 or audio_format != 1 or bits != 16:
+        raise ValueError("not 16 bit PCM")
+    if channels not in (1, 2):
+        raise ValueError("%d channels" % channels)
+    if not MIN_SAMPLE_RATE <= rate <= MAX_SAMPLE_RATE:
+        raise ValueError("sample rate %d" % rate)
+    if byte_rate != rate * channels * 2 or align != channels * 2:
+        raise ValueError("inconsistent byte rate or block align")
+    if riff_size != len(data) - 8 or data_size != len(data) - 44:
+        raise ValueError("RIFF size %d / data size %d for a %d byte file" % (riff_size, data_size, len(data)))
+    if data_size % align:
+        raise ValueError("data size %d is not a whole number of frames" % data_size)
+    return channels, rate, data_size / byte_rate
+
+
+def check_form(fields, files, calls):
+    """returns (gap, description of the segment), raises ValueError"""
+    missing = [name for name in REQUIRED_FIELDS if name not in fields]
+    if missing:
+        raise ValueError("missing " + ", ".join(missing))
+    unknown = [name for name in fields if name not in KNOWN_FIELDS]
+    if unknown:
+        raise ValueError("unknown " + ", ".join(unknown))
+    if fields["version"] != "1.1" or fields["action"] != "uploadMedia":
+        raise ValueError("version %s action %s" % (fields["version"], fields["action"]))
+    if not re.fullmatch(r"\d+", fields["segmentNumber"]):
+        raise ValueError("segmentNumber " + fields["segmentNumber"])
+    if fields["finalSegment"] not in ("true", "false"):
+        raise ValueError("finalSegment " + fields["finalSegment"])
+    if not re.fullmatch(r"\d+\.\d{1,3}", fields["startTime"]):
+        raise ValueError("startTime " + fields["startTime"])
+    if "offsetMap" in fields:
+        offsets = json.loads(fields["offsetMap"])
+        if not all(isinstance(o, list) and len(o) == 2 and o[0] <= o[1] for o in offsets):
+            raise ValueError("offsetMap " + fields["offsetMap"])
+    if "file" not in files:
+        raise ValueError("no file part")
+    filename, wav = files["file"]
+    if not filename.endswith("_%s.wav" % fields["segmentNumber"]):
+        raise ValueError("file name %s for segment %s" % (filename, fields["segmentNumber"]))
+    channels, rate, seconds = check_wav(wav)
+    error, gap = calls.check(fields["callID"], int(fields["segmentNumber"]), fields["finalSegment"] == "true")
+    if error:
+        raise ValueError(error)
+    return gap, "%s #%s%s at %ss: %.2fs %dch %dHz" % (fields["callID"], fields["segmentNumber"],
+                                                 " final" if fields["finalSegment"] == "true" else "",
+                                                 fields["startTime"], seconds, channels, rate)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "vb-mock/1.0"
+
+    def log_message(self, fmt, *args):
+        if self.server.options.verbose:
+            sys.stderr.write("%s %s\n" % (self.address_string(), fmt % args))
+
+    def reply(self, status, payload):
+        body = json.dumps(payload).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Connection", "close")
+        self.end_headers()
+        self.wfile.write(body)
+        self.close_connection = True
+
+    def reset(self):
+        # RST instead of FIN
+        self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        self.connection.close()
+        self.close_connection = True
+
+    def read_body(self, length):
+        chunks, left = [], length
+        while left > 0:
+            chunk = self.rfile.read(min(left, 65536))
+            if not chunk:
+                break
+            self.server.bandwidth.consume(len(chunk))
+            chunks.append(chunk)
+            left -= len(chunk)
+        return b"".join(chunks)
+
+    def do_POST(self):
+        options, stats = self.server.options, self.server.stats
+        fault = random.random()
+
+        if fault < options.reset_rate:
+            stats.count("reset")
+            self.reset()
+            return
+        fault -= options.reset_rate
+
+        body = self.read_body(int(self.headers.get("Content-Length", 0)))
+
+        if fault < options.timeout_rate:
+            stats.count("timeout", len(body))
+            time.sleep(options.hang)
+            self.reset()
+            return
+        fault -= options.timeout_rate
+
+        if options.latency:
+            time.sleep(max(0.0, random.gauss(options.latency, options.jitter)) / 1000)
+
+        if fault < options.error_rate:
+            stats.count("error", len(body))
+            self.reply(503, {"requestStatus": "FAILURE", "statusMessage": "injected error"})
+            return
+
+        try:
+            fields, files = parse_multipart(body, self.headers.get("Content-Type"))
+            gap, description = check_form(fields, files, self.server.calls)
+        except ValueError as error:
+            stats.count("invalid", len(body))
+            sys.stderr.write("invalid upload: %s\n" % error)
+            self.reply(400, {"requestStatus": "FAILURE", "statusMessage": str(error)})
+            return
+
+        stats.count("ok", len(body))
+        if gap:
+            stats.count("gap")
+        if options.verbose:
+            sys.stderr.write(description + "\n")
+        self.reply(200, {"requestStatus": "SUCCESS",
+                         "statusMessage": "The request was processed successfully",
+                         "mediaId": uuid.uuid4().hex})
+
+
+def parse_latency(value):
+    latency, _, jitter = value.partition(":")
+    return float(latency), float(jitter or 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--latency", type=parse_latency, default=(0.0, 0.0), metavar="MS[:JITTER]",
+                        help="delay before answering, normally distributed")
+    parser.add_argument("--bandwidth", type=float, default=0, metavar="BYTES/S",
+                        help="cap on the upload bandwidth of all connections together")
+    parser.add_argument("--error-rate", type=float, default=0, help="share of requests answered with 503")
+    parser.add_argument("--timeout-rate", type=float, default=0, help="share of requests never answered")
+    parser.add_argument("--hang", type=float, default=120, help="seconds a timed out request is held")
+    parser.add_argument("--reset-rate", type=float, default=0, help="share of connections reset before the body")
+    parser.add_argument("--report", type=float, default=10, help="seconds between summaries, 0 for none")
+    parser.add_argument("--seed", type=int)
+    parser.add_argument("-v", "--verbose", action="store_true")
+    options = parser.parse_args()
+    options.latency, options.jitter = options.latency
+
+    random.seed(options.seed)
+    server = ThreadingHTTPServer((options.host, options.port), Handler)
+    server.daemon_threads = True
+    server.request_queue_size = 1024
+    server.options = options
+    server.stats = Stats()
+    server.calls = Calls()
+    server.bandwidth = Bandwidth(options.bandwidth)
+
+    if options.report > 0:
+        def report():
+            while True:
+                time.sleep(options.report)
+                sys.stderr.write(server.stats.summary() + "\n")
+        threading.Thread(target=report, daemon=True).start()
+
+    def terminate(signum, frame):
+        raise KeyboardInterrupt()
+    signal.signal(signal.SIGTERM, terminate)
+
+    sys.stderr.write("listening on http://%s:%d/\n" % server.server_address)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    sys.stderr.write(server.stats.summary() + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,609 @@
+/* Offline replay: pushes recorded calls through the capture loop of
+ * mixmonitor_thread() and the segment pipeline as fast as the CPU allows.
+ *
+ * Inputs are files or directories of
+ *   .wav		16 bit PCM, 8 kHz, mono (one leg) or stereo (read and write legs)
+ *   .raw .sln	headerless 8 kHz 16 bit little endian mono
+ *   .pcap		RTP G.711 (payload types 0 and 8), every SSRC is replayed as one call
+ *
+ * Segments go to a no-op transport by default. -u uploads them to a sink
+ * (e.g. tools/vb_mock_server.py), -o writes the would-be POST bodies to a
+ * directory. Every segment is checked against the fixed segmentation:
+ * segmentNumber, finalSegment, startTime and the WAV size must follow from
+ * the length of the call and segment_length. The checks are skipped when the
+ * segmentation depends on the audio (-m pause, -e).
+ *
+ * Reports call-minutes processed per CPU-second (all threads, pipeline included).
+ *
+ * make tools && ./tools/vb_replay -j 8 -l 30 captures/
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <curl/curl.h>
+#include "vb_platform.h"
+#include "voicebase.h"
+#include "vb_stats.h"
+
+#define FRAME_SAMPLES		160
+#define FRAME_MS			20
+#define MAX_REPORTED		20		//mismatches printed in full
+
+struct call{
+	char		name[256];
+	short*		legs[2];			//legs[1] is NULL for a single leg
+	int			num_samples;		//per leg, whole frames only
+	//filled in by the transport
+	int			segments;
+	int			final_seen;
+};
+
+static struct call* calls;
+static int num_calls;
+static int next_call;
+
+static int stereo;
+static int sample_rate = 8000;
+static int verify = 1;
+static const char* url;
+static const char* out_dir;
+static int verbose;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mismatches;
+
+static void tool_log(int level, const char* file, int line, const char* function, const char* fmt, va_list ap){
+	if (verbose || level >= VB_LOG_ERROR)
+		vfprintf(stderr, fmt, ap);
+}
+
+static void mismatch(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void mismatch(const char* fmt, ...){
+	va_list ap;
+
+	pthread_mutex_lock(&report_lock);
+	if (++mismatches <= MAX_REPORTED){
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+	}
+	pthread_mutex_unlock(&report_lock);
+}
+
+static struct call* add_call(const char* name, int suffix){
+	struct call* call;
+
+	calls = realloc(calls, (num_calls + 1) * sizeof(*calls));
+	call = &calls[num_calls++];
+	memset(call, 0, sizeof(*call));
+	if (suffix >= 0)
+		snprintf(call->name, sizeof(call->name), "%s-%08x", name, suffix);
+	else
+		snprintf(call->name, sizeof(call->name), "%s", name);
+	return call;
+}
+
+static char* read_file(const char* path, long* size){
+	FILE* f = fopen(path, "rb");
+	char* data = NULL;
+
+	if (!f)
+		return NULL;
+	if (!fseek(f, 0, SEEK_END) && (*size = ftell(f)) >= 0 && !fseek(f, 0, SEEK_SET) &&
+			(data = malloc(*size + 1)) && fread(data, 1, *size, f) != (size_t)*size){
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+static unsigned int get_le32(const unsigned char* p){ return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24; }
+static unsigned int get_le16(const unsigned char* p){ return p[0] | p[1] << 8; }
+static unsigned int get_be16(const unsigned char* p){ return p[0] << 8 | p[1]; }
+static unsigned int get_be32(const unsigned char* p){ return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+static void load_wav(const char* path, const char* name){
+	long size;
+	unsigned char* data = (unsigned char*)read_file(path, &size);
+	unsigned char* fmt = NULL;
+	unsigned char* samples = NULL;
+	long samples_size = 0;
+	long pos = 12;
+	struct call* call;
+	int channels;
+	int i, c;
+
+	if (!data || size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)){
+		fprintf(stderr, "%s: not a WAV file\n", path);
+		free(data);
+		return;
+	}
+	while (pos + 8 <= size){
+		long chunk = get_le32(data + pos + 4);
+		if (!memcmp(data + pos, "fmt ", 4) && chunk >= 16)
+			fmt = data + pos + 8;
+		else if (!memcmp(data + pos, "data", 4)){
+			samples = data + pos + 8;
+			samples_size = chunk < size - pos - 8 ? chunk : size - pos - 8;
+		}
+		pos += 8 + chunk + (chunk & 1);
+	}
+	if (!fmt || !samples || get_le16(fmt) != 1 || get_le16(fmt + 14) != 16 || get_le32(fmt + 4) != 8000 ||
+			(channels = get_le16(fmt + 2)) < 1 || channels > 2){
+		fprintf(stderr, "%s: only 8 kHz 16 bit PCM mono or stereo is supported\n", path);
+		free(data);
+		return;
+	}
+
+	call = add_call(name, -1);
+	call->num_samples = samples_size / (2 * channels) / FRAME_SAMPLES * FRAME_SAMPLES;
+	for (c = 0; c < channels; ++c){
+		call->legs[c] = malloc(call->num_samples * sizeof(short));
+		for (i = 0; i < call->num_samples; ++i)
+			call->legs[c][i] = (short)get_le16(samples + (i * channels + c) * 2);
+	}
+	free(data);
+}
+
+static void load_raw(const char* path, const char* name){
+	long size;
+	char* data = read_file(path, &size);
+	struct call* call;
+
+	if (!data){
+		fprintf(stderr, "%s: can't read\n", path);
+		return;
+	}
+	call = add_call(name, -1);
+	call->num_samples = size / 2 / FRAME_SAMPLES * FRAME_SAMPLES;
+	call->legs[0] = (short*)data;
+}
+
+static short ulaw_to_linear(unsigned char u){
+	int t;
+	u = ~u;
+	t = (((u & 0x0f) << 3) + 0x84) << ((u & 0x70) >> 4);
+	return (u & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+
+static short alaw_to_linear(unsigned char a){
+	int t, seg;
+	a ^= 0x55;
+	t = (a & 0x0f) << 4;
+	seg = (a & 0x70) >> 4;
+	if (seg == 0)
+		t += 8;
+	else
+		t = (t + 0x108) << (seg - 1);
+	return (a & 0x80) ? t : -t;
+}
+
+struct rtp_stream{
+	unsigned int	ssrc;
+	short*			samples;
+	int				num_samples;
+	int				size;
+};
+
+/* RTP G.711 streams of a capture, in arrival order (no jitter buffer) */
+static void load_pcap(const char* path, const char* name){
+	long size;
+	unsigned char* data = (unsigned char*)read_file(path, &size);
+	struct rtp_stream* streams = NULL;
+	int num_streams = 0;
+	unsigned int magic;
+	int swapped;
+	unsigned int linktype;
+	long pos = 24;
+	int i;
+
+	if (!data || size < 24){
+		fprintf(stderr, "%s: not a pcap file\n", path);
+		free(data);
+		return;
+	}
+	magic = get_le32(data);
+	swapped = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+	if (!swapped && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d){
+		fprintf(stderr, "%s: not a pcap file (pcapng is not supported)\n", path);
+		free(data);
+		return;
+	}
+	linktype = swapped ? get_be32(data + 20) : get_le32(data + 20);
+
+	while (pos + 16 <= size){
+		unsigned int caplen = swapped ? get_be32(data + pos + 8) : get_le32(data + pos + 8);
+		unsigned char* pkt = data + pos + 16;
+		unsigned char* end = pkt + caplen;
+		unsigned int proto;
+		int ip_version;
+		int flags, cc, payload_type;
+		unsigned int ssrc;
+		struct rtp_stream* stream = NULL;
+
+		pos += 16 + caplen;
+		if (pos > size)
+			break;
+
+		//link layer
+		if (linktype == 1){
+			if (pkt + 14 > end)
+				continue;
+			proto = get_be16(pkt + 12);
+			pkt += 14;
+			if (proto == 0x8100 && pkt + 4 <= end){
+				proto = get_be16(pkt + 2);
+				pkt += 4;
+			}
+		}else if (linktype == 113){
+			if (pkt + 16 > end)
+				continue;
+			proto = get_be16(pkt + 14);
+			pkt += 16;
+		}else if (linktype == 276){
+			if (pkt + 20 > end)
+				continue;
+			proto = get_be16(pkt);
+			pkt += 20;
+		}else if (linktype == 101){
+			proto = (pkt < end && (pkt[0] >> 4) == 6) ? 0x86dd : 0x0800;
+		}else{
+			fprintf(stderr, "%s: unsupported link type %u\n", path, linktype);
+			break;
+		}
+
+		//IP and UDP
+		if (pkt >= end)
+			continue;
+		ip_version = pkt[0] >> 4;
+		if (proto == 0x0800 && ip_version == 4){
+			int ihl = (pkt[0] & 0x0f) * 4;
+			if (pkt + ihl > end || pkt[9] != 17 || (get_be16(pkt + 6) & 0x3fff))
+				continue;	//not UDP, or a fragment
+			pkt += ihl;
+		}else if (proto == 0x86dd && ip_version == 6){
+			if (pkt + 40 > end || pkt[6] != 17)
+				continue;
+			pkt += 40;
+		}else{
+			continue;
+		}
+		if (pkt + 8 > end)
+			continue;
+		pkt += 8;
+
+		//RTP
+		if (pkt + 12 > end || (pkt[0] >> 6) != 2)
+			continue;
+		payload_type = pkt[1] & 0x7f;
+		if (payload_type != 0 && payload_type != 8)
+			continue;
+		flags 	= pkt[0];
+		cc 		= flags & 0x0f;
+		ssrc 	= get_be32(pkt + 8);
+		if (flags & 0x20)
+			end -= end[-1];		//padding
+		pkt += 12 + cc * 4;
+		if ((flags & 0x10) && pkt + 4 <= end)
+			pkt += 4 + get_be16(pkt + 2) * 4;	//header extension
+		if (pkt >= end)
+			continue;
+
+		for (i = 0; i < num_streams; ++i)
+			if (streams[i].ssrc == ssrc)
+				stream = &streams[i];
+		if (!stream){
+			streams = realloc(streams, (num_streams + 1) * sizeof(*streams));
+			stream = &streams[num_streams++];
+			memset(stream, 0, sizeof(*stream));
+			stream->ssrc = ssrc;
+		}
+		if (stream->num_samples + (end - pkt) > stream->size){
+			stream->size = (stream->num_samples + (end - pkt)) * 2;
+			stream->samples = realloc(stream->samples, stream->size * sizeof(short));
+		}
+		for (; pkt < end; ++pkt)
+			stream->samples[stream->num_samples++] = payload_type ? alaw_to_linear(*pkt) : ulaw_to_linear(*pkt);
+	}
+
+	for (i = 0; i < num_streams; ++i){
+		struct call* call = add_call(name, streams[i].ssrc);
+		call->legs[0] 		= streams[i].samples;
+		call->num_samples 	= streams[i].num_samples / FRAME_SAMPLES * FRAME_SAMPLES;
+	}
+	if (!num_streams)
+		fprintf(stderr, "%s: no G.711 RTP streams\n", path);
+	free(streams);
+	free(data);
+}
+
+static void load_path(const char* path){
+	struct stat st;
+	const char* base;
+	const char* ext;
+	char name[256];
+
+	if (stat(path, &st)){
+		fprintf(stderr, "%s: can't stat\n", path);
+		return;
+	}
+	if (S_ISDIR(st.st_mode)){
+		struct dirent** entries;
+		int n = scandir(path, &entries, NULL, alphasort);
+		int i;
+
+		for (i = 0; i < n; ++i){
+			char child[4096];
+			if (entries[i]->d_name[0] != '.'){
+				snprintf(child, sizeof(child), "%s/%s", path, entries[i]->d_name);
+				load_path(child);
+			}
+			free(entries[i]);
+		}
+		if (n >= 0)
+			free(entries);
+		return;
+	}
+
+	base 	= strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	ext 	= strrchr(base, '.') ? strrchr(base, '.') : "";
+	//the name becomes the session id, which is used in file names
+	snprintf(name, sizeof(name), "%.*s", (int)(ext - base), base);
+
+	if (!strcasecmp(ext, ".wav"))
+		load_wav(path, name);
+	else if (!strcasecmp(ext, ".raw") || !strcasecmp(ext, ".sln"))
+		load_raw(path, name);
+	else if (!strcasecmp(ext, ".pcap"))
+		load_pcap(path, name);
+}
+
+/* same segment handling as prepare_segment() in app_vbmixmonitor.c */
+static void prepare_segment(struct mem_storage_t* mem_storage, const char* name, long int cts, long int* prev_ts, int* count){
+	if (segment_should_close(mem_storage, cts - *prev_ts)){
+		close_mem_storage(mem_storage, 0);
+		*prev_ts = cts;
+		++(*count);
+	}
+	if (!is_opened(mem_storage))
+		open_mem_storage(mem_storage, name, *count, cts);
+}
+
+static void replay_call(int index){
+	struct call* call = &calls[index];
+	struct mem_storage_t mem_storage;
+	long int cts = 0;
+	long int prev_ts = 0;
+	int count = 0;
+	int pos;
+	char params[256];
+	char name[300];
+
+	//the call index comes back in callID, so the transport can find the call
+	snprintf(params, sizeof(params), "{\"callId\":\"%d\",\"stereo\":%s,\"sampleRate\":%d}",
+			 index, (stereo && call->legs[1]) ? "true" : "false", sample_rate);
+	snprintf(name, sizeof(name), "Replay/%s", call->name);
+	memset(&mem_storage, 0, sizeof(mem_storage));
+	if (!create_mem_storage(&mem_storage, params)){
+		fprintf(stderr, "%s: out of memory\n", call->name);
+		destroy_mem_storage(&mem_storage);
+		return;
+	}
+
+	for (pos = 0; pos < call->num_samples; pos += FRAME_SAMPLES){
+		const short* read 	= call->legs[0] + pos;
+		const short* write 	= call->legs[1] ? call->legs[1] + pos : NULL;
+
+		prepare_segment(&mem_storage, name, cts, &prev_ts, &count);
+		if (!write)
+			put_data(&mem_storage, read, FRAME_SAMPLES);
+		else if (stereo)
+			put_data_stereo(&mem_storage, read, FRAME_SAMPLES, write, FRAME_SAMPLES);
+		else
+			put_data_mixed(&mem_storage, read, FRAME_SAMPLES, write, FRAME_SAMPLES);
+		cts += FRAME_MS;
+	}
+
+	if (!is_opened(&mem_storage)){
+		open_mem_storage(&mem_storage, name, count, cts);
+		put_silence(&mem_storage, 8000);
+	}
+	close_mem_storage(&mem_storage, 1);
+	destroy_mem_storage(&mem_storage);
+}
+
+static void* replay_thread(void* data){
+	int index;
+
+	while ((index = __atomic_fetch_add(&next_call, 1, __ATOMIC_RELAXED)) < num_calls)
+		replay_call(index);
+	return NULL;
+}
+
+/* Expected segmentation of a call of call_ms in fixed mode: a segment is closed
+ * before the first frame more than segment_length after its start, so every
+ * segment but the last is segment_length plus one frame long. A call shorter
+ * than a frame still gets one segment of a second of silence. */
+static void check_segment(struct call* call, const struct vb_upload_form* form){
+	long long call_ms 	= (long long)call->num_samples * 1000 / 8000;
+	long long seg_ms 	= get_vb_segment_duration() * 1000LL + FRAME_MS;
+	int expected 		= call_ms ? (int)((call_ms + seg_ms - 1) / seg_ms) : 1;
+	int number 			= atoi(form->segmentNumber);
+	long long start_ms 	= number * seg_ms;
+	long long length_ms = call_ms ? (call_ms - start_ms < seg_ms ? call_ms - start_ms : seg_ms) : 1000;
+	int channels 		= (stereo && call->legs[1]) ? 2 : 1;
+	long expected_size 	= 44 + (long)(length_ms * sample_rate / 1000) * 2 * channels;
+	long tolerance 		= sample_rate == 8000 ? 0 : FRAME_SAMPLES * sample_rate / 8000 * 2 * channels;
+	char start_time[64];
+	int last = !strcmp(form->finalSegment, "true");
+
+	snprintf(start_time, sizeof(start_time), "%lld.%03lld", start_ms / 1000, start_ms % 1000);
+
+	if (number >= expected)
+		mismatch("%s: segment %d, expected %d segments\n", call->name, number, expected);
+	if (last != (number == expected - 1))
+		mismatch("%s: segment %d finalSegment=%s\n", call->name, number, form->finalSegment);
+	if (strcmp(form->time_str, start_time))
+		mismatch("%s: segment %d startTime %s, expected %s\n", call->name, number, form->time_str, start_time);
+	if (labs(form->content_size - expected_size) > tolerance)
+		mismatch("%s: segment %d WAV of %ld bytes, expected %ld\n", call->name, number, form->content_size, expected_size);
+}
+
+static int replay_transport(const struct vb_upload_form* form, char* status_str, int status_max_size, long* http_status){
+	struct call* call = &calls[atoi(form->callID)];
+	int res = 0;
+
+	__atomic_fetch_add(&call->segments, 1, __ATOMIC_RELAXED);
+	if (!strcmp(form->finalSegment, "true"))
+		__atomic_fetch_add(&call->final_seen, 1, __ATOMIC_RELAXED);
+	if (verify)
+		check_segment(call, form);
+
+	status_str[0] 	= 0;
+	*http_status 	= 200;
+	if (url){
+		res = curl_post_segment(form, status_str, status_max_size, http_status);
+	}else if (out_dir){
+		struct vb_form_template* own_tmpl = NULL;
+		const struct vb_form_template* tmpl = form->tmpl;
+		struct vb_upload_body body;
+		char path[4096];
+		FILE* f;
+		int i;
+
+		snprintf(path, sizeof(path), "%s/%s.post", out_dir, form->content_name);
+		if (!tmpl)
+			tmpl = own_tmpl = vb_form_template_create(form);
+		if (!tmpl || vb_upload_body_init(&body, tmpl, form)){
+			fprintf(stderr, "Can't render %s\n", path);
+		}else if ((f = fopen(path, "wb"))){
+			for (i = 0; i < VB_UPLOAD_BODY_PARTS; ++i)
+				fwrite(body.parts[i], 1, body.sizes[i], f);
+			fclose(f);
+		}else{
+			fprintf(stderr, "Can't write %s\n", path);
+		}
+		vb_form_template_free(own_tmpl);
+	}
+	return res;
+}
+
+static double cpu_seconds(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void usage(const char* prog){
+	fprintf(stderr, "usage: %s [-j threads] [-l segment seconds] [-m fixed|pause] [-e off|compress|drop]\n"
+					"          [-r sample rate] [-s] [-u url | -o dir] [-v] file|dir...\n"
+					"  -s  stereo segments for two leg captures (mixed by default)\n"
+					"  -u  upload the segments to this URL\n"
+					"  -o  write the POST bodies to this directory\n", prog);
+}
+
+int main(int argc, char** argv){
+	static const struct vb_platform platform = { NULL, NULL, NULL, tool_log };
+	pthread_t* threads;
+	int num_threads = 1;
+	long long audio_samples = 0;
+	long long wall;
+	double cpu;
+	struct vb_stats stats;
+	int expected_segments = 0;
+	int opt;
+	int i;
+
+	vb_platform_set(&platform);
+	set_defaults();
+
+	while ((opt = getopt(argc, argv, "j:l:m:e:r:su:o:vh")) != -1){
+		switch (opt){
+		case 'j': num_threads = atoi(optarg); break;
+		case 'l': set_vb_segment_duration(atoi(optarg)); break;
+		case 'm': set_vb_segment_mode(parse_segment_mode(optarg)); break;
+		case 'e': set_vb_silence_elision(parse_silence_elision(optarg)); break;
+		case 'r': sample_rate = atoi(optarg); break;
+		case 's': stereo = 1; break;
+		case 'u': url = optarg; break;
+		case 'o': out_dir = optarg; break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (url)
+		set_vb_api_url(url);
+	vb_config_apply();
+	if (optind >= argc || num_threads < 1 || get_vb_segment_duration() < 1 ||
+			sample_rate < VB_MIN_SAMPLE_RATE || sample_rate > VB_MAX_SAMPLE_RATE){
+		usage(argv[0]);
+		return 1;
+	}
+	verify = get_vb_segment_mode() == VB_SEGMENT_FIXED && get_vb_silence_elision() == VB_ELISION_OFF;
+
+	for (i = optind; i < argc; ++i)
+		load_path(argv[i]);
+	if (!num_calls){
+		fprintf(stderr, "No calls to replay\n");
+		return 1;
+	}
+	for (i = 0; i < num_calls; ++i)
+		audio_samples += calls[i].num_samples;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+	set_vb_transport(replay_transport);
+	vb_pipeline_start();
+
+	threads = calloc(num_threads, sizeof(*threads));
+	wall 	= vb_now_us();
+	cpu 	= cpu_seconds();
+	for (i = 0; i < num_threads; ++i)
+		pthread_create(&threads[i], NULL, replay_thread, NULL);
+	for (i = 0; i < num_threads; ++i)
+		pthread_join(threads[i], NULL);
+	//drains the encode and upload workers
+	vb_pipeline_stop();
+	wall 	= vb_now_us() - wall;
+	cpu 	= cpu_seconds() - cpu;
+	free(threads);
+
+	if (verify){
+		for (i = 0; i < num_calls; ++i){
+			long long call_ms 	= (long long)calls[i].num_samples * 1000 / 8000;
+			long long seg_ms 	= get_vb_segment_duration() * 1000LL + FRAME_MS;
+			int expected 		= call_ms ? (int)((call_ms + seg_ms - 1) / seg_ms) : 1;
+
+			expected_segments += expected;
+			if (calls[i].segments != expected || calls[i].final_seen != 1)
+				mismatch("%s: %d segments (%d final), expected %d\n", calls[i].name, calls[i].segments, calls[i].final_seen, expected);
+		}
+	}
+
+	vb_stats_snapshot(&stats);
+	printf("%d calls, %.1f call-minutes, %lld segments (%lld failed), %lld bytes\n",
+		   num_calls, audio_samples / 8000.0 / 60, stats.segments_closed, stats.segments_failed, stats.bytes_uploaded);
+	printf("%.2f s wall, %.2f s CPU, %.1f call-minutes per CPU-second, %.0fx real time per core\n",
+		   wall / 1e6, cpu, audio_samples / 8000.0 / 60 / cpu, audio_samples / 8000.0 / cpu);
+	if (verify)
+		printf("verification: %d segments expected, %d mismatches\n", expected_segments, mismatches);
+	else
+		printf("verification skipped, the segmentation depends on the audio\n");
+
+	for (i = 0; i < num_calls; ++i){
+		free(calls[i].legs[0]);
+		free(calls[i].legs[1]);
+	}
+	free(calls);
+	curl_global_cleanup();
+	return mismatches ? 2 : 0;
+}
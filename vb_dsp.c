@@ -0,0 +1,552 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VB_HAVE_AVX2_DISPATCH 1
+#endif
+
+#include "vb_platform.h"
+#include "vb_dsp.h"
+
+void vb_interleave_s16(short* dst, const short* left, const short* right, int num_samples){
+	int i = 0;
+#if defined(__SSE2__)
+	for (; i + 8 <= num_samples; i += 8){
+		__m128i l = _mm_loadu_si128((const __m128i*)(left + i));
+		__m128i r = _mm_loadu_si128((const __m128i*)(right + i));
+		_mm_storeu_si128((__m128i*)(dst + 2 * i), 	 _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i*)(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+	}
+#endif
+	for (; i < num_samples; ++i){
+		dst[2 * i] 		= left[i];
+		dst[2 * i + 1] 	= right[i];
+	}
+}
+
+void vb_mix_s16(short* dst, const short* a, const short* b, int num_samples){
+	int i = 0;
+#if defined(__SSE2__)
+	for (; i + 8 <= num_samples; i += 8){
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epi16(va, vb));
+	}
+#endif
+	for (; i < num_samples; ++i){
+		int sum = a[i] + b[i];
+		dst[i] = sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+	}
+}
+
+static void gain_scalar(short* samples, int i, int n, int volfactor){
+	for (; i < n; ++i){
+		int v = volfactor > 0 ? samples[i] * volfactor : samples[i] / -volfactor;
+		samples[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+	}
+}
+
+void vb_gain_s16(short* samples, int num_samples, int volfactor){
+	int i = 0;
+
+	if (volfactor == 0 || volfactor == 1 || volfactor == -1)
+		return;
+#if defined(__SSE2__)
+	if (volfactor > 0 && volfactor <= 32767){
+		//16x16 -> 32 bit products, packed back with signed saturation
+		__m128i g = _mm_set1_epi16((short)volfactor);
+		for (; i + 8 <= num_samples; i += 8){
+			__m128i x 	= _mm_loadu_si128((const __m128i*)(samples + i));
+			__m128i lo 	= _mm_mullo_epi16(x, g);
+			__m128i hi 	= _mm_mulhi_epi16(x, g);
+			_mm_storeu_si128((__m128i*)(samples + i),
+							 _mm_packs_epi32(_mm_unpacklo_epi16(lo, hi), _mm_unpackhi_epi16(lo, hi)));
+		}
+	}else if (volfactor < 0 && volfactor >= -32768 && !(-volfactor & (-volfactor - 1))){
+		//power of two divisor: bias negative samples so the shift truncates towards zero like C division
+		int shift = __builtin_ctz(-volfactor);
+		__m128i bias = _mm_set1_epi16((short)(-volfactor - 1));
+		for (; i + 8 <= num_samples; i += 8){
+			__m128i x 	= _mm_loadu_si128((const __m128i*)(samples + i));
+			__m128i neg = _mm_srai_epi16(x, 15);
+			_mm_storeu_si128((__m128i*)(samples + i),
+							 _mm_sra_epi16(_mm_add_epi16(x, _mm_and_si128(neg, bias)), _mm_cvtsi32_si128(shift)));
+		}
+	}
+#endif
+	gain_scalar(samples, i, num_samples, volfactor);
+}
+
+/* Scalar tail shared by all frame_stats variants, starts at sample i */
+static void frame_stats_tail(const short* s, int i, int n, unsigned long long* energy, int* zc){
+	if (i == 0 && n > 0){
+		*energy += (unsigned long long)((int)s[0] * s[0]);
+		i = 1;
+	}
+	for (; i < n; ++i){
+		*energy += (unsigned long long)((int)s[i] * s[i]);
+		*zc 	+= ((s[i] ^ s[i - 1]) < 0);
+	}
+}
+
+static void frame_stats_scalar(const short* s, int n, struct vb_frame_stats* stats){
+	unsigned long long energy = 0;
+	int zc = 0;
+
+	frame_stats_tail(s, 0, n, &energy, &zc);
+	stats->energy = energy;
+	stats->zero_crossings = zc;
+	stats->num_samples = n;
+}
+
+#if defined(__SSE2__)
+/* Sample 0 is handled by the tail, the vector body covers [1, n) so that
+ * s[i] and s[i - 1] can both be loaded without a boundary check.
+ * madd(x, x) sums two squares into 32 bits, which only exceeds INT_MAX for
+ * two -32768 samples, so the partial sums are widened as unsigned. */
+static void frame_stats_sse2(const short* s, int n, struct vb_frame_stats* stats){
+	unsigned long long energy = 0;
+	int zc = 0;
+	int i = 1;
+	__m128i zero 	= _mm_setzero_si128();
+	__m128i ones 	= _mm_set1_epi16(1);
+	__m128i e_acc 	= _mm_setzero_si128();
+	__m128i zc_acc 	= _mm_setzero_si128();
+
+	if (n <= 0){
+		frame_stats_scalar(s, n, stats);
+		return;
+	}
+
+	for (; i + 8 <= n; i += 8){
+		__m128i cur 	= _mm_loadu_si128((const __m128i*)(s + i));
+		__m128i prev 	= _mm_loadu_si128((const __m128i*)(s + i - 1));
+		__m128i sq 		= _mm_madd_epi16(cur, cur);
+		__m128i sign 	= _mm_srli_epi16(_mm_xor_si128(cur, prev), 15);
+
+		e_acc 	= _mm_add_epi64(e_acc, _mm_unpacklo_epi32(sq, zero));
+		e_acc 	= _mm_add_epi64(e_acc, _mm_unpackhi_epi32(sq, zero));
+		zc_acc 	= _mm_add_epi32(zc_acc, _mm_madd_epi16(sign, ones));
+	}
+	{
+		unsigned long long e[2];
+		int z[4];
+		_mm_storeu_si128((__m128i*)e, e_acc);
+		_mm_storeu_si128((__m128i*)z, zc_acc);
+		energy 	= e[0] + e[1] + (unsigned long long)((int)s[0] * s[0]);
+		zc 		= z[0] + z[1] + z[2] + z[3];
+	}
+	frame_stats_tail(s, i, n, &energy, &zc);
+	stats->energy = energy;
+	stats->zero_crossings = zc;
+	stats->num_samples = n;
+}
+#endif
+
+#ifdef VB_HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static void frame_stats_avx2(const short* s, int n, struct vb_frame_stats* stats){
+	unsigned long long energy = 0;
+	int zc = 0;
+	int i = 1;
+	__m256i zero 	= _mm256_setzero_si256();
+	__m256i ones 	= _mm256_set1_epi16(1);
+	__m256i e_acc 	= _mm256_setzero_si256();
+	__m256i zc_acc 	= _mm256_setzero_si256();
+
+	if (n <= 0){
+		frame_stats_scalar(s, n, stats);
+		return;
+	}
+
+	for (; i + 16 <= n; i += 16){
+		__m256i cur 	= _mm256_loadu_si256((const __m256i*)(s + i));
+		__m256i prev 	= _mm256_loadu_si256((const __m256i*)(s + i - 1));
+		__m256i sq 		= _mm256_madd_epi16(cur, cur);
+		__m256i sign 	= _mm256_srli_epi16(_mm256_xor_si256(cur, prev), 15);
+
+		e_acc 	= _mm256_add_epi64(e_acc, _mm256_unpacklo_epi32(sq, zero));
+		e_acc 	= _mm256_add_epi64(e_acc, _mm256_unpackhi_epi32(sq, zero));
+		zc_acc 	= _mm256_add_epi32(zc_acc, _mm256_madd_epi16(sign, ones));
+	}
+	{
+		unsigned long long e[4];
+		int z[8];
+		_mm256_storeu_si256((__m256i*)e, e_acc);
+		_mm256_storeu_si256((__m256i*)z, zc_acc);
+		energy 	= e[0] + e[1] + e[2] + e[3] + (unsigned long long)((int)s[0] * s[0]);
+		zc 		= z[0] + z[1] + z[2] + z[3] + z[4] + z[5] + z[6] + z[7];
+	}
+	//leaving dirty upper halves slows down all following SSE code (libm included)
+	_mm256_zeroupper();
+	frame_stats_tail(s, i, n, &energy, &zc);
+	stats->energy = energy;
+	stats->zero_crossings = zc;
+	stats->num_samples = n;
+}
+#endif
+
+static void frame_stats_resolve(const short* s, int n, struct vb_frame_stats* stats);
+
+static void (*frame_stats_impl)(const short* s, int n, struct vb_frame_stats* stats) = frame_stats_resolve;
+
+/* Picks the best kernel on first use. Concurrent first calls all store the same pointer. */
+static void frame_stats_resolve(const short* s, int n, struct vb_frame_stats* stats){
+	frame_stats_impl = frame_stats_scalar;
+#if defined(__SSE2__)
+	frame_stats_impl = frame_stats_sse2;
+#endif
+#ifdef VB_HAVE_AVX2_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		frame_stats_impl = frame_stats_avx2;
+#endif
+	frame_stats_impl(s, n, stats);
+}
+
+void vb_frame_stats_s16(const short* samples, int num_samples, struct vb_frame_stats* stats){
+	frame_stats_impl(samples, num_samples, stats);
+}
+
+void vb_vad_init(struct vb_vad* vad, int threshold_dbfs){
+	vad->threshold 		= 32768.0 * 32768.0 * pow(10.0, threshold_dbfs / 10.0);
+	vad->noise_floor 	= vad->threshold;
+	vad->hangover 		= 0;
+	vad->speech 		= 0;
+}
+
+int vb_vad_process(struct vb_vad* vad, const short* samples, int num_samples){
+	struct vb_frame_stats stats;
+
+	if (num_samples <= 0)
+		return vad->speech;
+
+	vb_frame_stats_s16(samples, num_samples, &stats);
+	return vb_vad_update(vad, &stats);
+}
+
+int vb_vad_update(struct vb_vad* vad, const struct vb_frame_stats* stats){
+	int num_samples = stats->num_samples;
+	double mean_square;
+	double threshold;
+	int active;
+
+	if (num_samples <= 0)
+		return vad->speech;
+
+	mean_square = (double)stats->energy / num_samples;
+
+	//the noise floor follows drops immediately and rises slowly (~5s at 20ms frames)
+	if (mean_square < vad->noise_floor)
+		vad->noise_floor = (vad->noise_floor + mean_square) / 2;
+	else
+		vad->noise_floor += (mean_square - vad->noise_floor) / 256;
+	if (vad->noise_floor < 1.0)
+		vad->noise_floor = 1.0;
+
+	threshold = vad->noise_floor * 4;
+	if (threshold < vad->threshold)
+		threshold = vad->threshold;
+
+	//voiced speech is loud, unvoiced fricatives are quieter but cross zero often
+	active = mean_square > threshold ||
+			 (mean_square > threshold / 4 && stats->zero_crossings * 10 > num_samples * 3);
+
+	if (active)
+		vad->hangover = VB_VAD_HANGOVER_FRAMES;
+	else if (vad->hangover > 0)
+		--vad->hangover;
+
+	vad->speech = active || vad->hangover > 0;
+	return vad->speech;
+}
+
+#define LPC_ORDER 		8
+#define LPC_SAMPLES 	80		//10 ms analysis window at the start of the frame
+
+static short lpc_window[LPC_SAMPLES];
+static volatile int lpc_window_ready;
+
+/* Hamming window in Q15. Concurrent first calls compute identical values. */
+static const short* get_lpc_window(){
+	if (!lpc_window_ready){
+		int i;
+		for (i = 0; i < LPC_SAMPLES; ++i)
+			lpc_window[i] = (short)(32767.0 * (0.54 - 0.46 * cos(2 * M_PI * i / (LPC_SAMPLES - 1))));
+		__sync_synchronize();
+		lpc_window_ready = 1;
+	}
+	return lpc_window;
+}
+
+/* Autocorrelation r[0..LPC_ORDER] of the windowed frame. The window also
+ * scales the samples down to 13 bits, so the 32 bit lane sums cannot overflow.
+ * The frame is zero padded to whole vectors plus LPC_ORDER, so every lag runs
+ * the vector loop to the end without a scalar tail. */
+static void autocorr_s16(const short* samples, int n, double* r){
+	const short* window = get_lpc_window();
+	short x[LPC_SAMPLES + LPC_ORDER + 8];
+	int padded;
+	int i;
+	int k;
+
+	if (n > LPC_SAMPLES)
+		n = LPC_SAMPLES;
+	padded = (n + 7) & ~7;
+
+	i = 0;
+#if defined(__SSE2__)
+	for (; i + 8 <= n; i += 8)
+		_mm_storeu_si128((__m128i*)(x + i), _mm_srai_epi16(_mm_mulhi_epi16(_mm_loadu_si128((const __m128i*)(samples + i)),
+																			 _mm_loadu_si128((const __m128i*)(window + i))), 2));
+#endif
+	for (; i < n; ++i)
+		x[i] = (short)(((int)samples[i] * window[i]) >> 16) >> 2;
+	memset(x + n, 0, (padded + LPC_ORDER - n) * sizeof(short));
+
+#if defined(__SSE2__)
+	{
+		//all lags in one pass, x[i..i+7] is loaded once per block
+		__m128i acc[LPC_ORDER + 1];
+		int z[4];
+		for (k = 0; k <= LPC_ORDER; ++k)
+			acc[k] = _mm_setzero_si128();
+		for (i = 0; i < padded; i += 8){
+			__m128i cur = _mm_loadu_si128((const __m128i*)(x + i));
+			for (k = 0; k <= LPC_ORDER; ++k)
+				acc[k] = _mm_add_epi32(acc[k], _mm_madd_epi16(cur, _mm_loadu_si128((const __m128i*)(x + i + k))));
+		}
+		for (k = 0; k <= LPC_ORDER; ++k){
+			_mm_storeu_si128((__m128i*)z, acc[k]);
+			r[k] = (double)((long long)z[0] + z[1] + z[2] + z[3]);
+		}
+	}
+#else
+	for (k = 0; k <= LPC_ORDER; ++k){
+		long long sum = 0;
+		for (i = 0; i + k < n; ++i)
+			sum += (int)x[i] * x[i + k];
+		r[k] = (double)sum;
+	}
+#endif
+}
+
+double vb_frame_flatness_s16(const short* samples, int num_samples){
+	double r[LPC_ORDER + 1];
+	double a[LPC_ORDER + 1];
+	double err;
+	int i;
+	int j;
+
+	autocorr_s16(samples, num_samples, r);
+	if (r[0] <= 0)
+		return 1.0;
+
+	//Levinson-Durbin, only the final prediction error is needed
+	err = r[0] * (1.0 + 1e-9);	//tiny white noise correction keeps pure tones stable
+	memset(a, 0, sizeof(a));
+	for (i = 1; i <= LPC_ORDER; ++i){
+		double acc = r[i];
+		double k;
+		for (j = 1; j < i; ++j)
+			acc -= a[j] * r[i - j];
+		k = acc / err;
+		for (j = 1; j <= i / 2; ++j){
+			double aj 	= a[j];
+			double aij 	= a[i - j];
+			a[j] 		= aj - k * aij;
+			a[i - j] 	= aij - k * aj;
+		}
+		a[i] = k;
+		err *= (1.0 - k * k);
+		if (err <= 0)
+			return 0.0;
+	}
+	return err / r[0];
+}
+
+void vb_tone_init(struct vb_tone_detector* det, int hold_ms, int threshold_dbfs){
+	memset(det, 0, sizeof(*det));
+	det->hold_ms 			= hold_ms;
+	det->log_threshold 		= log(32768.0 * 32768.0) + threshold_dbfs * log(10.0) / 10.0;
+	det->mean_log_flatness 	= log(0.1);
+}
+
+int vb_tone_process(struct vb_tone_detector* det, const short* samples, const struct vb_frame_stats* stats){
+	double log_energy;
+	double diff;
+	int candidate;
+	int interval_ms;
+	int audible;
+
+	if (stats->num_samples <= 0 || ++det->frame < VB_TONE_ANALYSIS_INTERVAL)
+		return det->active;
+	det->frame = 0;
+	interval_ms = VB_TONE_ANALYSIS_INTERVAL * stats->num_samples / 8;
+
+	//the envelope and activity are tracked over ~1.3s (16 analyses)
+	log_energy = log((double)stats->energy / stats->num_samples + 1.0);
+	//an absolute level: the VAD noise floor would adapt to steady music and call it silence
+	audible = log_energy > det->log_threshold;
+	if (!det->primed){
+		det->mean_log_energy = log_energy;
+		det->primed = 1;
+	}
+	diff = log_energy - det->mean_log_energy;
+	det->mean_log_energy 	+= diff / 16;
+	det->var_log_energy 	+= (diff * diff - det->var_log_energy) / 16;
+	det->activity 			+= ((audible ? 1.0 : 0.0) - det->activity) / 16;
+
+	//the flatness is only meaningful for audible frames (tone cadence gaps keep the last value)
+	if (audible)
+		det->mean_log_flatness += (log(vb_frame_flatness_s16(samples, stats->num_samples) + 1e-9) - det->mean_log_flatness) / 4;
+
+	//tones: very low flatness. music: no pauses, a flat envelope (speech modulates by 10 dB and more)
+	//and a harmonic spectrum (steady line noise is flat in time but also spectrally flat)
+	candidate = det->mean_log_flatness < -5.5 ||
+				(det->activity > 0.95 && det->var_log_energy < 0.5 && det->mean_log_flatness < -2.5);
+
+	if (candidate)
+		det->candidate_ms += interval_ms;
+	else
+		det->candidate_ms = 0;
+
+	det->active = det->candidate_ms >= det->hold_ms;
+	return det->active;
+}
+
+/* Zeroth order modified Bessel function of the first kind, for the Kaiser window */
+static double bessel_i0(double x){
+	double sum 	= 1.0;
+	double term = 1.0;
+	int k;
+	for (k = 1; k < 50 && term > sum * 1e-12; ++k){
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static int gcd(int a, int b){
+	while (b){
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+#define RESAMPLER_KAISER_BETA	5.65	//~60 dB stopband
+#define RESAMPLER_COEF_SHIFT	14		//Q14 keeps the 32 bit dot product sums from overflowing
+
+int vb_resampler_init(struct vb_resampler* rs, int in_rate, int out_rate){
+	int g;
+	int len;
+	int i;
+	int p;
+	double cutoff;
+	double* proto;
+
+	memset(rs, 0, sizeof(*rs));
+	if (in_rate <= 0 || out_rate <= 0)
+		return -1;
+	g 			= gcd(in_rate, out_rate);
+	rs->up 		= out_rate / g;
+	rs->down 	= in_rate / g;
+	if (rs->up > VB_RESAMPLER_MAX_PHASES)
+		return -1;
+
+	//prototype low pass at up * in_rate, cut off just below the lower of the two Nyquist rates
+	len 	= rs->up * VB_RESAMPLER_TAPS;
+	cutoff 	= 0.475 * (in_rate < out_rate ? in_rate : out_rate) / ((double)rs->up * in_rate);
+	proto 	= vb_malloc(len * sizeof(double));
+	rs->coefs = vb_malloc(len * sizeof(short));
+	if (!proto || !rs->coefs){
+		vb_free(proto);
+		vb_resampler_destroy(rs);
+		return -1;
+	}
+	for (i = 0; i < len; ++i){
+		double t = i - (len - 1) / 2.0;
+		double w = 2.0 * i / (len - 1) - 1.0;
+		double sinc = t == 0 ? 1.0 : sin(2 * M_PI * cutoff * t) / (2 * M_PI * cutoff * t);
+		proto[i] = 2 * cutoff * sinc * bessel_i0(RESAMPLER_KAISER_BETA * sqrt(1.0 - w * w)) / bessel_i0(RESAMPLER_KAISER_BETA);
+	}
+
+	//phase p uses proto[p + j * up]; every phase is normalised to unity gain at DC
+	for (p = 0; p < rs->up; ++p){
+		double sum = 0;
+		int j;
+		for (j = 0; j < VB_RESAMPLER_TAPS; ++j)
+			sum += proto[p + j * rs->up];
+		for (j = 0; j < VB_RESAMPLER_TAPS; ++j)
+			rs->coefs[p * VB_RESAMPLER_TAPS + VB_RESAMPLER_TAPS - 1 - j] =
+				(short)lrint(proto[p + j * rs->up] / sum * (1 << RESAMPLER_COEF_SHIFT));
+	}
+	vb_free(proto);
+	return 0;
+}
+
+void vb_resampler_destroy(struct vb_resampler* rs){
+	vb_free(rs->coefs);
+	rs->coefs = NULL;
+}
+
+int vb_resampler_max_output(const struct vb_resampler* rs, int num_samples){
+	return (int)(((long long)num_samples * rs->up) / rs->down) + 1;
+}
+
+static short resampler_dot(const short* coefs, const short* x){
+	int sum;
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	int j;
+	for (j = 0; j < VB_RESAMPLER_TAPS; j += 8)
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(coefs + j)),
+												_mm_loadu_si128((const __m128i*)(x + j))));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	sum = _mm_cvtsi128_si32(acc);
+#else
+	int j;
+	sum = 0;
+	for (j = 0; j < VB_RESAMPLER_TAPS; ++j)
+		sum += coefs[j] * x[j];
+#endif
+	sum = (sum + (1 << (RESAMPLER_COEF_SHIFT - 1))) >> RESAMPLER_COEF_SHIFT;
+	return sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+}
+
+int vb_resampler_process(struct vb_resampler* rs, const short* in, int num_samples, short* out){
+	const int step 		= rs->down / rs->up;
+	const int step_frac = rs->down % rs->up;
+	short* chunk 		= rs->buf + VB_RESAMPLER_TAPS - 1;
+	int produced 		= 0;
+
+	while (num_samples > 0){
+		int n = num_samples > VB_RESAMPLER_CHUNK ? VB_RESAMPLER_CHUNK : num_samples;
+
+		memcpy(chunk, in, n * sizeof(short));
+
+		//output centred on chunk[index] uses chunk[index - TAPS + 1 .. index], i.e. buf[index .. index + TAPS - 1]
+		while (rs->index < n){
+			out[produced++] = resampler_dot(rs->coefs + rs->phase * VB_RESAMPLER_TAPS, rs->buf + rs->index);
+			rs->index += step;
+			rs->phase += step_frac;
+			if (rs->phase >= rs->up){
+				rs->phase -= rs->up;
+				++rs->index;
+			}
+		}
+		rs->index -= n;
+
+		memmove(rs->buf, rs->buf + n, (VB_RESAMPLER_TAPS - 1) * sizeof(short));
+		in 			+= n;
+		num_samples -= n;
+	}
+	return produced;
+}
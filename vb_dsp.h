@@ -0,0 +1,97 @@
+#ifndef VB_DSP_H
+#define VB_DSP_H
+
+/* Sample processing kernels used by the segment storage.
+ * All kernels work on signed 16 bit linear samples and have an SSE2 body
+ * with a scalar tail, so they are safe to call with any length/alignment. */
+
+/* dst[2*i] = left[i], dst[2*i+1] = right[i] */
+void vb_interleave_s16(short* dst, const short* left, const short* right, int num_samples);
+
+/* dst[i] = saturate(a[i] + b[i]), dst may alias a or b */
+void vb_mix_s16(short* dst, const short* a, const short* b, int num_samples);
+
+/* In place volume adjustment with the ast_frame_adjust_volume() semantics:
+ * a positive factor multiplies, a negative one divides by its absolute value
+ * (truncating towards zero), 0 leaves the samples alone. Results saturate. */
+void vb_gain_s16(short* samples, int num_samples, int volfactor);
+
+struct vb_frame_stats{
+	unsigned long long	energy;			//sum of squared samples
+	int					zero_crossings;	//number of sign changes between neighbour samples
+	int					num_samples;
+};
+
+/* Energy and zero crossing count of one frame. Uses AVX2 when the CPU has it. */
+void vb_frame_stats_s16(const short* samples, int num_samples, struct vb_frame_stats* stats);
+
+#define VB_VAD_HANGOVER_FRAMES	10
+
+/* Streaming energy/zero crossing voice activity detector.
+ * The threshold adapts to the background noise floor but never drops
+ * below the configured absolute level. */
+struct vb_vad{
+	double 	threshold;		//absolute mean square threshold
+	double 	noise_floor;	//tracked mean square of the background
+	int		hangover;		//frames left before a pause is reported
+	int		speech;			//decision for the last frame
+};
+
+void vb_vad_init(struct vb_vad* vad, int threshold_dbfs);
+/* returns 1 if the frame is (or trails within the hangover) speech */
+int vb_vad_process(struct vb_vad* vad, const short* samples, int num_samples);
+/* same as vb_vad_process() for callers that already have the frame statistics */
+int vb_vad_update(struct vb_vad* vad, const struct vb_frame_stats* stats);
+
+/* Normalised LPC prediction error of a frame (a spectral flatness estimate):
+ * close to 1 for noise, ~0.01-0.1 for speech and far below that for tones. */
+double vb_frame_flatness_s16(const short* samples, int num_samples);
+
+#define VB_TONE_ANALYSIS_INTERVAL	4	//frames between two flatness estimates
+
+/* Streaming hold music / call progress tone detector.
+ * Flags audio that is continuously active with a flat envelope (music) or
+ * strongly tonal (ringback, busy, dial tones) for longer than hold_ms, and
+ * drops the flag as soon as the envelope starts to look like speech again. */
+struct vb_tone_detector{
+	int		frame;
+	int		primed;
+	int		hold_ms;
+	int		candidate_ms;		//how long the audio has looked like music/tones
+	double	mean_log_energy;
+	double	var_log_energy;		//envelope modulation, high for speech
+	double	mean_log_flatness;
+	double	activity;			//share of audible frames
+	double	log_threshold;		//audibility level, log of the mean square
+	int		active;
+};
+
+void vb_tone_init(struct vb_tone_detector* det, int hold_ms, int threshold_dbfs);
+/* returns 1 while music or tones are detected */
+int vb_tone_process(struct vb_tone_detector* det, const short* samples, const struct vb_frame_stats* stats);
+
+#define VB_RESAMPLER_TAPS		32		//filter taps per phase, a multiple of 8
+#define VB_RESAMPLER_CHUNK		320		//input samples filtered per pass
+#define VB_RESAMPLER_MAX_PHASES	512
+
+/* Streaming rational polyphase resampler (Kaiser windowed sinc, ~60 dB stopband).
+ * The filter history and output phase are carried over between calls, so a
+ * stream can be fed frame by frame without artifacts at the frame boundaries. */
+struct vb_resampler{
+	int		up;				//interpolation factor
+	int		down;			//decimation factor
+	short*	coefs;			//up phases of VB_RESAMPLER_TAPS Q14 taps, reversed for a forward dot product
+	int		phase;			//phase of the next output sample
+	int		index;			//input sample the next output is centred on, relative to the current chunk
+	short	buf[VB_RESAMPLER_TAPS - 1 + VB_RESAMPLER_CHUNK];	//filter history followed by the current chunk
+};
+
+/* returns 0 on success, -1 for unsupported rates (more than VB_RESAMPLER_MAX_PHASES phases) or no memory */
+int vb_resampler_init(struct vb_resampler* rs, int in_rate, int out_rate);
+void vb_resampler_destroy(struct vb_resampler* rs);
+/* upper bound of the output samples produced for num_samples input samples */
+int vb_resampler_max_output(const struct vb_resampler* rs, int num_samples);
+/* returns the number of samples written to out */
+int vb_resampler_process(struct vb_resampler* rs, const short* in, int num_samples, short* out);
+
+#endif
@@ -0,0 +1,592 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vb_platform.h"
+#include "vb_pipeline.h"
+#include "vb_stats.h"
+
+struct vb_worker{
+	struct vb_stage*	stage;
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		//a job was queued or the worker must stop
+	pthread_cond_t		room;		//a job was taken off a full queue
+	struct vb_job*		head;
+	struct vb_job*		tail;
+	int					depth;
+	int					busy;
+	int					stop;
+	unsigned long		processed;
+};
+
+#define FAIR_QUANTUM	65536	//cost credited to a tenant per round, about the audio of a few seconds
+
+struct vb_tenant{
+	struct vb_tenant*	next;		//all tenants of the stage
+	struct vb_tenant*	ring_next;	//tenants with jobs queued, in round robin order
+	struct vb_tenant*	ring_prev;
+	int					in_ring;
+	struct vb_job*		head;
+	struct vb_job*		tail;
+	int					queued;
+	int					backlog;	//jobs admitted, queued or on their way, not started
+	int					running;
+	long long			running_cost;
+	long long			deficit;
+	int					is_default;	//jobs without a tenant, and those of tenants that could not be allocated
+	unsigned int		hash;
+	char				key[];
+};
+
+struct vb_fair{
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		//a job was queued, finished, or the workers must stop
+	pthread_cond_t		room;
+	struct vb_fair_limits	limits;
+	struct vb_tenant*	tenants;
+	struct vb_tenant*	current;	//where the round robin is
+	int					active;		//tenants in the ring
+	int					num_tenants;
+	int					depth;
+	int					depth_limit;	//shared out among the tenants with a backlog
+	unsigned int*		running_routes;	//one per worker
+	int					running;
+	int					stop;
+	unsigned long		processed;
+	struct vb_tenant	default_tenant;
+};
+
+struct vb_stage{
+	char				name[32];
+	int					num_workers;
+	int					queue_limit;
+	vb_stage_fn			process;
+	struct vb_histogram* queue_wait;
+	struct vb_worker*	workers;
+	struct vb_fair*		fair;		//NULL: jobs go to the queue of a worker
+};
+
+static void queue_push(struct vb_worker* worker, struct vb_job* job){
+	job->next = NULL;
+	if (worker->tail)
+		worker->tail->next = job;
+	else
+		worker->head = job;
+	worker->tail = job;
+}
+
+static struct vb_job* queue_pop(struct vb_worker* worker){
+	struct vb_job* job = worker->head;
+
+	if (job && !(worker->head = job->next))
+		worker->tail = NULL;
+	return job;
+}
+
+static void* worker_thread(void* data){
+	struct vb_worker* worker = data;
+	struct vb_job* job;
+
+	pthread_mutex_lock(&worker->lock);
+	for (;;){
+		while (!worker->head && !worker->stop)
+			pthread_cond_wait(&worker->work, &worker->lock);
+		//stop only once the queue is drained
+		if (!(job = queue_pop(worker)))
+			break;
+		--worker->depth;
+		worker->busy = 1;
+		pthread_cond_signal(&worker->room);
+		pthread_mutex_unlock(&worker->lock);
+
+		if (worker->stage->queue_wait)
+			vb_histogram_record(worker->stage->queue_wait, vb_now_us() - job->queued);
+		worker->stage->process(job);
+
+		pthread_mutex_lock(&worker->lock);
+		worker->busy = 0;
+		++worker->processed;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+static int route_running(struct vb_fair* fair, unsigned int route){
+	int i;
+
+	for (i = 0; i < fair->running; ++i){
+		if (fair->running_routes[i] == route)
+			return 1;
+	}
+	return 0;
+}
+
+static void route_done(struct vb_fair* fair, unsigned int route){
+	int i;
+
+	for (i = 0; i < fair->running; ++i){
+		if (fair->running_routes[i] == route){
+			fair->running_routes[i] = fair->running_routes[--fair->running];
+			return;
+		}
+	}
+}
+
+static void ring_insert(struct vb_fair* fair, struct vb_tenant* tenant){
+	//a new tenant waits for its turn: it goes last in the round
+	if (!fair->current){
+		tenant->ring_next = tenant->ring_prev = tenant;
+		fair->current = tenant;
+	}else{
+		tenant->ring_next = fair->current;
+		tenant->ring_prev = fair->current->ring_prev;
+		tenant->ring_prev->ring_next = tenant;
+		fair->current->ring_prev = tenant;
+	}
+	tenant->in_ring = 1;
+	++fair->active;
+}
+
+static void ring_remove(struct vb_fair* fair, struct vb_tenant* tenant){
+	if (tenant->ring_next == tenant){
+		fair->current = NULL;
+	}else{
+		tenant->ring_prev->ring_next = tenant->ring_next;
+		tenant->ring_next->ring_prev = tenant->ring_prev;
+		if (fair->current == tenant)
+			fair->current = tenant->ring_next;
+	}
+	tenant->in_ring = 0;
+	tenant->deficit = 0;
+	--fair->active;
+}
+
+static struct vb_tenant* find_tenant(struct vb_fair* fair, const char* key){
+	unsigned int hash = 5381;
+	struct vb_tenant* tenant;
+	const char* c;
+	int len;
+
+	if (!key)
+		return &fair->default_tenant;
+	for (c = key; *c; ++c)
+		hash = hash * 33 + (unsigned char)*c;
+	for (tenant = fair->tenants; tenant; tenant = tenant->next){
+		if (tenant->hash == hash && !tenant->is_default && !strcmp(tenant->key, key))
+			return tenant;
+	}
+	len = c - key;
+	if (!(tenant = vb_calloc(1, sizeof(*tenant) + len + 1))){
+		vb_log(VB_LOG_WARNING, "Out of memory for an upload tenant, its jobs share the default queue\n");
+		return &fair->default_tenant;
+	}
+	memcpy(tenant->key, key, len + 1);
+	tenant->hash = hash;
+	tenant->next = fair->tenants;
+	fair->tenants = tenant;
+	++fair->num_tenants;
+	return tenant;
+}
+
+/* idle tenants are dropped, so the list only holds the ones with work */
+static void release_tenant(struct vb_fair* fair, struct vb_tenant* tenant){
+	struct vb_tenant** link;
+
+	if (tenant->is_default || tenant->queued || tenant->backlog || tenant->running)
+		return;
+	for (link = &fair->tenants; *link != tenant; link = &(*link)->next)
+		;
+	*link = tenant->next;
+	--fair->num_tenants;
+	vb_free(tenant);
+	//the others' shares grew
+	pthread_cond_broadcast(&fair->room);
+}
+
+/* The first job of the tenant that may start now, *prev is the job before it */
+static struct vb_job* tenant_next_job(struct vb_fair* fair, struct vb_tenant* tenant, struct vb_job** prev){
+	struct vb_job* job;
+
+	if (fair->limits.max_jobs && tenant->running >= fair->limits.max_jobs)
+		return NULL;
+	//a job waits behind its route, later jobs of the route are behind it anyway
+	for (*prev = NULL, job = tenant->head; job; *prev = job, job = job->next){
+		if (!route_running(fair, job->route))
+			break;
+	}
+	if (job && fair->limits.max_cost && tenant->running && tenant->running_cost + job->cost > fair->limits.max_cost)
+		return NULL;
+	return job;
+}
+
+/* Deficit round robin: a tenant is credited a quantum each time the round
+ * reaches it with a job it may start, and runs jobs while its credit covers
+ * them. Tenants at their limits are passed over without credit. */
+static struct vb_job* fair_pick(struct vb_fair* fair, struct vb_tenant** picked){
+	struct vb_tenant* tenant;
+	struct vb_job* prev;
+	struct vb_job* job;
+	int passed = 0;
+
+	while ((tenant = fair->current) && passed < fair->active){
+		if (!(job = tenant_next_job(fair, tenant, &prev))){
+			++passed;
+			fair->current = tenant->ring_next;
+			continue;
+		}
+		passed = 0;
+		if (job->cost > tenant->deficit){
+			tenant->deficit += FAIR_QUANTUM;
+			fair->current = tenant->ring_next;
+			continue;
+		}
+		tenant->deficit -= job->cost;
+		if (prev)
+			prev->next = job->next;
+		else
+			tenant->head = job->next;
+		if (tenant->tail == job)
+			tenant->tail = prev;
+		if (!--tenant->queued)
+			ring_remove(fair, tenant);
+		--tenant->backlog;
+		*picked = tenant;
+		return job;
+	}
+	return NULL;
+}
+
+static void* fair_worker_thread(void* data){
+	struct vb_worker* worker = data;
+	struct vb_stage* stage = worker->stage;
+	struct vb_fair* fair = stage->fair;
+	struct vb_tenant* tenant;
+	struct vb_job* job;
+	unsigned int route;
+	long cost;
+
+	pthread_mutex_lock(&fair->lock);
+	for (;;){
+		if (!(job = fair_pick(fair, &tenant))){
+			//stop only once the queues are drained
+			if (fair->stop && !fair->depth)
+				break;
+			pthread_cond_wait(&fair->work, &fair->lock);
+			continue;
+		}
+		route = job->route;
+		cost = job->cost;
+		fair->running_routes[fair->running++] = route;
+		++tenant->running;
+		tenant->running_cost += cost;
+		--fair->depth;
+		//waiting submits may be of any tenant
+		pthread_cond_broadcast(&fair->room);
+		pthread_mutex_unlock(&fair->lock);
+
+		if (stage->queue_wait)
+			vb_histogram_record(stage->queue_wait, vb_now_us() - job->queued);
+		stage->process(job);
+
+		pthread_mutex_lock(&fair->lock);
+		route_done(fair, route);
+		--tenant->running;
+		tenant->running_cost -= cost;
+		++fair->processed;
+		release_tenant(fair, tenant);
+		//the route and the limits of the tenant may let other jobs start
+		pthread_cond_broadcast(&fair->work);
+	}
+	pthread_mutex_unlock(&fair->lock);
+	return NULL;
+}
+
+static struct vb_stage* stage_create(const char* name, int num_workers, int queue_limit, const struct vb_fair_limits* limits, vb_stage_fn process, struct vb_histogram* queue_wait){
+	struct vb_stage* stage;
+	struct vb_fair* fair = NULL;
+	int i;
+
+	if (num_workers <= 0 || queue_limit <= 0)
+		return NULL;
+	if (!(stage = vb_calloc(1, sizeof(*stage))))
+		return NULL;
+	if (!(stage->workers = vb_calloc(num_workers, sizeof(*stage->workers)))){
+		vb_free(stage);
+		return NULL;
+	}
+	if (limits){
+		if (!(fair = stage->fair = vb_calloc(1, sizeof(*fair))) || !(fair->running_routes = vb_calloc(num_workers, sizeof(*fair->running_routes)))){
+			vb_free(fair);
+			vb_free(stage->workers);
+			vb_free(stage);
+			return NULL;
+		}
+		pthread_mutex_init(&fair->lock, NULL);
+		pthread_cond_init(&fair->work, NULL);
+		pthread_cond_init(&fair->room, NULL);
+		fair->limits = *limits;
+		fair->default_tenant.is_default = 1;
+		fair->tenants = &fair->default_tenant;
+	}
+	snprintf(stage->name, sizeof(stage->name), "%s", name);
+	stage->queue_limit 	= queue_limit;
+	stage->process 		= process;
+	stage->queue_wait 	= queue_wait;
+
+	for (i = 0; i < num_workers; ++i){
+		struct vb_worker* worker = &stage->workers[i];
+
+		worker->stage = stage;
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->work, NULL);
+		pthread_cond_init(&worker->room, NULL);
+		if (pthread_create(&worker->thread, NULL, fair ? fair_worker_thread : worker_thread, worker)){
+			vb_log(VB_LOG_ERROR, "Failed to start %s worker %d\n", name, i);
+			pthread_mutex_destroy(&worker->lock);
+			pthread_cond_destroy(&worker->work);
+			pthread_cond_destroy(&worker->room);
+			break;
+		}
+		stage->num_workers = i + 1;
+	}
+
+	if (!stage->num_workers){
+		if (fair){
+			pthread_mutex_destroy(&fair->lock);
+			pthread_cond_destroy(&fair->work);
+			pthread_cond_destroy(&fair->room);
+			vb_free(fair->running_routes);
+			vb_free(fair);
+		}
+		vb_free(stage->workers);
+		vb_free(stage);
+		return NULL;
+	}
+	if (fair){
+		pthread_mutex_lock(&fair->lock);
+		fair->depth_limit = queue_limit * stage->num_workers;
+		pthread_mutex_unlock(&fair->lock);
+	}
+	return stage;
+}
+
+struct vb_stage* vb_stage_create(const char* name, int num_workers, int queue_limit, vb_stage_fn process, struct vb_histogram* queue_wait){
+	return stage_create(name, num_workers, queue_limit, NULL, process, queue_wait);
+}
+
+struct vb_stage* vb_fair_stage_create(const char* name, int num_workers, int queue_limit, const struct vb_fair_limits* limits, vb_stage_fn process, struct vb_histogram* queue_wait){
+	static const struct vb_fair_limits no_limits;
+
+	return stage_create(name, num_workers, queue_limit, limits ? limits : &no_limits, process, queue_wait);
+}
+
+void vb_stage_set_limits(struct vb_stage* stage, const struct vb_fair_limits* limits){
+	if (!stage || !stage->fair)
+		return;
+	pthread_mutex_lock(&stage->fair->lock);
+	stage->fair->limits = *limits;
+	pthread_cond_broadcast(&stage->fair->work);
+	pthread_mutex_unlock(&stage->fair->lock);
+}
+
+static void fair_stage_destroy(struct vb_stage* stage){
+	struct vb_fair* fair = stage->fair;
+	struct vb_tenant* tenant;
+	struct vb_job* job;
+	int i;
+
+	pthread_mutex_lock(&fair->lock);
+	fair->stop = 1;
+	pthread_cond_broadcast(&fair->work);
+	pthread_cond_broadcast(&fair->room);
+	pthread_mutex_unlock(&fair->lock);
+
+	for (i = 0; i < stage->num_workers; ++i){
+		pthread_join(stage->workers[i].thread, NULL);
+		pthread_mutex_destroy(&stage->workers[i].lock);
+		pthread_cond_destroy(&stage->workers[i].work);
+		pthread_cond_destroy(&stage->workers[i].room);
+	}
+	//jobs submitted while the workers were exiting
+	while ((tenant = fair->tenants)){
+		fair->tenants = tenant->next;
+		while ((job = tenant->head)){
+			tenant->head = job->next;
+			stage->process(job);
+		}
+		if (!tenant->is_default)
+			vb_free(tenant);
+	}
+	pthread_mutex_destroy(&fair->lock);
+	pthread_cond_destroy(&fair->work);
+	pthread_cond_destroy(&fair->room);
+	vb_free(fair->running_routes);
+	vb_free(fair);
+	vb_free(stage->workers);
+	vb_free(stage);
+}
+
+void vb_stage_destroy(struct vb_stage* stage){
+	int i;
+
+	if (!stage)
+		return;
+	if (stage->fair){
+		fair_stage_destroy(stage);
+		return;
+	}
+
+	for (i = 0; i < stage->num_workers; ++i){
+		struct vb_worker* worker = &stage->workers[i];
+		pthread_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		pthread_cond_signal(&worker->work);
+		pthread_cond_broadcast(&worker->room);
+		pthread_mutex_unlock(&worker->lock);
+	}
+	for (i = 0; i < stage->num_workers; ++i){
+		struct vb_worker* worker = &stage->workers[i];
+		struct vb_job* job;
+
+		pthread_join(worker->thread, NULL);
+		//jobs submitted while the worker was exiting
+		while ((job = queue_pop(worker)))
+			stage->process(job);
+		pthread_mutex_destroy(&worker->lock);
+		pthread_cond_destroy(&worker->work);
+		pthread_cond_destroy(&worker->room);
+	}
+	vb_free(stage->workers);
+	vb_free(stage);
+}
+
+/* A tenant's share of the queues, at least the queue of a worker */
+static int tenant_share(struct vb_stage* stage){
+	struct vb_fair* fair = stage->fair;
+	struct vb_tenant* def = &fair->default_tenant;
+	int tenants = fair->num_tenants + (def->backlog || def->running);
+	int share = fair->depth_limit / (tenants ? tenants : 1);
+
+	return share > stage->queue_limit ? share : stage->queue_limit;
+}
+
+/* Counts the job in its tenant's backlog once the tenant has room, so a
+ * tenant at its limits with a burst waiting holds back its own jobs only */
+static struct vb_tenant* fair_admit(struct vb_stage* stage, struct vb_job* job){
+	struct vb_fair* fair = stage->fair;
+	struct vb_tenant* tenant;
+
+	//the tenant may drain and be released while this waits, so it is looked up again
+	while ((tenant = find_tenant(fair, job->tenant))->backlog >= tenant_share(stage) && !fair->stop)
+		pthread_cond_wait(&fair->room, &fair->lock);
+	++tenant->backlog;
+	return tenant;
+}
+
+void vb_stage_admit(struct vb_stage* stage, struct vb_job* job){
+	if (!stage->fair || job->admitted)
+		return;
+	pthread_mutex_lock(&stage->fair->lock);
+	job->admitted = fair_admit(stage, job);
+	pthread_mutex_unlock(&stage->fair->lock);
+}
+
+static void fair_submit(struct vb_stage* stage, struct vb_job* job){
+	struct vb_fair* fair = stage->fair;
+	struct vb_tenant* tenant;
+
+	pthread_mutex_lock(&fair->lock);
+	if (!(tenant = job->admitted))
+		tenant = fair_admit(stage, job);
+	job->admitted = NULL;
+	job->next = NULL;
+	if (tenant->tail)
+		tenant->tail->next = job;
+	else
+		tenant->head = job;
+	tenant->tail = job;
+	++tenant->queued;
+	++fair->depth;
+	if (!tenant->in_ring)
+		ring_insert(fair, tenant);
+	pthread_cond_signal(&fair->work);
+	pthread_mutex_unlock(&fair->lock);
+}
+
+void vb_stage_submit(struct vb_stage* stage, struct vb_job* job){
+	struct vb_worker* worker = &stage->workers[job->route % stage->num_workers];
+
+	job->queued = vb_now_us();
+	if (stage->fair){
+		fair_submit(stage, job);
+		return;
+	}
+	pthread_mutex_lock(&worker->lock);
+	while (worker->depth >= stage->queue_limit && !worker->stop)
+		pthread_cond_wait(&worker->room, &worker->lock);
+	queue_push(worker, job);
+	++worker->depth;
+	pthread_cond_signal(&worker->work);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void vb_stage_get_stats(struct vb_stage* stage, struct vb_stage_stats* stats){
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!stage)
+		return;
+	stats->workers = stage->num_workers;
+	if (stage->fair){
+		struct vb_tenant* tenant;
+
+		pthread_mutex_lock(&stage->fair->lock);
+		stats->queued 		= stage->fair->depth;
+		stats->busy 		= stage->fair->running;
+		stats->processed 	= stage->fair->processed;
+		for (tenant = stage->fair->tenants; tenant; tenant = tenant->next)
+			stats->tenants += tenant->queued || tenant->running;
+		pthread_mutex_unlock(&stage->fair->lock);
+		return;
+	}
+	for (i = 0; i < stage->num_workers; ++i){
+		struct vb_worker* worker = &stage->workers[i];
+		pthread_mutex_lock(&worker->lock);
+		stats->queued 		+= worker->depth;
+		stats->busy 		+= worker->busy;
+		stats->processed 	+= worker->processed;
+		pthread_mutex_unlock(&worker->lock);
+	}
+}
+
+int vb_stage_get_tenants(struct vb_stage* stage, struct vb_tenant_stats* tenants, int max){
+	struct vb_tenant* tenant;
+	int count = 0;
+
+	if (!stage || !stage->fair)
+		return 0;
+	pthread_mutex_lock(&stage->fair->lock);
+	for (tenant = stage->fair->tenants; tenant; tenant = tenant->next){
+		if (!tenant->queued && !tenant->running)
+			continue;
+		if (count < max){
+			struct vb_tenant_stats* t = &tenants[count];
+
+			if (tenant->is_default)
+				snprintf(t->label, sizeof(t->label), "(default)");
+			else
+				snprintf(t->label, sizeof(t->label), "%.4s...", tenant->key);
+			t->queued 		= tenant->queued;
+			t->running 		= tenant->running;
+			t->running_cost = tenant->running_cost;
+		}
+		++count;
+	}
+	pthread_mutex_unlock(&stage->fair->lock);
+	return count;
+}
+
+const char* vb_stage_name(struct vb_stage* stage){
+	return stage->name;
+}
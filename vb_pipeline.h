@@ -0,0 +1,73 @@
+#ifndef VB_PIPELINE_H
+#define VB_PIPELINE_H
+
+/* A pipeline stage: a pool of worker threads, each with its own bounded FIFO.
+ * Jobs are routed to a worker by their route key, so jobs with the same key
+ * (segments of one call) are processed one at a time and in submission order,
+ * while different calls spread over all workers of the stage.
+ *
+ * A fair stage queues the jobs per tenant (an API key) instead, and its
+ * workers take them from the tenants in deficit round robin order weighted
+ * by the job cost, so a tenant with a backlog gets its share of the workers
+ * and no more. Jobs with the same route still run one at a time, in order.
+ * Each tenant may have its share of the stage's queues waiting, a tenant
+ * over it holds back its own submits only. */
+
+struct vb_tenant;
+
+struct vb_job{
+	struct vb_job*	next;
+	unsigned int	route;
+	long long		queued;		//vb_now_us() at submission
+	const char*		tenant;		//fair stages: whose queue the job goes to, NULL is a tenant too
+	long			cost;		//fair stages: bytes, what the round robin shares out
+	struct vb_tenant*	admitted;	//fair stages: set by vb_stage_admit(), NULL before
+};
+
+typedef void (*vb_stage_fn)(struct vb_job* job);
+
+struct vb_stage;
+struct vb_histogram;
+
+struct vb_stage_stats{
+	int				workers;
+	int				queued;		//jobs waiting in the worker queues
+	int				busy;		//workers running a job
+	unsigned long	processed;
+	int				tenants;	//fair stages: tenants with jobs queued or running
+};
+
+/* What every tenant of a fair stage may run at once, 0 for no limit */
+struct vb_fair_limits{
+	int			max_jobs;
+	long long	max_cost;		//a job costing more still runs, alone
+};
+
+struct vb_tenant_stats{
+	char		label[16];		//the start of the tenant key only, keys are secrets
+	int			queued;
+	int			running;
+	long long	running_cost;
+};
+
+/* queue_wait, if not NULL, records how long jobs waited for a worker */
+struct vb_stage* vb_stage_create(const char* name, int num_workers, int queue_limit, vb_stage_fn process, struct vb_histogram* queue_wait);
+/* queue_limit is per worker, a fair stage shares the total among its tenants */
+struct vb_stage* vb_fair_stage_create(const char* name, int num_workers, int queue_limit, const struct vb_fair_limits* limits, vb_stage_fn process, struct vb_histogram* queue_wait);
+/* applies to the jobs started from now on, ignored by the other stages */
+void vb_stage_set_limits(struct vb_stage* stage, const struct vb_fair_limits* limits);
+/* processes everything still queued, then stops the workers */
+void vb_stage_destroy(struct vb_stage* stage);
+/* Blocks while the queue of the job's worker is full. A fair stage blocks
+ * while the job's tenant has its share waiting, unless the job was admitted. */
+void vb_stage_submit(struct vb_stage* stage, struct vb_job* job);
+/* Fair stages: counts the job in its tenant's share ahead of vb_stage_submit(),
+ * blocking while the share is full. An earlier stage admits its jobs before it
+ * takes them, so its workers never wait for one tenant. */
+void vb_stage_admit(struct vb_stage* stage, struct vb_job* job);
+void vb_stage_get_stats(struct vb_stage* stage, struct vb_stage_stats* stats);
+/* fills up to max tenants of a fair stage, returns how many there are */
+int vb_stage_get_tenants(struct vb_stage* stage, struct vb_tenant_stats* tenants, int max);
+const char* vb_stage_name(struct vb_stage* stage);
+
+#endif
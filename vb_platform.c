@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cJSON.h"
+#include "vb_platform.h"
+
+static void default_log(int level, const char* file, int line, const char* function, const char* fmt, va_list ap){
+	static const char* names[] = {"DEBUG", "VERBOSE", "NOTICE", "WARNING", "ERROR"};
+
+	fprintf(stderr, "[%s] %s:%d %s: ", (level >= 0 && level <= VB_LOG_ERROR) ? names[level] : "LOG", file, line, function);
+	vfprintf(stderr, fmt, ap);
+}
+
+static struct vb_platform vb_platform = {
+	calloc,
+	malloc,
+	free,
+	default_log,
+};
+
+void vb_platform_set(const struct vb_platform* platform){
+	cJSON_Hooks hooks;
+
+	vb_platform.calloc_fn 	= platform->calloc_fn 	? platform->calloc_fn 	: calloc;
+	vb_platform.malloc_fn 	= platform->malloc_fn 	? platform->malloc_fn 	: malloc;
+	vb_platform.free_fn 	= platform->free_fn 	? platform->free_fn 	: free;
+	vb_platform.log_fn 		= platform->log_fn 		? platform->log_fn 		: default_log;
+
+	hooks.malloc_fn = vb_platform.malloc_fn;
+	hooks.free_fn 	= vb_platform.free_fn;
+	cJSON_InitHooks(&hooks);
+}
+
+void* vb_calloc(size_t num, size_t size){
+	return vb_platform.calloc_fn(num, size);
+}
+
+void* vb_malloc(size_t size){
+	return vb_platform.malloc_fn(size);
+}
+
+void vb_free(void* ptr){
+	vb_platform.free_fn(ptr);
+}
+
+void vb_log_message(int level, const char* file, int line, const char* function, const char* fmt, ...){
+	va_list ap;
+
+	va_start(ap, fmt);
+	vb_platform.log_fn(level, file, line, function, fmt, ap);
+	va_end(ap);
+}
+
+long long vb_now_us(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,43 @@
+#ifndef VB_PLATFORM_H
+#define VB_PLATFORM_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+/* Host services of the voicebase library (segment storage, WAV writer and uploader).
+ * The library itself only needs libc, pthreads, libcurl and cJSON. The Asterisk
+ * module routes the allocator and the logger to ast_calloc()/ast_log(), tools and
+ * benchmarks run with the libc defaults. */
+
+//same values as the Asterisk __LOG_* levels
+#define VB_LOG_DEBUG	0
+#define VB_LOG_NOTICE	2
+#define VB_LOG_WARNING	3
+#define VB_LOG_ERROR	4
+
+struct vb_platform{
+	void*	(*calloc_fn)(size_t num, size_t size);
+	void*	(*malloc_fn)(size_t size);
+	void	(*free_fn)(void* ptr);
+	void	(*log_fn)(int level, const char* file, int line, const char* function, const char* fmt, va_list ap);
+};
+
+/* Installs the host services, NULL members keep the libc defaults (the default
+ * logger writes to stderr). cJSON allocates through the same functions.
+ * Call it before anything is allocated, memory is always released with the
+ * current free function. */
+void vb_platform_set(const struct vb_platform* platform);
+
+void* vb_calloc(size_t num, size_t size);
+void* vb_malloc(size_t size);
+void vb_free(void* ptr);
+
+void vb_log_message(int level, const char* file, int line, const char* function, const char* fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+
+#define vb_log(level, ...)	vb_log_message(level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+
+/* microseconds of a monotonic clock */
+long long vb_now_us();
+
+#endif
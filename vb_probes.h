@@ -0,0 +1,46 @@
+#ifndef VB_PROBES_H
+#define VB_PROBES_H
+
+/* USDT (SystemTap/bpftrace) static tracepoints of the vbmixmonitor provider.
+ * A probe is a single nop in the code and a note in the ELF file telling a
+ * tracer where to find the arguments. The probes have no semaphores, so the
+ * arguments are computed on every pass whether a tracer is attached or not:
+ * pass values the code has at hand, never the result of a costly call. E.g.
+ *
+ *   bpftrace -e 'usdt:./app_vbmixmonitor.so:vbmixmonitor:upload__done
+ *                { @ms = hist(arg5 / 1000); }'
+ *
+ * Without <sys/sdt.h> (or with VB_NO_PROBES) every probe compiles to nothing.
+ *
+ * monitor__start		(channel)
+ * monitor__stop		(channel, segments)
+ * frame__read			(read samples, write samples), a batch read off the audiohook
+ * segment__open		(session id, segment number)
+ * segment__close		(session id, segment number, bytes, last)
+ * upload__start		(session id, segment number, bytes)
+ * upload__done			(session id, segment number, bytes, curl result, http status, elapsed us)
+ */
+
+#if !defined(HAVE_SYS_SDT_H) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H 1
+#endif
+#endif
+
+#if defined(HAVE_SYS_SDT_H) && !defined(VB_NO_PROBES)
+#include <sys/sdt.h>
+#define VB_PROBE1(name, a1)							DTRACE_PROBE1(vbmixmonitor, name, a1)
+#define VB_PROBE2(name, a1, a2)						DTRACE_PROBE2(vbmixmonitor, name, a1, a2)
+#define VB_PROBE3(name, a1, a2, a3)					DTRACE_PROBE3(vbmixmonitor, name, a1, a2, a3)
+#define VB_PROBE4(name, a1, a2, a3, a4)				DTRACE_PROBE4(vbmixmonitor, name, a1, a2, a3, a4)
+#define VB_PROBE6(name, a1, a2, a3, a4, a5, a6)		DTRACE_PROBE6(vbmixmonitor, name, a1, a2, a3, a4, a5, a6)
+#else
+/* the arguments are referenced but never evaluated, so probe-only variables do not warn */
+#define VB_PROBE1(name, a1)							do { if (0) { (void)(a1); } } while (0)
+#define VB_PROBE2(name, a1, a2)						do { if (0) { (void)(a1); (void)(a2); } } while (0)
+#define VB_PROBE3(name, a1, a2, a3)					do { if (0) { (void)(a1); (void)(a2); (void)(a3); } } while (0)
+#define VB_PROBE4(name, a1, a2, a3, a4)				do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while (0)
+#define VB_PROBE6(name, a1, a2, a3, a4, a5, a6)		do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); (void)(a5); (void)(a6); } } while (0)
+#endif
+
+#endif
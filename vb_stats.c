@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vb_stats.h"
+
+struct vb_stats vb_stats;
+
+void vb_stats_snapshot(struct vb_stats* snapshot){
+	snapshot->active_monitors 	= __atomic_load_n(&vb_stats.active_monitors, 	__ATOMIC_RELAXED);
+	snapshot->frames_captured 	= __atomic_load_n(&vb_stats.frames_captured, 	__ATOMIC_RELAXED);
+	snapshot->bytes_captured 	= __atomic_load_n(&vb_stats.bytes_captured, 	__ATOMIC_RELAXED);
+	snapshot->segments_opened 	= __atomic_load_n(&vb_stats.segments_opened, 	__ATOMIC_RELAXED);
+	snapshot->segments_closed 	= __atomic_load_n(&vb_stats.segments_closed, 	__ATOMIC_RELAXED);
+	snapshot->segments_uploaded = __atomic_load_n(&vb_stats.segments_uploaded, 	__ATOMIC_RELAXED);
+	snapshot->segments_failed 	= __atomic_load_n(&vb_stats.segments_failed, 	__ATOMIC_RELAXED);
+	snapshot->bytes_uploaded 	= __atomic_load_n(&vb_stats.bytes_uploaded, 	__ATOMIC_RELAXED);
+	snapshot->bytes_truncated 	= __atomic_load_n(&vb_stats.bytes_truncated, 	__ATOMIC_RELAXED);
+	snapshot->buffered_bytes 	= __atomic_load_n(&vb_stats.buffered_bytes, 	__ATOMIC_RELAXED);
+	snapshot->segment_length_ms = __atomic_load_n(&vb_stats.segment_length_ms, 	__ATOMIC_RELAXED);
+	snapshot->segment_adaptive 	= __atomic_load_n(&vb_stats.segment_adaptive, 	__ATOMIC_RELAXED);
+}
+
+void vb_capture_stats_flush(struct vb_capture_stats* local){
+	if (local->frames){
+		vb_stats_add(frames_captured, local->frames);
+		vb_stats_add(bytes_captured, local->bytes);
+	}
+	memset(local, 0, sizeof(*local));
+}
+
+#define HISTOGRAM(var, metric, text) struct vb_histogram var = { .name = metric, .help = text }
+
+HISTOGRAM(vb_hist_upload_latency, 		"vbmixmonitor_upload_latency", 		"Time from segment close to upload completion");
+HISTOGRAM(vb_hist_curl_connect, 		"vbmixmonitor_curl_connect", 		"TCP connect time of segment uploads");
+HISTOGRAM(vb_hist_curl_tls, 			"vbmixmonitor_curl_tls", 			"TLS handshake time of segment uploads");
+HISTOGRAM(vb_hist_curl_transfer, 		"vbmixmonitor_curl_transfer", 		"Request and response transfer time of segment uploads");
+HISTOGRAM(vb_hist_frame_store, 			"vbmixmonitor_frame_store", 		"Time from reading a frame off the audiohook to storing it");
+HISTOGRAM(vb_hist_encode_queue_wait, 	"vbmixmonitor_encode_queue_wait", 	"Time closed segments wait for an encode worker");
+HISTOGRAM(vb_hist_upload_queue_wait, 	"vbmixmonitor_upload_queue_wait", 	"Time encoded segments wait for an upload worker");
+
+#undef HISTOGRAM
+
+struct vb_histogram* const vb_histograms[] = {
+	&vb_hist_upload_latency,
+	&vb_hist_curl_connect,
+	&vb_hist_curl_tls,
+	&vb_hist_curl_transfer,
+	&vb_hist_frame_store,
+	&vb_hist_encode_queue_wait,
+	&vb_hist_upload_queue_wait,
+};
+const int vb_num_histograms = sizeof(vb_histograms) / sizeof(vb_histograms[0]);
+
+/* Values below VB_HIST_SUB_COUNT get a bucket each, above that a power of two
+ * 2^m is split into VB_HIST_SUB_COUNT buckets of 2^(m - VB_HIST_SUB_BITS) */
+static int bucket_index(long long value){
+	int magnitude;
+
+	if (value < VB_HIST_SUB_COUNT)
+		return value < 0 ? 0 : (int)value;
+	if (value >= (1LL << VB_HIST_MAX_BITS))
+		return VB_HIST_BUCKETS - 1;
+	magnitude = 63 - __builtin_clzll(value);
+	return (magnitude - VB_HIST_SUB_BITS + 1) * VB_HIST_SUB_COUNT +
+		   (int)((value >> (magnitude - VB_HIST_SUB_BITS)) & (VB_HIST_SUB_COUNT - 1));
+}
+
+static long long bucket_lower(int index){
+	int magnitude;
+
+	if (index < VB_HIST_SUB_COUNT)
+		return index;
+	magnitude = index / VB_HIST_SUB_COUNT + VB_HIST_SUB_BITS - 1;
+	return (long long)(VB_HIST_SUB_COUNT + index % VB_HIST_SUB_COUNT) << (magnitude - VB_HIST_SUB_BITS);
+}
+
+void vb_histogram_record(struct vb_histogram* hist, long long value_us){
+	long long max;
+
+	if (value_us < 0)
+		value_us = 0;
+	__atomic_fetch_add(&hist->buckets[bucket_index(value_us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, value_us, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (value_us > max &&
+		   !__atomic_compare_exchange_n(&hist->max, &max, value_us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+long long vb_histogram_quantile(const struct vb_histogram* hist, double quantile){
+	long long counts[VB_HIST_BUCKETS];
+	long long total = 0;
+	long long seen = 0;
+	long long rank;
+	int i;
+
+	for (i = 0; i < VB_HIST_BUCKETS; ++i)
+		total += (counts[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED));
+	if (!total)
+		return 0;
+
+	rank = (long long)(quantile * total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < VB_HIST_BUCKETS; ++i){
+		seen += counts[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i >= VB_HIST_BUCKETS - 1)
+		return __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	//middle of the bucket
+	return (bucket_lower(i) + bucket_lower(i + 1) - 1) / 2;
+}
+
+/* The exported buckets are the powers of two, which are exact bucket edges,
+ * so le="2^k us" counts every value below 2^k us. */
+static void write_histogram(FILE* f, const struct vb_histogram* hist){
+	long long counts[VB_HIST_BUCKETS];
+	long long cumulative = 0;
+	int i;
+
+	for (i = 0; i < VB_HIST_BUCKETS; ++i)
+		counts[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+
+	fprintf(f, "# HELP %s_seconds %s\n", hist->name, hist->help);
+	fprintf(f, "# TYPE %s_seconds histogram\n", hist->name);
+	for (i = 0; i < VB_HIST_BUCKETS; ++i){
+		cumulative += counts[i];
+		if (i + 1 < VB_HIST_BUCKETS && !(bucket_lower(i + 1) & (bucket_lower(i + 1) - 1)))
+			fprintf(f, "%s_seconds_bucket{le=\"%.9g\"} %lld\n", hist->name, bucket_lower(i + 1) / 1e6, cumulative);
+	}
+	//_count is the bucket total, so it always matches the +Inf bucket
+	fprintf(f, "%s_seconds_bucket{le=\"+Inf\"} %lld\n", hist->name, cumulative);
+	fprintf(f, "%s_seconds_sum %.6f\n", hist->name, __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1e6);
+	fprintf(f, "%s_seconds_count %lld\n", hist->name, cumulative);
+}
+
+static void write_metric(FILE* f, const char* name, const char* type, const char* help, long long value){
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type, name, value);
+}
+
+void vb_stats_write_prometheus(FILE* f){
+	struct vb_stats stats;
+	int i;
+
+	vb_stats_snapshot(&stats);
+	write_metric(f, "vbmixmonitor_active_monitors", 		"gauge", 	"Running monitors", 					stats.active_monitors);
+	write_metric(f, "vbmixmonitor_frames_captured_total", 	"counter", 	"Frames read from audiohooks", 			stats.frames_captured);
+	write_metric(f, "vbmixmonitor_captured_bytes_total", 	"counter", 	"Bytes read from audiohooks", 			stats.bytes_captured);
+	write_metric(f, "vbmixmonitor_segments_opened_total", 	"counter", 	"Segments opened", 						stats.segments_opened);
+	write_metric(f, "vbmixmonitor_segments_closed_total", 	"counter", 	"Segments closed", 						stats.segments_closed);
+	write_metric(f, "vbmixmonitor_segments_uploaded_total", "counter", 	"Segments uploaded", 					stats.segments_uploaded);
+	write_metric(f, "vbmixmonitor_segments_failed_total", 	"counter", 	"Segments whose upload failed", 		stats.segments_failed);
+	write_metric(f, "vbmixmonitor_uploaded_bytes_total", 	"counter", 	"Bytes uploaded", 						stats.bytes_uploaded);
+	write_metric(f, "vbmixmonitor_truncated_bytes_total", 	"counter", 	"Bytes dropped from full segment buffers", stats.bytes_truncated);
+	write_metric(f, "vbmixmonitor_buffered_bytes", 			"gauge", 	"Bytes held in segment buffers", 		stats.buffered_bytes);
+	fprintf(f, "# HELP vbmixmonitor_segment_length_seconds Length segments are closed at\n# TYPE vbmixmonitor_segment_length_seconds gauge\n"
+			"vbmixmonitor_segment_length_seconds %.3f\n", stats.segment_length_ms / 1e3);
+	write_metric(f, "vbmixmonitor_segment_adaptive", 		"gauge", 	"1 when the segment length adapts to the load", stats.segment_adaptive);
+	for (i = 0; i < vb_num_histograms; ++i)
+		write_histogram(f, vb_histograms[i]);
+}
+
+int vb_stats_export_prometheus(const char* filename){
+	char tmp_name[4096];
+	FILE* f;
+	int res;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+	if (!(f = fopen(tmp_name, "w")))
+		return -1;
+	vb_stats_write_prometheus(f);
+	res = ferror(f);
+	if (fclose(f) || res || rename(tmp_name, filename)){
+		remove(tmp_name);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef VB_STATS_H
+#define VB_STATS_H
+
+#include <stdio.h>
+
+/* Module wide counters. Writers use relaxed atomic adds and never take a lock,
+ * readers copy them without one: every counter is exact, a snapshot is not
+ * a consistent cut across counters. */
+struct vb_stats{
+	long long	active_monitors;
+	long long	frames_captured;
+	long long	bytes_captured;
+	long long	segments_opened;
+	long long	segments_closed;
+	long long	segments_uploaded;
+	long long	segments_failed;
+	long long	bytes_uploaded;
+	long long	bytes_truncated;	//audio dropped because the segment buffer was full
+	long long	buffered_bytes;		//segment buffers held by calls and the pipeline
+	long long	segment_length_ms;	//length segments are closed at now, moves with segment_adaptive
+	long long	segment_adaptive;	//1 when the published settings adapt the length
+};
+
+extern struct vb_stats vb_stats;
+
+#define vb_stats_add(field, n)	__atomic_fetch_add(&vb_stats.field, (n), __ATOMIC_RELAXED)
+#define vb_stats_set(field, n)	__atomic_store_n(&vb_stats.field, (n), __ATOMIC_RELAXED)
+
+void vb_stats_snapshot(struct vb_stats* snapshot);
+
+/* Capture threads count frames in a local batch and publish it every
+ * VB_STATS_CAPTURE_BATCH frames, so the shared cache line is touched about
+ * once a second per call instead of on every frame. */
+#define VB_STATS_CAPTURE_BATCH	50
+
+struct vb_capture_stats{
+	long long	frames;
+	long long	bytes;
+};
+
+void vb_capture_stats_flush(struct vb_capture_stats* local);
+
+static inline void vb_capture_stats_add(struct vb_capture_stats* local, long long bytes){
+	++local->frames;
+	local->bytes += bytes;
+	if (local->frames >= VB_STATS_CAPTURE_BATCH)
+		vb_capture_stats_flush(local);
+}
+
+/* HDR style log-linear histogram of microsecond values: 16 linear sub-buckets
+ * per power of two keep every recorded value within 6.25% of its bucket.
+ * Recording is a few relaxed atomic adds, so any thread can record without a lock. */
+#define VB_HIST_SUB_BITS	4
+#define VB_HIST_SUB_COUNT	(1 << VB_HIST_SUB_BITS)
+#define VB_HIST_MAX_BITS	36		//values are clamped to 2^36 us (~19 hours)
+#define VB_HIST_BUCKETS		((VB_HIST_MAX_BITS - VB_HIST_SUB_BITS + 1) * VB_HIST_SUB_COUNT)
+
+struct vb_histogram{
+	const char*	name;		//Prometheus metric name without the _seconds suffix
+	const char*	help;
+	long long	count;
+	long long	sum;		//us
+	long long	max;		//us
+	long long	buckets[VB_HIST_BUCKETS];
+};
+
+void vb_histogram_record(struct vb_histogram* hist, long long value_us);
+/* value below which the given share (0..1) of the recorded values fall, in us */
+long long vb_histogram_quantile(const struct vb_histogram* hist, double quantile);
+
+extern struct vb_histogram vb_hist_upload_latency;		//segment close to upload completion
+extern struct vb_histogram vb_hist_curl_connect;
+extern struct vb_histogram vb_hist_curl_tls;
+extern struct vb_histogram vb_hist_curl_transfer;
+extern struct vb_histogram vb_hist_frame_store;			//frame read from the audiohook to stored
+extern struct vb_histogram vb_hist_encode_queue_wait;
+extern struct vb_histogram vb_hist_upload_queue_wait;
+
+extern struct vb_histogram* const vb_histograms[];
+extern const int vb_num_histograms;
+
+/* Prometheus text exposition of the counters and histograms */
+void vb_stats_write_prometheus(FILE* f);
+/* writes through a temporary file and renames it, so a textfile collector
+ * never reads a partial file. Returns 0 on success. */
+int vb_stats_export_prometheus(const char* filename);
+
+#endif
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "vb_platform.h"
+#include "vb_stats.h"
+#include "vb_trace.h"
+
+#define TIMELINE_QUEUE_LIMIT	4096	//events waiting for the writer
+#define TIMELINE_LINE_MAX		512
+
+static const char* const trace_level_names[] = { "off", "call", "segment", "debug" };
+
+int parse_trace_level(const char* value){
+	int i;
+
+	for (i = 0; i < sizeof(trace_level_names) / sizeof(trace_level_names[0]); ++i){
+		if (!strcasecmp(value, trace_level_names[i]))
+			return i;
+	}
+	if (sscanf(value, "%30d", &i) == 1 && i >= VB_TRACE_OFF && i <= VB_TRACE_DEBUG)
+		return i;
+	return -1;
+}
+
+const char* trace_level_name(int level){
+	if (level < VB_TRACE_OFF || level > VB_TRACE_DEBUG)
+		return "unknown";
+	return trace_level_names[level];
+}
+
+void vb_log_ratelimited(struct vb_ratelimit* limit, int interval_ms, int level, const char* file, int line, const char* function, const char* fmt, ...){
+	long long now = vb_now_us();
+	long long next = __atomic_load_n(&limit->next, __ATOMIC_RELAXED);
+	char msg[1024];
+	va_list ap;
+	int suppressed;
+	int len;
+
+	if (now < next || !__atomic_compare_exchange_n(&limit->next, &next, now + interval_ms * 1000LL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+		__atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	if (!suppressed){
+		vb_log_message(level, file, line, function, "%s", msg);
+		return;
+	}
+	len = strlen(msg);
+	if (len > 0 && msg[len - 1] == '\n')
+		msg[len - 1] = 0;
+	vb_log_message(level, file, line, function, "%s (%d more like it suppressed)\n", msg, suppressed);
+}
+
+static long long summary_next;
+static struct vb_stats summary_prev;	//written by the thread that wins summary_next only
+
+void vb_trace_summary_tick(int interval_s){
+	long long now;
+	long long next;
+	struct vb_stats s;
+
+	if (interval_s <= 0)
+		return;
+	now = vb_now_us();
+	next = __atomic_load_n(&summary_next, __ATOMIC_RELAXED);
+	if (now < next || !__atomic_compare_exchange_n(&summary_next, &next, now + interval_s * 1000000LL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	vb_stats_snapshot(&s);
+	//the first tick only sets the baseline
+	if (next && (s.active_monitors || s.segments_closed != summary_prev.segments_closed ||
+			s.segments_uploaded != summary_prev.segments_uploaded || s.segments_failed != summary_prev.segments_failed)){
+		vb_log(VB_LOG_NOTICE, "%lld monitors, last %d s: %lld segments closed, %lld uploaded (%lld KB), %lld failed, %lld KB truncated; %lld KB buffered, %lld timeline events dropped\n",
+				s.active_monitors, interval_s,
+				s.segments_closed - summary_prev.segments_closed,
+				s.segments_uploaded - summary_prev.segments_uploaded,
+				(s.bytes_uploaded - summary_prev.bytes_uploaded) / 1024,
+				s.segments_failed - summary_prev.segments_failed,
+				(s.bytes_truncated - summary_prev.bytes_truncated) / 1024,
+				s.buffered_bytes / 1024, vb_timeline_dropped());
+	}
+	summary_prev = s;
+}
+
+struct vb_timeline{
+	char	filename[1024];
+	FILE*	f;
+	int		failed;		//the file could not be opened, its events are discarded
+};
+
+struct timeline_record{
+	struct timeline_record*	next;
+	struct vb_timeline*		timeline;
+	int						close;
+	char					line[];
+};
+
+static pthread_mutex_t 	writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t 	writer_work = PTHREAD_COND_INITIALIZER;
+static pthread_t 		writer_thread;
+static int 				writer_running;
+static int 				writer_stop;
+static struct timeline_record* queue_head;
+static struct timeline_record* queue_tail;
+static int 				queue_depth;
+static long long 		timeline_dropped;
+
+/* writer thread only */
+static void write_record(struct timeline_record* record){
+	struct vb_timeline* timeline = record->timeline;
+
+	if (record->close){
+		if (timeline->f)
+			fclose(timeline->f);
+		vb_free(timeline);
+		return;
+	}
+	if (!timeline->f && !timeline->failed){
+		if (!(timeline->f = fopen(timeline->filename, "a"))){
+			vb_log(VB_LOG_WARNING, "Can't open trace timeline %s: %s\n", timeline->filename, strerror(errno));
+			timeline->failed = 1;
+		}
+	}
+	if (timeline->f){
+		fputs(record->line, timeline->f);
+		fflush(timeline->f);
+	}
+}
+
+static void* writer_main(void* data){
+	struct timeline_record* batch;
+	struct timeline_record* next;
+
+	pthread_mutex_lock(&writer_lock);
+	for (;;){
+		while (!queue_head && !writer_stop)
+			pthread_cond_wait(&writer_work, &writer_lock);
+		//stop only once the queue is drained
+		if (!(batch = queue_head))
+			break;
+		queue_head = queue_tail = NULL;
+		queue_depth = 0;
+		pthread_mutex_unlock(&writer_lock);
+
+		for (; batch; batch = next){
+			next = batch->next;
+			write_record(batch);
+			vb_free(batch);
+		}
+
+		pthread_mutex_lock(&writer_lock);
+	}
+	pthread_mutex_unlock(&writer_lock);
+	return NULL;
+}
+
+/* Queues a record, closes are queued even when the queue is full.
+ * Returns 0 when queued, the caller keeps the record otherwise. */
+static int queue_record(struct timeline_record* record){
+	int res = -1;
+
+	record->next = NULL;
+	pthread_mutex_lock(&writer_lock);
+	if (writer_running && (record->close || queue_depth < TIMELINE_QUEUE_LIMIT)){
+		if (queue_tail)
+			queue_tail->next = record;
+		else
+			queue_head = record;
+		queue_tail = record;
+		++queue_depth;
+		pthread_cond_signal(&writer_work);
+		res = 0;
+	}
+	pthread_mutex_unlock(&writer_lock);
+	return res;
+}
+
+int vb_trace_start(){
+	int res = 0;
+
+	pthread_mutex_lock(&writer_lock);
+	if (!writer_running){
+		writer_stop = 0;
+		if ((res = pthread_create(&writer_thread, NULL, writer_main, NULL)))
+			vb_log(VB_LOG_WARNING, "Failed to start the trace timeline writer, timelines are disabled\n");
+		else
+			writer_running = 1;
+	}
+	pthread_mutex_unlock(&writer_lock);
+	return res;
+}
+
+void vb_trace_stop(){
+	pthread_mutex_lock(&writer_lock);
+	if (!writer_running){
+		pthread_mutex_unlock(&writer_lock);
+		return;
+	}
+	writer_running = 0;
+	writer_stop = 1;
+	pthread_cond_signal(&writer_work);
+	pthread_mutex_unlock(&writer_lock);
+
+	pthread_join(writer_thread, NULL);
+}
+
+struct vb_timeline* vb_timeline_open(const char* filename){
+	struct vb_timeline* timeline;
+
+	if (!__atomic_load_n(&writer_running, __ATOMIC_RELAXED))
+		return NULL;
+	if (!(timeline = vb_calloc(1, sizeof(*timeline))))
+		return NULL;
+	snprintf(timeline->filename, sizeof(timeline->filename), "%s", filename);
+	return timeline;
+}
+
+void vb_timeline_event(struct vb_timeline* timeline, const char* event, const char* fields, ...){
+	char line[TIMELINE_LINE_MAX];
+	struct timeline_record* record;
+	struct timespec ts;
+	va_list ap;
+	int len;
+
+	if (!timeline)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	len = snprintf(line, sizeof(line), "{\"ts\":%ld.%06ld,\"event\":\"%s\"", (long)ts.tv_sec, ts.tv_nsec / 1000, event);
+	if (fields && *fields && len < sizeof(line)){
+		line[len++] = ',';
+		va_start(ap, fields);
+		len += vsnprintf(line + len, sizeof(line) - len, fields, ap);
+		va_end(ap);
+	}
+	if (len < sizeof(line))
+		len += snprintf(line + len, sizeof(line) - len, "}\n");
+	//a cut line would not be valid JSON
+	if (len >= sizeof(line) || !(record = vb_malloc(sizeof(*record) + len + 1))){
+		__atomic_fetch_add(&timeline_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	record->timeline = timeline;
+	record->close = 0;
+	memcpy(record->line, line, len + 1);
+	if (queue_record(record)){
+		__atomic_fetch_add(&timeline_dropped, 1, __ATOMIC_RELAXED);
+		vb_free(record);
+	}
+}
+
+void vb_timeline_close(struct vb_timeline* timeline){
+	struct timeline_record* record;
+
+	if (!timeline)
+		return;
+	if ((record = vb_malloc(sizeof(*record) + 1))){
+		record->timeline = timeline;
+		record->close = 1;
+		record->line[0] = 0;
+		if (!queue_record(record))
+			return;
+		vb_free(record);
+	}
+	//the writer is gone (or no memory): nothing else uses the file any more
+	if (timeline->f)
+		fclose(timeline->f);
+	vb_free(timeline);
+}
+
+long long vb_timeline_dropped(){
+	return __atomic_load_n(&timeline_dropped, __ATOMIC_RELAXED);
+}
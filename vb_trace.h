@@ -0,0 +1,57 @@
+#ifndef VB_TRACE_H
+#define VB_TRACE_H
+
+/* Call tracing. Normal operation logs errors and a periodic summary line only;
+ * per call lines are written when trace_level or the "trace" key of the call
+ * params asks for them. A call can also keep a JSONL timeline of its segments,
+ * written by a background thread so capture and upload threads never wait for
+ * the disk. */
+
+#define VB_TRACE_OFF		0	//errors and the periodic summary
+#define VB_TRACE_CALL		1	//start and end of every call
+#define VB_TRACE_SEGMENT	2	//every segment opened, closed and uploaded
+#define VB_TRACE_DEBUG		3	//the upload form fields, password masked
+
+/* "off", "call", "segment", "debug" or the number, -1 when invalid */
+int parse_trace_level(const char* value);
+const char* trace_level_name(int level);
+
+#define vb_trace(current, level, ...)	do { if ((current) >= (level)) vb_log(VB_LOG_NOTICE, __VA_ARGS__); } while (0)
+
+/* At most one line per interval, the lines suppressed in between are counted
+ * and reported with the next one. Any thread may use a limiter. */
+struct vb_ratelimit{
+	long long	next;			//vb_now_us() when the next line may go out
+	int			suppressed;
+};
+
+void vb_log_ratelimited(struct vb_ratelimit* limit, int interval_ms, int level, const char* file, int line, const char* function, const char* fmt, ...)
+	__attribute__((format(printf, 7, 8)));
+
+#define vb_log_limited(limit, interval_ms, level, ...)	vb_log_ratelimited(limit, interval_ms, level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+
+/* Logs what the module did since the previous summary (monitors, segments,
+ * uploads, failures) once interval_s passed, 0 disables it. Quiet periods
+ * are skipped. Cheap enough to call on every segment. */
+void vb_trace_summary_tick(int interval_s);
+
+/* Starts and stops the timeline writer, stop writes everything queued first */
+int vb_trace_start();
+void vb_trace_stop();
+
+struct vb_timeline;
+
+/* The file is created by the writer on the first event. NULL when the writer is not running. */
+struct vb_timeline* vb_timeline_open(const char* filename);
+/* Appends {"ts":<unix time>,"event":<event>,<fields>}, fields is a printf
+ * format of further JSON members, e.g. "\"segment\":%d". Never blocks: events
+ * are dropped when the writer falls behind. A NULL timeline is ignored. */
+void vb_timeline_event(struct vb_timeline* timeline, const char* event, const char* fields, ...)
+	__attribute__((format(printf, 3, 4)));
+/* no events may follow */
+void vb_timeline_close(struct vb_timeline* timeline);
+
+/* timeline events dropped so far */
+long long vb_timeline_dropped();
+
+#endif
@@ -1,51 +1,382 @@
-#include "asterisk.h"
-#include "asterisk/paths.h"	/* use ast_config_AST_MONITOR_DIR */
-#include "asterisk/file.h"
-#include "asterisk/audiohook.h"
-#include "asterisk/pbx.h"
-#include "asterisk/module.h"
-#include "asterisk/cli.h"
-#include "asterisk/app.h"
-#include "asterisk/channel.h"
-#include "asterisk/autochan.h"
-#include "asterisk/manager.h"
-#include "asterisk/test.h"
-#include "asterisk/utils.h"
-#include "asterisk/config.h"
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <ifaddrs.h>
 #include <curl/curl.h>
 #include "cJSON.h"
+#include "vb_platform.h"
 #include "voicebase.h"
+#include "vb_dsp.h"
+#include "vb_pipeline.h"
+#include "vb_stats.h"
+#include "vb_trace.h"
+#include "vb_probes.h"
+
+/* Module settings. A published snapshot is never modified: set_defaults() and
+ * the setters fill a draft, vb_config_apply() publishes a copy of it. Calls
+ * keep the snapshot they started with, closed segments the one of their call. */
+#define VB_PROFILE_BUCKETS	64
+
+struct vb_config{
+	int		refs;
+	char	api_key[1024];
+	char	password[1024];
+	char	pub[1024];
+	char	callback_url[2048];
+	char	api_url[1024];
+	char	title[1024];
+	int		segment_duration;
+	int		stereo;
+	int		segment_mode;
+	int		segment_min_duration;
+	int		segment_pause_ms;
+	int		segment_stagger;
+	int		segment_adaptive;
+	int		segment_adaptive_min;
+	int		segment_adaptive_max;
+	int		silence_elision;
+	int		silence_keep_ms;
+	int		vad_threshold;
+	int		hold_detection;
+	int		hold_detect_ms;
+	int		sample_rate;
+	int		encode_workers;
+	int		upload_workers;
+	int		pipeline_queue_limit;
+	int		upload_max_per_key;
+	int		upload_max_bytes_per_key;
+	int		trace_level;
+	int		trace_summary_interval;
+	int		trace_timeline;
+	char	trace_dir[1024];
+	char	ip_string[1024];
+
+	struct vb_profile	general;		//the upload settings above, for calls without a profile
+	struct vb_profile*	profiles[VB_PROFILE_BUCKETS];
+	int		num_profiles;
+};
 
-static char vb_api_key[1024];
-static char vb_password[1024];
-static char vb_public[1024];
-static char vb_callback_url[2048];
-static char vb_api_url[1024];
-static char vb_title[1024];
-static int  vb_segment_duration;
-static char vb_ip_string[1024];
+static struct vb_config vb_config_draft;
+static struct vb_config vb_config_initial;	//the first snapshot, so publishing it can't fail
+static struct vb_config* vb_config;			//the current snapshot
+static pthread_mutex_t vb_config_lock = PTHREAD_MUTEX_INITIALIZER;
 //static char vb_time_string[1024];
 
+#define SAMPLES_PER_BLOCK 320
+
 struct buf_t{
 	int 	pos;
 	char* 	buf;
 	int 	buf_size;
 };
 
+/* Parsed call params, shared by the capture thread and the segments of the call still in the pipeline */
+struct vb_params{
+	int			refs;
+	cJSON*		json;
+	int			uploads_in_flight;	//closed segments of the call not uploaded yet
+	long long	bytes_uploaded;
+	int			trace_level;
+	struct vb_timeline*	timeline;	//closed with the last reference, after the final upload
+	struct vb_upload_form	form;	//the fields every segment shares, resolved when the call starts
+	char		call_id[4096];
+	struct vb_form_template*	tmpl;	//rendered from form when the first segment closes
+};
+
+/* A closed segment on its way through the encode and upload stages */
+struct vb_segment{
+	struct vb_job 		job;		//must be first
+	struct vb_params* 	params;
+	struct vb_config*	config;		//the settings of the call
+	struct vb_profile*	profile;	//owned by config
+	const struct vb_form_template*	tmpl;	//owned by params
+	char* 	buf;
+	int		buf_size;
+	int 	size;
+	int 	wav_header_size;
+	int 	count;
+	int 	last;
+	int		pts;
+	int		trace_level;
+	char 	session_id[2048];
+	char 	channel[256];
+	char 	time_string[1024];
+	int		num_offsets;
+	struct vb_offset offsets[VB_MAX_OFFSETS];
+
+	//filled in by the encode stage
+	char	full_session_id[4096];
+	char	content_name[VB_CONTENT_NAME_MAX];
+	char	start_pts[64];
+	char	offset_map[VB_MAX_OFFSETS * 24 + 4];
+	int		has_offset_map;
+	long long	closed;		//vb_now_us() when the segment was closed
+	struct vb_segment*	next_closed;	//closed segments of the call not submitted yet
+};
+
+static struct vb_stage* encode_stage;
+static struct vb_stage* upload_stage;
+
+static struct vb_ratelimit curl_fail_limit;
+static struct vb_ratelimit upload_fail_limit;
+#define FAIL_LOG_INTERVAL_MS	10000
+
+static vb_transport_fn vb_transport = curl_post_segment;
+
+void set_vb_transport(vb_transport_fn transport){
+	vb_transport = transport ? transport : curl_post_segment;
+}
+
+static vb_event_fn vb_event_handler;
+
+void set_vb_event_handler(vb_event_fn handler){
+	vb_event_handler = handler;
+}
+
+/* djb2, the same hash as ast_str_hash() */
+static unsigned int hash_string(const char* str){
+	unsigned int hash = 5381;
+	while (*str)
+		hash = hash * 33 ^ (unsigned char)*str++;
+	return hash;
+}
+
+static void free_profiles(struct vb_config* config){
+	struct vb_profile* profile;
+	int i;
+
+	for (i = 0; i < VB_PROFILE_BUCKETS; ++i){
+		while ((profile = config->profiles[i])){
+			config->profiles[i] = profile->next;
+			vb_free(profile);
+		}
+	}
+	config->num_profiles = 0;
+}
+
+static struct vb_profile* find_profile(struct vb_config* config, const char* name){
+	struct vb_profile* profile;
+
+	for (profile = config->profiles[hash_string(name) % VB_PROFILE_BUCKETS]; profile; profile = profile->next){
+		if (!strcmp(profile->name, name))
+			return profile;
+	}
+	return NULL;
+}
+
+static void vb_config_ref(struct vb_config* config){
+	__atomic_fetch_add(&config->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void vb_config_unref(struct vb_config* config){
+	if (config && __atomic_sub_fetch(&config->refs, 1, __ATOMIC_ACQ_REL) == 0){
+		free_profiles(config);
+		if (config != &vb_config_initial)
+			vb_free(config);
+	}
+}
+
+/* The built-in settings, without profiles */
+static void config_defaults(struct vb_config* config){
+    memset(config->api_key, 0, sizeof(config->api_key));
+    memset(config->password, 0, sizeof(config->password));
+    memset(config->pub, 0, sizeof(config->pub));
+    memset(config->callback_url, 0, sizeof(config->callback_url));
+    memset(config->title, 0, sizeof(config->title));
+ //   memset(vb_time_string, 0, sizeof(vb_time_string));
+    strcpy(config->api_url, "http://www.beta.voicebase.com");
+    get_ip_string(config->ip_string, sizeof(config->ip_string));
+
+    config->segment_duration = 120;
+    config->stereo = 0;
+    config->segment_mode = VB_SEGMENT_FIXED;
+    config->segment_min_duration = 30;
+    config->segment_pause_ms = 200;
+    config->segment_stagger = 0;
+    config->segment_adaptive = 0;
+    config->segment_adaptive_min = 30;
+    config->segment_adaptive_max = 300;
+    config->silence_elision = VB_ELISION_OFF;
+    config->silence_keep_ms = 400;
+    config->vad_threshold = -45;
+    config->hold_detection = 0;
+    config->hold_detect_ms = 3000;
+    config->sample_rate = VB_CAPTURE_RATE;
+    config->encode_workers = 2;
+    config->upload_workers = 4;
+    config->pipeline_queue_limit = 64;
+    config->upload_max_per_key = 0;
+    config->upload_max_bytes_per_key = 0;
+    config->trace_level = VB_TRACE_OFF;
+    config->trace_summary_interval = 300;
+    config->trace_timeline = 0;
+    memset(config->trace_dir, 0, sizeof(config->trace_dir));
+}
+
 void set_defaults(){
     /* Set the default values */
-    memset(vb_api_key, 0, sizeof(vb_api_key));
-    memset(vb_password, 0, sizeof(vb_password));
-    memset(vb_public, 0, sizeof(vb_public));
-    memset(vb_callback_url, 0, sizeof(vb_callback_url));
-    memset(vb_title, 0, sizeof(vb_title));
- //   memset(vb_time_string, 0, sizeof(vb_time_string));
-    strcpy(vb_api_url, "http://www.beta.voicebase.com");
-    get_ip_string(vb_ip_string, sizeof(vb_ip_string));
+    free_profiles(&vb_config_draft);
+    config_defaults(&vb_config_draft);
+}
+
+static void init_profile(struct vb_profile* profile, const char* name, const struct vb_config* from){
+	memset(profile, 0, sizeof(*profile));
+	snprintf(profile->name, 			sizeof(profile->name), 			"%s", name);
+	snprintf(profile->api_key, 			sizeof(profile->api_key), 		"%s", from->api_key);
+	snprintf(profile->password, 		sizeof(profile->password), 		"%s", from->password);
+	snprintf(profile->pub, 				sizeof(profile->pub), 			"%s", from->pub);
+	snprintf(profile->callback_url, 	sizeof(profile->callback_url), 	"%s", from->callback_url);
+	snprintf(profile->api_url, 			sizeof(profile->api_url), 		"%s", from->api_url);
+	snprintf(profile->title, 			sizeof(profile->title), 		"%s", from->title);
+	snprintf(profile->transcript_type, 	sizeof(profile->transcript_type), "machine");
+}
+
+static int segment_adaptive_ms;			//effective length of adaptive segments, 0 until the first adjustment
+static long long segment_adapt_next;
+
+static int clamp_segment_ms(const struct vb_config* config, int ms){
+	if (ms > config->segment_adaptive_max * 1000)
+		ms = config->segment_adaptive_max * 1000;
+	if (ms < config->segment_adaptive_min * 1000)
+		ms = config->segment_adaptive_min * 1000;
+	return ms;
+}
+
+/* the length segments are closed at now */
+static int get_segment_ms(const struct vb_config* config){
+	int ms;
+
+	if (!config->segment_adaptive)
+		return config->segment_duration * 1000;
+	ms = __atomic_load_n(&segment_adaptive_ms, __ATOMIC_RELAXED);
+	return clamp_segment_ms(config, ms ? ms : config->segment_duration * 1000);
+}
+
+/* Adaptive segments: at a segment boundary a call may look at the pipeline,
+ * at most once per segment length for all calls together, so a step shows in
+ * the queues before the next one is taken. More segments waiting than there
+ * are upload workers is a backlog, longer segments then mean fewer requests
+ * for the same audio. An empty pipeline with a spare upload worker can afford
+ * more requests, shorter segments then bring the transcripts sooner. The
+ * length grows faster than it shrinks, so a burst is absorbed quickly and the
+ * length settles when the load is even. */
+static void adapt_segment_length(const struct vb_config* config){
+	long long now = vb_now_us();
+	long long next = __atomic_load_n(&segment_adapt_next, __ATOMIC_RELAXED);
+	struct vb_stage_stats encode, upload;
+	int waiting;
+	int ms;
+
+	if (now < next)
+		return;
+	ms = get_segment_ms(config);
+	if (!__atomic_compare_exchange_n(&segment_adapt_next, &next, now + ms * 1000LL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	vb_pipeline_get_stats(&encode, &upload);
+	waiting = encode.queued + upload.queued;
+	if (waiting > upload.workers)
+		ms += ms / 4;
+	else if (!waiting && upload.busy < upload.workers)
+		ms -= ms / 10;
+	ms = clamp_segment_ms(config, ms);
+	__atomic_store_n(&segment_adaptive_ms, ms, __ATOMIC_RELAXED);
+	__atomic_store_n(&segment_adapt_next, now + ms * 1000LL, __ATOMIC_RELAXED);
+	vb_stats_set(segment_length_ms, ms);
+}
 
-    vb_segment_duration = 120;
+/* Fixes the length of the call's next segment. A change of the adaptive
+ * length applies at the next boundary of every call, so the boundaries stay
+ * spread and open segments are not cut short together. */
+static void latch_segment_length(struct mem_storage_t* mem_storage){
+	if (mem_storage->config->segment_adaptive)
+		adapt_segment_length(mem_storage->config);
+	mem_storage->segment_ms = get_segment_ms(mem_storage->config);
+}
+
+/* a segment of segment_ms at the upload rate, plus a second */
+static int get_segment_buf_size(const struct mem_storage_t* mem_storage){
+	return (int)((mem_storage->segment_ms + 1000LL) * mem_storage->sample_rate / 1000) * 2 * mem_storage->num_of_channels;
+}
+
+static const struct vb_fair_limits* get_upload_limits(const struct vb_config* config, struct vb_fair_limits* limits){
+	limits->max_jobs = config->upload_max_per_key;
+	limits->max_cost = config->upload_max_bytes_per_key;
+	return limits;
+}
+
+/* Puts the settings of a newly published snapshot into effect */
+static void config_published(const struct vb_config* config){
+	struct vb_fair_limits limits;
+
+	vb_stage_set_limits(upload_stage, get_upload_limits(config, &limits));
+	if (!config->segment_adaptive)
+		__atomic_store_n(&segment_adaptive_ms, 0, __ATOMIC_RELAXED);
+	vb_stats_set(segment_length_ms, get_segment_ms(config));
+	vb_stats_set(segment_adaptive, config->segment_adaptive ? 1 : 0);
+}
+
+int vb_config_apply(){
+	struct vb_config* config;
+	struct vb_config* old;
+
+	pthread_mutex_lock(&vb_config_lock);
+	if (!vb_config){
+		config = &vb_config_initial;
+	}else if (!(config = vb_malloc(sizeof(*config)))){
+		pthread_mutex_unlock(&vb_config_lock);
+		vb_log(VB_LOG_ERROR, "Can't allocate the configuration, keeping the previous one\n");
+		return -1;
+	}
+	memcpy(config, &vb_config_draft, sizeof(*config));
+	config->refs = 1;
+	init_profile(&config->general, "", config);
+	//the snapshot takes over the profiles
+	memset(vb_config_draft.profiles, 0, sizeof(vb_config_draft.profiles));
+	vb_config_draft.num_profiles = 0;
+
+	old = vb_config;
+	vb_config = config;
+	pthread_mutex_unlock(&vb_config_lock);
+	config_published(config);
+
+	//the snapshot stays alive while calls or segments still use it
+	vb_config_unref(old);
+	return 0;
+}
+
+/* The current snapshot with a reference. The lock is held just long enough to
+ * take the reference, so a concurrent vb_config_apply() can't free it first.
+ * Before anything is applied the built-in defaults are published, never the
+ * unapplied draft. */
+static struct vb_config* vb_config_acquire(){
+	struct vb_config* config;
+	int published = 0;
+
+	pthread_mutex_lock(&vb_config_lock);
+	if (!vb_config){
+		config_defaults(&vb_config_initial);
+		vb_config_initial.refs = 1;
+		init_profile(&vb_config_initial.general, "", &vb_config_initial);
+		vb_config = &vb_config_initial;
+		published = 1;
+	}
+	config = vb_config;
+	vb_config_ref(config);
+	pthread_mutex_unlock(&vb_config_lock);
+	if (published){
+		vb_log(VB_LOG_WARNING, "No configuration applied, using the defaults\n");
+		config_published(config);
+	}
+	return config;
 }
 
 static void get_time_string(char* result, int max_size){
@@ -66,12 +397,40 @@ char* get_safe_object_strings(cJSON *m, char* name, char* default_val){
 	return result;
 }
 
-int get_safe_object_integer(cJSON *m, char* name){
+/* the spellings ast_true() accepts */
+static int is_true(const char* value){
+	return !strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcasecmp(value, "y") ||
+		   !strcasecmp(value, "t") || !strcasecmp(value, "1") || !strcasecmp(value, "on");
+}
+
+int get_safe_object_bool(cJSON *m, char* name, int default_val){
+	int result = default_val;
+	if (m && name){
+		cJSON* element = cJSON_GetObjectItem(m,name);
+		if (element){
+			if (element->type == cJSON_True)
+				result = 1;
+			else if (element->type == cJSON_False)
+				result = 0;
+			else if (element->type == cJSON_Number)
+				result = (element->valueint != 0);
+			else if (element->valuestring)
+				result = is_true(element->valuestring);
+		}
+	}
+	return result;
+}
 
-	int result = 0;
-	cJSON* element = cJSON_GetObjectItem(m,name);
-	if (element){
-		result = element->valueint;
+int get_safe_object_integer(cJSON *m, char* name, int default_val){
+	int result = default_val;
+	if (m && name){
+		cJSON* element = cJSON_GetObjectItem(m,name);
+		if (element){
+			if (element->type == cJSON_Number)
+				result = element->valueint;
+			else if (element->valuestring)
+				sscanf(element->valuestring, "%30d", &result);
+		}
 	}
 	return result;
 }
@@ -95,112 +454,233 @@ static size_t RecvCallBack ( char *ptr, size_t size, size_t nmemb, char *data )
 	return size * nmemb;
 }
 
-static CURLcode curl_post_segment(	const char* version,
-								const char* apikey,
-								const char* password,
-								const char* action,
-								const char* callID,
-								const char* segmentNumber,
-								const char* finalSegment,
-								const char* rtCallbackURL,
-								const char* content_name,
-								const char* content_buff,
-								long content_size,
-								const char* pub,
-								const char* title,
-								const char* time_str,
-								const char* desc,
-								const char* lang,
-								const char* sourceUrl,
-								const char* recordedDate,
-								const char* externalId,
-								const char* ownerId,
-								const char* autoCreate,
-								const char* humanRush,
-								const char* transcriptType,
-
-								char* status_str,
-								int status_max_size){
+struct vb_form_template{
+	char	boundary[48];
+	char	content_type[96];
+	char	trailer[64];
+	int		trailer_size;
+	int		size;
+	char	head[];			//the fields, size bytes
+};
+
+/* Appends a field at len like snprintf: the result is the length it needs,
+ * buf NULL or full only measures */
+static int render_field(char* buf, int max, int len, const char* boundary, const char* name, const char* value){
+	int room = (buf && len < max) ? max - len : 0;
+
+	if (!value)
+		return len;
+	return len + snprintf(room ? buf + len : NULL, room,
+			"--%s\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n%s\r\n", boundary, name, value);
+}
+
+/* Appends value to a quoted header parameter like render_field(). '"', CR and
+ * LF would end the parameter or the header, they are percent-encoded as
+ * browsers do. Field values need no such care: they are part bodies, which
+ * end at the boundary only, and the boundary is random. */
+static int render_quoted(char* buf, int max, int len, const char* value){
+	for (; *value; ++value){
+		const char* escape = *value == '"' ? "%22" : *value == '\r' ? "%0D" : *value == '\n' ? "%0A" : NULL;
+		int n = escape ? 3 : 1;
+
+		if (len + n < max)
+			memcpy(buf + len, escape ? escape : value, n);
+		len += n;
+	}
+	if (len < max)
+		buf[len] = 0;
+	return len;
+}
+
+static int render_static_fields(char* buf, int max, const char* boundary, const struct vb_upload_form* form){
+	int len = 0;
+
+	len = render_field(buf, max, len, boundary, "version", 		form->version);
+	len = render_field(buf, max, len, boundary, "apikey", 		form->apikey);
+	len = render_field(buf, max, len, boundary, "password", 		form->password);
+	len = render_field(buf, max, len, boundary, "action", 		form->action);
+	len = render_field(buf, max, len, boundary, "callID", 		form->callID);
+	len = render_field(buf, max, len, boundary, "rtCallbackUrl", 	form->rtCallbackURL);
+	len = render_field(buf, max, len, boundary, "transcriptType", form->transcriptType);
+	len = render_field(buf, max, len, boundary, "public", 		form->pub);
+	len = render_field(buf, max, len, boundary, "title", 			form->title);
+	len = render_field(buf, max, len, boundary, "desc", 			form->desc);
+	len = render_field(buf, max, len, boundary, "lang", 			form->lang);
+	len = render_field(buf, max, len, boundary, "sourceUrl", 		form->sourceUrl);
+	len = render_field(buf, max, len, boundary, "recordedDate", 	form->recordedDate);
+	len = render_field(buf, max, len, boundary, "externalId", 	form->externalId);
+	len = render_field(buf, max, len, boundary, "ownerId", 		form->ownerId);
+	len = render_field(buf, max, len, boundary, "autoCreate", 	form->autoCreate);
+	len = render_field(buf, max, len, boundary, "humanRush", 		form->humanRush);
+	return len;
+}
+
+struct vb_form_template* vb_form_template_create(const struct vb_upload_form* form){
+	static unsigned long long boundary_seq;
+	struct vb_form_template* tmpl;
+	char boundary[48];
+	int size;
+
+	//unique per call, so an uploaded WAV can't contain it by chance
+	snprintf(boundary, sizeof(boundary), "------------------------vb%016llx",
+			(unsigned long long)vb_now_us() * 0x9E3779B97F4A7C15ULL + __atomic_add_fetch(&boundary_seq, 1, __ATOMIC_RELAXED));
+	size = render_static_fields(NULL, 0, boundary, form);
+	if (!(tmpl = vb_malloc(sizeof(*tmpl) + size + 1)))
+		return NULL;
+	memcpy(tmpl->boundary, boundary, sizeof(boundary));
+	snprintf(tmpl->content_type, sizeof(tmpl->content_type), "multipart/form-data; boundary=%s", boundary);
+	tmpl->trailer_size = snprintf(tmpl->trailer, sizeof(tmpl->trailer), "\r\n--%s--\r\n", boundary);
+	tmpl->size = render_static_fields(tmpl->head, size + 1, boundary, form);
+	return tmpl;
+}
+
+void vb_form_template_free(struct vb_form_template* tmpl){
+	vb_free(tmpl);
+}
+
+int vb_upload_body_init(struct vb_upload_body* body, const struct vb_form_template* tmpl, const struct vb_upload_form* form){
+	int max = sizeof(body->fields);
+	int len = 0;
+
+	len = render_field(body->fields, max, len, tmpl->boundary, "startTime", 		form->time_str);
+	len = render_field(body->fields, max, len, tmpl->boundary, "segmentNumber", 	form->segmentNumber);
+	len = render_field(body->fields, max, len, tmpl->boundary, "finalSegment", 	form->finalSegment);
+	len = render_field(body->fields, max, len, tmpl->boundary, "offsetMap", 		form->offsetMap);
+	if (len < max)
+		len += snprintf(body->fields + len, max - len, "--%s\r\nContent-Disposition: form-data; name=\"file\"; filename=\"", tmpl->boundary);
+	len = render_quoted(body->fields, max, len, form->content_name);
+	if (len < max)
+		len += snprintf(body->fields + len, max - len, "\"\r\nContent-Type: application/octet-stream\r\n\r\n");
+	if (len >= max)
+		return -1;
+
+	body->parts[0] = tmpl->head;
+	body->sizes[0] = tmpl->size;
+	body->parts[1] = body->fields;
+	body->sizes[1] = len;
+	body->parts[2] = form->content_buff;
+	body->sizes[2] = form->content_size;
+	body->parts[3] = tmpl->trailer;
+	body->sizes[3] = tmpl->trailer_size;
+	body->size = body->sizes[0] + body->sizes[1] + body->sizes[2] + body->sizes[3];
+	body->content_type = tmpl->content_type;
+	return 0;
+}
+
+/* Where libcurl is in the body, it may rewind on a redirect or a retried connection */
+struct body_reader{
+	const struct vb_upload_body*	body;
+	int		part;
+	long	offset;
+};
+
+static size_t ReadCallBack(char *ptr, size_t size, size_t nmemb, void *data){
+	struct body_reader* reader = data;
+	size_t max = size * nmemb;
+	size_t done = 0;
+
+	while (done < max && reader->part < VB_UPLOAD_BODY_PARTS){
+		long left = reader->body->sizes[reader->part] - reader->offset;
+		size_t n;
+
+		if (left <= 0){
+			++reader->part;
+			reader->offset = 0;
+			continue;
+		}
+		n = (size_t)left < max - done ? (size_t)left : max - done;
+		memcpy(ptr + done, reader->body->parts[reader->part] + reader->offset, n);
+		reader->offset += n;
+		done += n;
+	}
+	return done;
+}
+
+static int SeekCallBack(void *data, curl_off_t offset, int origin){
+	struct body_reader* reader = data;
+
+	if (origin != SEEK_SET || offset < 0 || offset > reader->body->size)
+		return CURL_SEEKFUNC_CANTSEEK;
+	for (reader->part = 0; reader->part < VB_UPLOAD_BODY_PARTS && offset >= reader->body->sizes[reader->part]; ++reader->part)
+		offset -= reader->body->sizes[reader->part];
+	reader->offset = offset;
+	return CURL_SEEKFUNC_OK;
+}
+
+int curl_post_segment(const struct vb_upload_form* form, char* status_str, int status_max_size, long* http_status){
 	CURL *curl;
 	CURLcode res;
-	struct curl_httppost *formpost=NULL;
-	struct curl_httppost *lastptr=NULL;
+	struct vb_form_template* own_tmpl = NULL;
+	const struct vb_form_template* tmpl = form->tmpl;
+	struct vb_upload_body body;
+	struct body_reader reader;
+	struct curl_slist* headers = NULL;
+	char content_type[128];
 
 	struct buf_t buf;
-	CURLFORMcode form_res;
 
 	buf.pos = 0;
 	buf.buf = status_str;
 	buf.buf_size = status_max_size;
+	*http_status = 0;
+	status_str[0] = 0;
 //	ast_mutex_lock(&curl_lock);
 
-#define ADD_FORM_DATA(X, VAL) if (VAL) { form_res = curl_formadd(&formpost,  &lastptr,  CURLFORM_COPYNAME, X, CURLFORM_COPYCONTENTS, VAL,  CURLFORM_END);  \
-					 ast_log(LOG_NOTICE, "%s = %s\n", (X), (VAL));	\
-					}
-
-	ADD_FORM_DATA("version", 		version);
-	ADD_FORM_DATA("apikey", 		apikey);
-	ADD_FORM_DATA("password", 		password);
-	ADD_FORM_DATA("action", 		action);
-	ADD_FORM_DATA("callID", 		callID);
-	ADD_FORM_DATA("startTime", 		time_str);
-	ADD_FORM_DATA("segmentNumber", 	segmentNumber);
-	ADD_FORM_DATA("finalSegment", 	finalSegment);
-	ADD_FORM_DATA("rtCallbackUrl", 	rtCallbackURL);
-	ADD_FORM_DATA("transcriptType", transcriptType);
-	ADD_FORM_DATA("public", 		pub);
-	ADD_FORM_DATA("title", 			title);
-	ADD_FORM_DATA("desc", 			desc);
-	ADD_FORM_DATA("lang", 			lang);
-	ADD_FORM_DATA("sourceUrl", 			sourceUrl);
-	ADD_FORM_DATA("recordedDate", 			recordedDate);
-	ADD_FORM_DATA("externalId", 			externalId);
-	ADD_FORM_DATA("ownerId", 			ownerId);
-	ADD_FORM_DATA("autoCreate", 			autoCreate);
-	ADD_FORM_DATA("humanRush", 			humanRush);
-
-#undef ADD_FORM_DATA
-
-	form_res = curl_formadd(&formpost,
-	               &lastptr,
-	               CURLFORM_COPYNAME, "file",
-	               CURLFORM_BUFFER, 		content_name,
-	               CURLFORM_BUFFERPTR, 		content_buff,
-	               CURLFORM_BUFFERLENGTH, 	content_size,
-	               CURLFORM_END);
-
-//	ast_log(LOG_NOTICE, "content name = %s, content size = %d, content_ptr=0x%X\n", content_name, (int)content_size, (int)content_buff);
-
-
-//	ast_log(LOG_NOTICE, "11 = %d\n", (int)form_res);
-
-
-//	ast_log(LOG_NOTICE, "13 = %d\n", (int)form_res);
+	if (!tmpl && !(tmpl = own_tmpl = vb_form_template_create(form))){
+		vb_log_limited(&curl_fail_limit, FAIL_LOG_INTERVAL_MS, VB_LOG_WARNING, "Out of memory for the upload form\n");
+		return CURLE_OUT_OF_MEMORY;
+	}
+	if (vb_upload_body_init(&body, tmpl, form)){
+		vb_log_limited(&curl_fail_limit, FAIL_LOG_INTERVAL_MS, VB_LOG_WARNING, "The fields of %s don't fit the upload form\n", form->content_name);
+		vb_form_template_free(own_tmpl);
+		return CURLE_FAILED_INIT;
+	}
+	reader.body 	= &body;
+	reader.part 	= 0;
+	reader.offset 	= 0;
+	snprintf(content_type, sizeof(content_type), "Content-Type: %s", body.content_type);
 
 	/* get a curl handle */
 	curl = curl_easy_init();
-	if(curl) {
+	if(curl && (headers = curl_slist_append(NULL, content_type))) {
 		/* First set the URL that is about to receive our POST. This URL can
 		   just as well be a https:// URL if that is what should receive the
 		   data. */
-		res = curl_easy_setopt(curl, CURLOPT_URL, vb_api_url);
-	//	ast_log(LOG_NOTICE, "a = %d\n", (int)res);
-		/* Now specify the POST data */
-
-		res = curl_easy_setopt(curl, CURLOPT_HTTPPOST, formpost);
-	//	ast_log(LOG_NOTICE, "b = %d\n", (int)res);
+		res = curl_easy_setopt(curl, CURLOPT_URL, form->url);
+		/* Now specify the POST data, streamed from the parts of the body */
+		res = curl_easy_setopt(curl, CURLOPT_POST, 1L);
+		res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		res = curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body.size);
+		res = curl_easy_setopt(curl, CURLOPT_READFUNCTION, ReadCallBack);
+		res = curl_easy_setopt(curl, CURLOPT_READDATA, &reader);
+		res = curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, SeekCallBack);
+		res = curl_easy_setopt(curl, CURLOPT_SEEKDATA, &reader);
 	//	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1 );
 		res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, RecvCallBack);
-	//	ast_log(LOG_NOTICE, "c = %d\n", (int)res);
+	//	vb_log(VB_LOG_NOTICE, "c = %d\n", (int)res);
 
 		res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-	//	ast_log(LOG_NOTICE, "d = %d\n", (int)res);
+	//	vb_log(VB_LOG_NOTICE, "d = %d\n", (int)res);
 
 		/* Perform the request, res will get the return code */
 		res = curl_easy_perform(curl);
 		/* Check for errors */
 		if(res != CURLE_OK)
-			ast_log(LOG_NOTICE, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+			vb_log_limited(&curl_fail_limit, FAIL_LOG_INTERVAL_MS, VB_LOG_WARNING, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+		else{
+			double connect = 0, appconnect = 0, pretransfer = 0, total = 0;
+
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, http_status);
+			curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+			curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+			curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+			curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+			//the times are cumulative from the start of the request
+			vb_histogram_record(&vb_hist_curl_connect, (long long)(connect * 1e6));
+			if (appconnect > 0)
+				vb_histogram_record(&vb_hist_curl_tls, (long long)((appconnect - connect) * 1e6));
+			vb_histogram_record(&vb_hist_curl_transfer, (long long)((total - pretransfer) * 1e6));
+		}
 
 		if (buf.pos > 0 && buf.pos < buf.buf_size){
 			buf.buf[buf.pos] = 0;
@@ -208,12 +688,16 @@ static CURLcode curl_post_segment(	const char* version,
 			buf.buf[0] = 0;
 		}
 
-		curl_formfree(formpost);
+		curl_slist_free_all(headers);
 		/* always cleanup */
 		curl_easy_cleanup(curl);
 	}else{
-	    ast_log(LOG_NOTICE, "Failed to do curl_easy_init()\n");
+	    vb_log_limited(&curl_fail_limit, FAIL_LOG_INTERVAL_MS, VB_LOG_WARNING, "Failed to do curl_easy_init()\n");
+	    if (curl)
+	    	curl_easy_cleanup(curl);
+	    res = CURLE_FAILED_INIT;
 	}
+	vb_form_template_free(own_tmpl);
 //	ast_mutex_unlock(&curl_lock);
 	return res;
 }
@@ -265,12 +749,171 @@ void wav_header_data_size_fix(char* buf, int data_size){
 	write_int(buf + 40, data_size);
 }
 
+static struct vb_params* vb_params_alloc(cJSON* json){
+	struct vb_params* params = vb_calloc(1, sizeof(*params));
+	if (params){
+		params->refs = 1;
+		params->json = json;
+	}
+	return params;
+}
+
+static void vb_params_ref(struct vb_params* params){
+	__atomic_fetch_add(&params->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void vb_params_unref(struct vb_params* params){
+	if (__atomic_sub_fetch(&params->refs, 1, __ATOMIC_ACQ_REL) == 0){
+		vb_timeline_close(params->timeline);
+		vb_form_template_free(params->tmpl);
+		if (params->json)
+			cJSON_Delete(params->json);
+		vb_free(params);
+	}
+}
+
+/* "trace" of the call params, a level name or number */
+static int get_call_trace_level(const struct vb_config* config, cJSON* params){
+	const char* value = get_safe_object_strings(params, "trace", NULL);
+	int level = value ? parse_trace_level(value) : get_safe_object_integer(params, "trace", config->trace_level);
+
+	if (level < VB_TRACE_OFF || level > VB_TRACE_DEBUG){
+		vb_log(VB_LOG_WARNING, "Invalid trace level in the params, using %s\n", trace_level_name(config->trace_level));
+		level = config->trace_level;
+	}
+	return level;
+}
+
+/* the callID of the uploads: the "callId" param or <channel>_<ip>_<start time> */
+static const char* get_call_id(const struct vb_config* config, cJSON* params, const char* session_id, const char* time_string, char* result, int max_size){
+	const char* call_id = get_safe_object_strings(params, "callId", NULL);
+
+	if (call_id)
+		return call_id;
+	snprintf(result, max_size, "%s_%s_%s", session_id, config->ip_string, time_string);
+	return result;
+}
+
+/* The fields of the uploads of a call that don't depend on the segment, from the params and the
+ * profile. The strings stay owned by them. callID is NULL unless the params have one. */
+static void resolve_upload_form(struct vb_upload_form* form, cJSON* params, struct vb_profile* profile){
+	memset(form, 0, sizeof(*form));
+	form->url 				= profile->api_url;
+	form->version 			= "1.1";
+	form->action 			= "uploadMedia";
+	form->apikey			= get_safe_object_strings(params, "apikey", 			profile->api_key);
+	form->password			= get_safe_object_strings(params, "pw", 				profile->password);
+	form->title				= get_safe_object_strings(params, "title", 			profile->title);
+	form->callID			= get_safe_object_strings(params, "callId", 			NULL);
+	form->pub				= get_safe_object_strings(params, "public", 			profile->pub);
+	form->rtCallbackURL		= get_safe_object_strings(params, "rtCallbackUrl",	 	profile->callback_url);
+
+	form->desc				= get_safe_object_strings(params, "desc", 				NULL);
+	form->lang				= get_safe_object_strings(params, "lang", 				profile->lang[0] ? profile->lang : NULL);
+	form->sourceUrl			= get_safe_object_strings(params, "sourceUrl", 		NULL);
+	form->recordedDate		= get_safe_object_strings(params, "recordedDate", 		NULL);
+	form->externalId		= get_safe_object_strings(params, "externalId", 		NULL);
+	form->ownerId			= get_safe_object_strings(params, "ownerId", 			NULL);
+	form->autoCreate		= get_safe_object_strings(params, "autoCreate", 		NULL);
+	form->humanRush			= get_safe_object_strings(params, "humanRush", 		NULL);
+	form->transcriptType	= get_safe_object_strings(params, "transcriptType", 	profile->transcript_type);
+}
+
+static struct vb_timeline* get_timeline(struct mem_storage_t* mem_storage){
+	return mem_storage->shared_params ? mem_storage->shared_params->timeline : NULL;
+}
+
 int create_mem_storage(struct mem_storage_t* mem_storage, const char * command_line){
-	mem_storage->buf 		= ast_calloc(1, vb_segment_duration * 8000 * 2 + 16000);
+	struct vb_config* config;
+	const char* profile_name = NULL;
+	int buf_size;
+
+	//the call keeps the settings it started with, a reload applies to new calls
+	config = mem_storage->config = vb_config_acquire();
+	mem_storage->closed = NULL;
+
+	while (isspace((unsigned char)*command_line))
+		++command_line;
+	mem_storage->params = NULL;
+	if (*command_line == '{'){
+		//read only from here on: one allocation, and a couple of dozen lookups
+		if (!(mem_storage->params = cJSON_ParseArena(command_line)))
+			vb_log(VB_LOG_ERROR, "Failed to parse cli params '%s'\n", command_line);
+		else
+			cJSON_IndexObject(mem_storage->params);
+		profile_name = get_safe_object_strings(mem_storage->params, "profile", NULL);
+	}else if (*command_line){
+		//a bare name selects a profile, nothing to parse
+		profile_name = command_line;
+	}
+	mem_storage->profile = &config->general;
+	if (profile_name && !(mem_storage->profile = find_profile(config, profile_name))){
+		vb_log(VB_LOG_WARNING, "Unknown profile '%s', using the general settings\n", profile_name);
+		mem_storage->profile = &config->general;
+	}
+	//closed segments keep a reference, so the params outlive the call until they are uploaded
+	mem_storage->shared_params = vb_params_alloc(mem_storage->params);
+	if (!mem_storage->shared_params){
+		if (mem_storage->params)
+			cJSON_Delete(mem_storage->params);
+		mem_storage->params = NULL;
+	}
+	mem_storage->trace_level = get_call_trace_level(config, mem_storage->params);
+	//the file is named after the channel, so it is opened with the first segment
+	mem_storage->timeline = config->trace_dir[0] && get_safe_object_bool(mem_storage->params, "traceTimeline", config->trace_timeline);
+	if (mem_storage->shared_params){
+		mem_storage->shared_params->trace_level = mem_storage->trace_level;
+		resolve_upload_form(&mem_storage->shared_params->form, mem_storage->params, mem_storage->profile);
+	}
+	mem_storage->num_of_channels = get_safe_object_bool(mem_storage->params, "stereo", config->stereo) ? 2 : 1;
+
+	mem_storage->segment_mode = config->segment_mode;
+	if (get_safe_object_strings(mem_storage->params, "segmentMode", NULL))
+		mem_storage->segment_mode = parse_segment_mode(get_safe_object_strings(mem_storage->params, "segmentMode", NULL));
+
+	mem_storage->stagger = get_safe_object_bool(mem_storage->params, "segmentStagger", config->segment_stagger);
+	mem_storage->stagger_ms = 0;
+
+	mem_storage->silence_elision = config->silence_elision;
+	if (get_safe_object_strings(mem_storage->params, "silenceElision", NULL))
+		mem_storage->silence_elision = parse_silence_elision(get_safe_object_strings(mem_storage->params, "silenceElision", NULL));
+	mem_storage->silence_keep_samples = (mem_storage->silence_elision == VB_ELISION_COMPRESS) ? config->silence_keep_ms * 8 : 0;
+	mem_storage->silence_samples = 0;
+	vb_vad_init(&mem_storage->vad[0], config->vad_threshold);
+	vb_vad_init(&mem_storage->vad[1], config->vad_threshold);
+
+	mem_storage->hold_detection = get_safe_object_bool(mem_storage->params, "holdDetection", config->hold_detection);
+	vb_tone_init(&mem_storage->tone[0], config->hold_detect_ms, config->vad_threshold);
+	vb_tone_init(&mem_storage->tone[1], config->hold_detect_ms, config->vad_threshold);
+
+	//samples are analysed at the capture rate and converted to the upload rate when stored
+	mem_storage->sample_rate = get_safe_object_integer(mem_storage->params, "sampleRate", config->sample_rate);
+	if (mem_storage->sample_rate < VB_MIN_SAMPLE_RATE || mem_storage->sample_rate > VB_MAX_SAMPLE_RATE){
+		vb_log(VB_LOG_WARNING, "Unsupported sampleRate %d, using %d\n", mem_storage->sample_rate, config->sample_rate);
+		mem_storage->sample_rate = config->sample_rate;
+	}
+	mem_storage->resample = 0;
+	if (mem_storage->sample_rate != VB_CAPTURE_RATE){
+		if (vb_resampler_init(&mem_storage->resampler[0], VB_CAPTURE_RATE, mem_storage->sample_rate) ||
+				vb_resampler_init(&mem_storage->resampler[1], VB_CAPTURE_RATE, mem_storage->sample_rate)){
+			vb_log(VB_LOG_WARNING, "Can't resample to %d Hz, uploading %d Hz audio\n", mem_storage->sample_rate, VB_CAPTURE_RATE);
+			vb_resampler_destroy(&mem_storage->resampler[0]);
+			vb_resampler_destroy(&mem_storage->resampler[1]);
+			mem_storage->sample_rate = VB_CAPTURE_RATE;
+		}else{
+			mem_storage->resample = 1;
+		}
+	}
+
+	latch_segment_length(mem_storage);
+	buf_size = get_segment_buf_size(mem_storage);
+	mem_storage->buf 		= vb_calloc(1, buf_size);
 	if (mem_storage->buf)
-		mem_storage->buf_size 	= vb_segment_duration * 8000 * 2 + 16000;
+		mem_storage->buf_size 	= buf_size;
 	else
 		mem_storage->buf_size 	= 0;
+	vb_stats_add(buffered_bytes, mem_storage->buf_size);
+	vb_stats_add(active_monitors, 1);
 	mem_storage->count 			= 0;
 	mem_storage->pos 			= 0;
 	mem_storage->is_opened		= 0;
@@ -278,25 +921,47 @@ int create_mem_storage(struct mem_storage_t* mem_storage, const char * command_l
 	get_time_string(mem_storage->time_string, sizeof(mem_storage->time_string));
 
 	memset(mem_storage->session_id, 0, sizeof(mem_storage->session_id));
-	ast_log(LOG_WARNING, "Allocated memory for storage buffer %d\n", (int)mem_storage->buf_size);
-	mem_storage->params 	= cJSON_Parse(command_line);
-	if (!mem_storage->params){
-		ast_log(LOG_ERROR, "Failed to parse cli params '%s'\n", command_line);
-	}
+	mem_storage->channel[0] = 0;
+	vb_trace(mem_storage->trace_level, VB_TRACE_CALL, "Monitor started: %d channel(s) at %d Hz, %d byte segment buffer\n",
+			mem_storage->num_of_channels, mem_storage->sample_rate, mem_storage->buf_size);
 	return (mem_storage->buf != NULL);
 }
 
 int destroy_mem_storage(struct mem_storage_t* mem_storage){
+	submit_closed_segments(mem_storage);
+	vb_trace(mem_storage->trace_level, VB_TRACE_CALL, "Monitor of %s stopped after %d segment(s)\n", mem_storage->session_id, mem_storage->count + 1);
+	vb_timeline_event(get_timeline(mem_storage), "stop", "\"segments\":%d", mem_storage->count + 1);
+	if (vb_event_handler && mem_storage->channel[0]){
+		struct vb_event event = { VB_EVENT_MONITOR_STOPPED };
+		char call_id[4096];
+
+		event.channel 	= mem_storage->channel;
+		event.call_id 	= get_call_id(mem_storage->config, mem_storage->params, mem_storage->session_id, mem_storage->time_string, call_id, sizeof(call_id));
+		event.segment 	= mem_storage->count + 1;
+		get_upload_stats(mem_storage, &event.uploads_in_flight, &event.bytes);
+		vb_event_handler(&event);
+	}
 	if (mem_storage->buf){
-		ast_free(mem_storage->buf);
+		vb_free(mem_storage->buf);
+		vb_stats_add(buffered_bytes, -mem_storage->buf_size);
 	}
+	vb_stats_add(active_monitors, -1);
 	mem_storage->buf 		= NULL;
 	mem_storage->buf_size 	= 0;
 	mem_storage->count 		= 0;
 	mem_storage->pos 		= 0;
 	mem_storage->is_opened	= 0;
-	if (mem_storage->params)
-		cJSON_Delete(mem_storage->params);
+	if (mem_storage->shared_params)
+		vb_params_unref(mem_storage->shared_params);
+	mem_storage->shared_params 	= NULL;
+	mem_storage->params 		= NULL;
+	vb_config_unref(mem_storage->config);
+	mem_storage->config 		= NULL;
+	if (mem_storage->resample){
+		vb_resampler_destroy(&mem_storage->resampler[0]);
+		vb_resampler_destroy(&mem_storage->resampler[1]);
+		mem_storage->resample = 0;
+	}
 	return 0;
 }
 
@@ -304,25 +969,245 @@ int is_opened(struct mem_storage_t* mem_storage){
 	return mem_storage->is_opened;
 }
 
-int put_data(struct mem_storage_t* mem_storage, struct ast_frame* frm){
+/* Runs the detectors over one leg, returns 1 if somebody is talking on it.
+ * *hold is set when the leg carries hold music or call progress tones. */
+static int analyse_leg(struct mem_storage_t* mem_storage, int leg, const short* samples, int num_samples, int* hold){
+	struct vb_frame_stats stats;
+	int speech;
+
+	vb_frame_stats_s16(samples, num_samples, &stats);
+	speech = vb_vad_update(&mem_storage->vad[leg], &stats);
+	if (mem_storage->hold_detection && vb_tone_process(&mem_storage->tone[leg], samples, &stats)){
+		*hold = 1;
+		return 0;
+	}
+	return speech;
+}
+
+/* Silence elision and hold suspension: decides whether a frame goes into the segment.
+ * Pause frames past the kept part of a pause and hold music/tone frames are
+ * skipped and, when speech resumes, the skip is recorded in the offset map so
+ * transcript timestamps can be mapped back to call time.
+ * Returns 1 if the frame must be stored. */
+static int keep_frame(struct mem_storage_t* mem_storage, const short* left, int left_samples, const short* right, int right_samples){
+	int samples = left_samples > right_samples ? left_samples : right_samples;
+	int speech = 0;
+	int hold = 0;
+	int skip;
+
+	if (mem_storage->silence_elision == VB_ELISION_OFF && mem_storage->segment_mode != VB_SEGMENT_PAUSE
+			&& !mem_storage->hold_detection){
+		mem_storage->in_samples 	+= samples;
+		mem_storage->out_samples 	+= samples;
+		return 1;
+	}
+
+	if (left_samples > 0)
+		speech |= analyse_leg(mem_storage, 0, left, left_samples, &hold);
+	if (right_samples > 0)
+		speech |= analyse_leg(mem_storage, 1, right, right_samples, &hold);
+
+	//hold music counts as a pause for the segmenter, but is skipped regardless of its length
+	if (speech)
+		mem_storage->silence_samples = 0;
+	else
+		mem_storage->silence_samples += samples;
+
+	skip = (hold && !speech) ||
+		   (mem_storage->silence_elision != VB_ELISION_OFF && mem_storage->silence_samples > mem_storage->silence_keep_samples);
+
+	if (mem_storage->eliding && !skip){
+		struct vb_offset* offset = &mem_storage->offsets[mem_storage->num_offsets++];
+		offset->out_samples = mem_storage->out_samples;
+		offset->in_samples 	= mem_storage->in_samples;
+		mem_storage->eliding = 0;
+	}else if (!mem_storage->eliding && skip && mem_storage->num_offsets < VB_MAX_OFFSETS){
+		//a free offset slot is reserved for the resume point before skipping starts
+		mem_storage->eliding = 1;
+	}
+
+	mem_storage->in_samples += samples;
+	if (mem_storage->eliding)
+		return 0;
+	mem_storage->out_samples += samples;
+	return 1;
+}
+
+/* Segment boundary decision, elapsed_ms is the captured time since the segment was opened.
+ * In pause mode segment_length is the hard maximum and the segment is closed
+ * at the first pause once it is segment_min_length long. */
+int segment_should_close(struct mem_storage_t* mem_storage, long int elapsed_ms){
+	long int max_ms;
+	long int min_ms;
+
+	if (!is_opened(mem_storage))
+		return 0;
+	max_ms = mem_storage->segment_ms;
+	//only the first boundary moves, the later ones keep the period
+	if (mem_storage->count == 0 && mem_storage->stagger_ms){
+		max_ms -= mem_storage->stagger_ms;
+		if (max_ms < 1000)
+			max_ms = 1000;
+	}
+	min_ms = mem_storage->config->segment_min_duration * 1000L;
+	if (min_ms > max_ms)
+		min_ms = max_ms;
+	if (elapsed_ms > max_ms)
+		return 1;
+	if (mem_storage->segment_mode == VB_SEGMENT_PAUSE && elapsed_ms >= min_ms
+			&& mem_storage->silence_samples >= mem_storage->config->segment_pause_ms * 8)
+		return 1;
+	return 0;
+}
+
+/* Calls a dialer starts together would close their segments together, one
+ * period after another, and hand the upload workers a burst each time. The
+ * first segment of a staggered call is cut short by an offset taken from the
+ * channel name, so the boundaries of such calls are spread over the period
+ * while every call still gets the same boundaries when it is replayed. The
+ * first segment keeps at least a second of audio. */
+static int get_stagger_ms(const struct mem_storage_t* mem_storage){
+	int range = mem_storage->segment_ms - 1000;
+
+	if (!mem_storage->stagger || range <= 0)
+		return 0;
+	//sequential channel names differ in the low bits of the hash only
+	return (unsigned long long)(hash_string(mem_storage->channel) * 2654435761u) * range >> 32;
+}
+
+static void put_samples(struct mem_storage_t* mem_storage, const short* samples, int num_samples){
+	short resampled[SAMPLES_PER_BLOCK * VB_MAX_SAMPLE_RATE / VB_CAPTURE_RATE + 1];
+	int size;
+
+	if (!keep_frame(mem_storage, samples, num_samples, NULL, 0))
+		return;
+
+	//callers pass at most SAMPLES_PER_BLOCK samples when resampling
+	if (mem_storage->resample){
+		num_samples = vb_resampler_process(&mem_storage->resampler[0], samples, num_samples, resampled);
+		samples = resampled;
+	}
+
+	size = num_samples * 2;//we use 16 bit per sample
+	if (mem_storage->pos + size > mem_storage->buf_size){
+		vb_stats_add(bytes_truncated, mem_storage->pos + size - mem_storage->buf_size);
+		size = mem_storage->buf_size - mem_storage->pos;
+	}
+	if (size < 0)
+		size = 0;
+
+	memcpy(mem_storage->buf + mem_storage->pos, samples, size);
+	mem_storage->pos += size;
+}
+
+int put_data(struct mem_storage_t* mem_storage, const short* samples, int num_samples){
 	if (is_opened(mem_storage)){
-		int size = ast_codec_get_samples(frm) * 2;//we use 16 bit per sample
-		if (mem_storage->pos + size > mem_storage->buf_size)
-			size = mem_storage->buf_size - mem_storage->pos;
-		if (size < 0)
-			size = 0;
+		if (!mem_storage->resample){
+			put_samples(mem_storage, samples, num_samples);
+			return 0;
+		}
+		while (num_samples > 0){
+			int n = num_samples > SAMPLES_PER_BLOCK ? SAMPLES_PER_BLOCK : num_samples;
+			put_samples(mem_storage, samples, n);
+			samples 	+= n;
+			num_samples -= n;
+		}
+	}
+	return 0;
+}
 
-		//ast_log(LOG_NOTICE, "Added frame with ptr=%x, size=%d\n", (int)frm->data.ptr, (int)size);
+int put_data_mixed(struct mem_storage_t* mem_storage, const short* read_buf, int read_samples, const short* write_buf, int write_samples){
+	short mixed[SAMPLES_PER_BLOCK];
 
-		memcpy(mem_storage->buf + mem_storage->pos, frm->data.ptr, size);
-		mem_storage->pos += size;
+	if (is_opened(mem_storage)){
+		int samples 		= read_samples > write_samples ? read_samples : write_samples;
+		int done = 0;
+
+		//same block splitting as put_data_stereo(), a missing leg contributes nothing
+		while (done < samples){
+			int n = samples - done;
+			int left_avail = read_samples - done;
+			int right_avail = write_samples - done;
+			const short* left 	= left_avail > 0 ? read_buf + done : NULL;
+			const short* right 	= right_avail > 0 ? write_buf + done : NULL;
+
+			if (n > SAMPLES_PER_BLOCK)
+				n = SAMPLES_PER_BLOCK;
+			if (left_avail > 0 && left_avail < n)
+				n = left_avail;
+			if (right_avail > 0 && right_avail < n)
+				n = right_avail;
+
+			if (left_avail > 0 && right_avail > 0){
+				vb_mix_s16(mixed, left, right, n);
+				put_samples(mem_storage, mixed, n);
+			}else{
+				put_samples(mem_storage, left_avail > 0 ? left : right, n);
+			}
+			done += n;
+		}
+	}
+	return 0;
+}
+
+int put_data_stereo(struct mem_storage_t* mem_storage, const short* read_buf, int read_samples, const short* write_buf, int write_samples){
+	static const short silence[SAMPLES_PER_BLOCK];
+	short resampled[2][SAMPLES_PER_BLOCK * VB_MAX_SAMPLE_RATE / VB_CAPTURE_RATE + 1];
+
+	if (is_opened(mem_storage)){
+		int samples 		= read_samples > write_samples ? read_samples : write_samples;
+		int done = 0;
+
+		if (!keep_frame(mem_storage, read_buf, read_samples, write_buf, write_samples))
+			return 0;
+
+		//a missing or short leg is padded with silence, so both channels (and resamplers) stay aligned
+		while (done < samples){
+			int n = samples - done;
+			int left_avail = read_samples - done;
+			int right_avail = write_samples - done;
+			const short* left 	= silence;
+			const short* right 	= silence;
+
+			if (n > SAMPLES_PER_BLOCK)
+				n = SAMPLES_PER_BLOCK;
+			if (left_avail > 0 && left_avail < n)
+				n = left_avail;
+			if (right_avail > 0 && right_avail < n)
+				n = right_avail;
+			if (left_avail > 0)
+				left = read_buf + done;
+			if (right_avail > 0)
+				right = write_buf + done;
+			done += n;
+
+			//both legs get the same number of samples, so the resamplers produce equal counts
+			if (mem_storage->resample){
+				vb_resampler_process(&mem_storage->resampler[0], left, n, resampled[0]);
+				n = vb_resampler_process(&mem_storage->resampler[1], right, n, resampled[1]);
+				left 	= resampled[0];
+				right 	= resampled[1];
+			}
+
+			//4 bytes per interleaved sample pair
+			if (mem_storage->pos + n * 4 > mem_storage->buf_size){
+				vb_stats_add(bytes_truncated, mem_storage->pos + n * 4 - mem_storage->buf_size);
+				n = (mem_storage->buf_size - mem_storage->pos) / 4;
+			}
+			if (n <= 0)
+				continue;
+
+			vb_interleave_s16((short*)(mem_storage->buf + mem_storage->pos), left, right, n);
+			mem_storage->pos += n * 4;
+		}
 	}
 	return 0;
 }
 
 int put_silence(struct mem_storage_t* mem_storage, int num_of_silence_samples){
 	if (is_opened(mem_storage)){
-		int size = num_of_silence_samples * 2;//we use 16 bit per sample
+		//the length is given in capture samples
+		int size = (int)((long long)num_of_silence_samples * mem_storage->sample_rate / VB_CAPTURE_RATE) * 2 * mem_storage->num_of_channels;//we use 16 bit per sample
 		if (mem_storage->pos + size > mem_storage->buf_size)
 			size = mem_storage->buf_size - mem_storage->pos;
 		if (size < 0)
@@ -338,12 +1223,32 @@ int open_mem_storage(struct mem_storage_t* mem_storage, const char* session_id,
 
 	strncpy(mem_storage->session_id, get_simple_name(session_id), sizeof(mem_storage->session_id) - 1);
 	mem_storage->session_id[sizeof(mem_storage->session_id) - 1] = 0;
-
-	mem_storage->wav_header_size = mem_storage->pos = write_wav_header(mem_storage->buf, mem_storage->buf_size, 8000, 16, 1);
-	ast_log(LOG_WARNING, "Storage opened. Header size = %d\n, session_id = %s\n", mem_storage->wav_header_size, mem_storage->session_id);
+	snprintf(mem_storage->channel, sizeof(mem_storage->channel), "%s", session_id);
+
+	mem_storage->wav_header_size = mem_storage->pos = write_wav_header(mem_storage->buf, mem_storage->buf_size, mem_storage->sample_rate, 16, mem_storage->num_of_channels);
+	if (mem_storage->timeline && mem_storage->shared_params){
+		char filename[PATH_MAX];
+
+		//a cut name could be another call's file
+		if (snprintf(filename, sizeof(filename), "%s/%s_%s.jsonl", mem_storage->config->trace_dir, mem_storage->session_id, mem_storage->time_string) < sizeof(filename))
+			mem_storage->shared_params->timeline = vb_timeline_open(filename);
+		else
+			vb_log(VB_LOG_WARNING, "Timeline file name of %s is too long, no timeline is written\n", mem_storage->session_id);
+		mem_storage->timeline = 0;
+	}
+	vb_trace(mem_storage->trace_level, VB_TRACE_SEGMENT, "Segment %d of %s opened at %d ms\n", count, mem_storage->session_id, pts);
+	vb_timeline_event(get_timeline(mem_storage), "open", "\"segment\":%d,\"pts\":%d", count, pts);
 	mem_storage->is_opened = 1;
+	vb_stats_add(segments_opened, 1);
+	VB_PROBE2(segment__open, mem_storage->session_id, count);
 	mem_storage->count = count;
 	mem_storage->pts = pts;
+	if (count == 0)
+		mem_storage->stagger_ms = get_stagger_ms(mem_storage);
+	mem_storage->in_samples = 0;
+	mem_storage->out_samples = 0;
+	mem_storage->num_offsets = 0;
+	mem_storage->eliding = 0;
 
 	return 1;
 }
@@ -379,180 +1284,648 @@ void get_ip_string(char* result, int max_size){
 	 freeifaddrs(ifaddr);
 }
 
-int close_mem_storage(struct mem_storage_t* mem_storage, int last){
+/* Renders the offset map as [[segment_ms,call_ms],...] relative to the segment
+ * start, returns NULL when nothing was elided */
+static const char* format_offset_map(const struct vb_offset* offsets, int num_offsets, char* result, int max_size){
+	int i;
+	int len;
+
+	if (num_offsets == 0)
+		return NULL;
+
+	len = snprintf(result, max_size, "[");
+	for (i = 0; i < num_offsets && len < max_size; ++i){
+		len += snprintf(result + len, max_size - len, "%s[%d,%d]", i ? "," : "",
+						offsets[i].out_samples / (VB_CAPTURE_RATE / 1000), offsets[i].in_samples / (VB_CAPTURE_RATE / 1000));
+	}
+	if (len < max_size)
+		snprintf(result + len, max_size - len, "]");
+	return result;
+}
 
-	char full_session_id[4096];
+static void free_segment(struct vb_segment* seg){
+	if (seg->params){
+		__atomic_fetch_sub(&seg->params->uploads_in_flight, 1, __ATOMIC_RELAXED);
+		vb_params_unref(seg->params);
+	}
+	vb_config_unref(seg->config);
+	if (seg->buf){
+		vb_free(seg->buf);
+		vb_stats_add(buffered_bytes, -seg->buf_size);
+	}
+	vb_free(seg);
+}
+
+/* Encode stage: finalises the WAV and renders the form fields that depend on the segment only */
+static void encode_segment(struct vb_segment* seg){
+	wav_header_data_size_fix(seg->buf, seg->size - seg->wav_header_size);
+
+	snprintf(seg->full_session_id, sizeof(seg->full_session_id), "%s_%s_%s", seg->session_id, seg->config->ip_string, seg->time_string);
+	snprintf(seg->start_pts, sizeof(seg->start_pts), "%d.%03d", seg->pts/1000, seg->pts%1000);
+	snprintf(seg->content_name, sizeof(seg->content_name), "%s_%d.wav", seg->full_session_id, seg->count);
+	seg->has_offset_map = format_offset_map(seg->offsets, seg->num_offsets, seg->offset_map, sizeof(seg->offset_map)) != NULL;
+}
+
+/* Upload stage: posts the encoded segment */
+static void upload_segment(struct vb_segment* seg){
 	char str_segment_number[1024];
 	char sending_status[1024];
-	char content_name[1024];
-	char start_pts[1024];
-	CURLcode res;
-	char*	title = NULL;
-	char*	desc = NULL;
-	char* 	lang = NULL;
-	char* 	sourceUrl = NULL;
-	char* 	recordedDate = NULL;
-	char*	externalId = NULL;
-	char*	ownerId = NULL;
-	char*	autoCreate = NULL;
-	char* 	humanRush = NULL;
-	char*	transcriptType = NULL;
-	char*	rtCallbackUrl = NULL;
-	char* 	callId = NULL;
-	char*	apikey = NULL;
-	char*	pw = NULL;
-	char* 	pub = NULL;
-
-
-	wav_header_data_size_fix(mem_storage->buf, mem_storage->pos - mem_storage->wav_header_size);
-
-	snprintf(full_session_id, sizeof(full_session_id), "%s_%s_%s", mem_storage->session_id, vb_ip_string, mem_storage->time_string);
-	snprintf(start_pts, sizeof(start_pts), "%d.%d", (int)mem_storage->pts/1000, (int)mem_storage->pts%1000);
-
-	snprintf(content_name, sizeof(content_name), "%s_%d.wav", full_session_id, mem_storage->count);
-	snprintf(str_segment_number, sizeof(str_segment_number), "%d", mem_storage->count);
-
-	ast_log(LOG_WARNING, "trying to send storage data to voicebase %s\n", full_session_id);
-
-	ast_log(LOG_WARNING, " api_key = %s\n password = %s\n full_session_id = %s\n segment_number = %s\n content name = %s\n public = %s\n title = %s\n",
-			    vb_api_key, vb_password, full_session_id, str_segment_number, content_name, vb_public, vb_title);
-
-	apikey			= get_safe_object_strings(mem_storage->params, "apikey", 			vb_api_key);
-	pw				= get_safe_object_strings(mem_storage->params, "pw", 				vb_password);
-	title			= get_safe_object_strings(mem_storage->params, "title", 			vb_title);
-	callId			= get_safe_object_strings(mem_storage->params, "callId", 			full_session_id);
-	pub				= get_safe_object_strings(mem_storage->params, "public", 			vb_public);
-	rtCallbackUrl	= get_safe_object_strings(mem_storage->params, "rtCallbackUrl",	 	vb_callback_url);
-
-	desc			= get_safe_object_strings(mem_storage->params, "desc", 				NULL);
-	lang			= get_safe_object_strings(mem_storage->params, "lang", 				NULL);
-	sourceUrl		= get_safe_object_strings(mem_storage->params, "sourceUrl", 		NULL);
-	recordedDate	= get_safe_object_strings(mem_storage->params, "recordedDate", 		NULL);
-	externalId		= get_safe_object_strings(mem_storage->params, "externalId", 		NULL);
-	ownerId			= get_safe_object_strings(mem_storage->params, "ownerId", 			NULL);
-	autoCreate		= get_safe_object_strings(mem_storage->params, "autoCreate", 		NULL);
-	humanRush		= get_safe_object_strings(mem_storage->params, "humanRush", 		NULL);
-	transcriptType	= get_safe_object_strings(mem_storage->params, "transcriptType", 	"machine");
-
-	ast_log(LOG_NOTICE, "Filling request properties finished\n");
-
-	res = curl_post_segment(	"1.1",
-								apikey,
-								pw,
-								"uploadMedia",
-								callId,
-								str_segment_number,
-								last ? "true" : "false",
-								rtCallbackUrl,
-								content_name,
-								mem_storage->buf,
-								mem_storage->pos,
-								pub,
-								title,
-								start_pts,
-								desc,
-								lang,
-								sourceUrl,
-								recordedDate,
-								externalId,
-								ownerId,
-								autoCreate,
-								humanRush,
-								transcriptType,
-								sending_status,
-								sizeof(sending_status));
-//	if (res != CURLE_OK){
-		ast_log(LOG_WARNING, "Sent data with session id %s to %s, returned status = %s, curl result=%d\n", full_session_id, vb_api_url, sending_status, (int)res);
-//	}
-	/*
-	f = fopen(full_filename, "w");
-	if (f){
-		fwrite(mem_storage->buf, 1, mem_storage->pos, f);
-		fclose(f);
+	struct vb_upload_form form;
+	int res;
+	long http_status;
+	long long start;
+	long long end;
+
+	snprintf(str_segment_number, sizeof(str_segment_number), "%d", seg->count);
+
+	if (seg->params){
+		form = seg->params->form;
+	}else{
+		resolve_upload_form(&form, NULL, seg->profile);
+		form.callID = seg->full_session_id;
+	}
+
+	VB_PROBE3(upload__start, seg->full_session_id, seg->count, seg->size);
+	start = vb_now_us();
+
+	form.tmpl 			= seg->tmpl;
+	form.segmentNumber 	= str_segment_number;
+	form.finalSegment 	= seg->last ? "true" : "false";
+	form.content_name 	= seg->content_name;
+	form.content_buff 	= seg->buf;
+	form.content_size 	= seg->size;
+	form.time_str 		= seg->start_pts;
+	form.offsetMap 		= seg->has_offset_map ? seg->offset_map : NULL;
+
+	//the password never goes to the log
+	vb_trace(seg->trace_level, VB_TRACE_DEBUG, "Uploading %s to %s: apikey=%s password=%s callID=%s startTime=%s segmentNumber=%s finalSegment=%s "
+			"rtCallbackUrl=%s transcriptType=%s public=%s title=%s lang=%s externalId=%s ownerId=%s offsetMap=%s\n",
+			form.content_name, form.url, form.apikey, (form.password && *form.password) ? "***" : "", form.callID, form.time_str,
+			form.segmentNumber, form.finalSegment, form.rtCallbackURL, form.transcriptType, form.pub, form.title,
+			form.lang ? form.lang : "", form.externalId ? form.externalId : "", form.ownerId ? form.ownerId : "",
+			form.offsetMap ? form.offsetMap : "");
+
+	res = vb_transport(&form, sending_status, sizeof(sending_status), &http_status);
+	end = vb_now_us();
+	VB_PROBE6(upload__done, seg->full_session_id, seg->count, seg->size, (int)res, http_status, end - start);
+	vb_histogram_record(&vb_hist_upload_latency, end - seg->closed);
+	if (vb_event_handler){
+		struct vb_event event = { VB_EVENT_SEGMENT_UPLOADED };
+
+		event.channel 		= seg->channel;
+		event.call_id 		= form.callID;
+		event.segment 		= seg->count;
+		event.last 			= seg->last;
+		event.bytes 		= seg->size;
+		event.queue_wait_us = start - seg->closed;
+		event.upload_us 	= end - start;
+		event.curl_result 	= res;
+		event.http_status 	= http_status;
+		if (res != CURLE_OK || http_status >= 400)
+			event.type = VB_EVENT_SEGMENT_FAILED;
+		vb_event_handler(&event);
+	}
+	vb_timeline_event(seg->params ? seg->params->timeline : NULL, "upload", "\"segment\":%d,\"bytes\":%d,\"curl\":%d,\"http\":%ld,\"upload_us\":%lld,\"latency_us\":%lld",
+			seg->count, seg->size, res, http_status, end - start, end - seg->closed);
+	if (res == CURLE_OK && http_status < 400){
+		vb_stats_add(segments_uploaded, 1);
+		vb_stats_add(bytes_uploaded, seg->size);
+		if (seg->params)
+			__atomic_fetch_add(&seg->params->bytes_uploaded, seg->size, __ATOMIC_RELAXED);
+		vb_trace(seg->trace_level, VB_TRACE_SEGMENT, "Segment %d of %s uploaded in %lld ms: HTTP %ld %s\n",
+				seg->count, seg->full_session_id, (end - start) / 1000, http_status, sending_status);
+	}else{
+		vb_stats_add(segments_failed, 1);
+		vb_log_limited(&upload_fail_limit, FAIL_LOG_INTERVAL_MS, VB_LOG_WARNING, "Upload of segment %d of %s to %s failed: curl %d, HTTP %ld %s\n",
+				seg->count, seg->full_session_id, form.url, res, http_status, sending_status);
+	}
+	vb_trace_summary_tick(seg->config->trace_summary_interval);
+}
+
+static void encode_stage_process(struct vb_job* job){
+	struct vb_segment* seg = (struct vb_segment*)job;
+
+	encode_segment(seg);
+	if (upload_stage){
+		vb_stage_submit(upload_stage, job);
+	}else{
+		upload_segment(seg);
+		free_segment(seg);
+	}
+}
+
+static void upload_stage_process(struct vb_job* job){
+	struct vb_segment* seg = (struct vb_segment*)job;
+
+	upload_segment(seg);
+	free_segment(seg);
+}
+
+/* Hands a closed segment to the pipeline. Segments of one call share a route,
+ * so they are encoded and uploaded in order. Uploads are queued per API key. */
+static void submit_segment(struct vb_segment* seg){
+	seg->job.route 	= hash_string(seg->session_id);
+	seg->job.tenant = seg->params ? seg->params->form.apikey : seg->profile->api_key;
+	seg->job.cost 	= seg->size;
+	//an API key with its share of uploads waiting holds back its own calls, not the encode workers
+	if (upload_stage)
+		vb_stage_admit(upload_stage, &seg->job);
+	if (encode_stage){
+		vb_stage_submit(encode_stage, &seg->job);
 	}else{
-	    ast_log(LOG_WARNING, "Failed to do data dump to %s\n", full_filename);
-	}*/
+		encode_stage_process(&seg->job);
+	}
+}
+
+/* A segment dropped before it reached the pipeline fails like an upload would */
+static void report_dropped_segment(struct mem_storage_t* mem_storage, int count, int last, int bytes){
+	vb_stats_add(segments_failed, 1);
+	if (vb_event_handler){
+		struct vb_event event = { VB_EVENT_SEGMENT_FAILED };
+		char call_id[4096];
+
+		event.channel 		= mem_storage->channel;
+		event.call_id 		= get_call_id(mem_storage->config, mem_storage->params, mem_storage->session_id, mem_storage->time_string, call_id, sizeof(call_id));
+		event.segment 		= count;
+		event.last 			= last;
+		event.bytes 		= bytes;
+		event.curl_result 	= CURLE_OUT_OF_MEMORY;
+		vb_event_handler(&event);
+	}
+}
+
+int close_mem_storage_deferred(struct mem_storage_t* mem_storage, int last){
+	struct vb_segment* seg;
+	struct vb_segment** tail;
+
 	mem_storage->is_opened = 0;
+	vb_stats_add(segments_closed, 1);
+	VB_PROBE4(segment__close, mem_storage->session_id, mem_storage->count, mem_storage->pos, last);
+
+	if (!(seg = vb_calloc(1, sizeof(*seg)))){
+		vb_log(VB_LOG_ERROR, "Can't allocate segment %d of %s, dropping it\n", mem_storage->count, mem_storage->session_id);
+		report_dropped_segment(mem_storage, mem_storage->count, last, mem_storage->pos);
+		return 0;
+	}
+	seg->closed 			= vb_now_us();
+	seg->buf 				= mem_storage->buf;
+	seg->buf_size 			= mem_storage->buf_size;
+	seg->size 				= mem_storage->pos;
+	seg->wav_header_size 	= mem_storage->wav_header_size;
+	seg->count 				= mem_storage->count;
+	seg->last 				= last;
+	seg->pts 				= mem_storage->pts;
+	seg->trace_level 		= mem_storage->trace_level;
+	seg->config 			= mem_storage->config;
+	seg->profile 			= mem_storage->profile;
+	vb_config_ref(seg->config);
+	seg->num_offsets 		= mem_storage->num_offsets;
+	memcpy(seg->offsets, mem_storage->offsets, mem_storage->num_offsets * sizeof(struct vb_offset));
+	snprintf(seg->session_id, sizeof(seg->session_id), "%s", mem_storage->session_id);
+	snprintf(seg->channel, sizeof(seg->channel), "%s", mem_storage->channel);
+	snprintf(seg->time_string, sizeof(seg->time_string), "%s", mem_storage->time_string);
+	if ((seg->params = mem_storage->shared_params)){
+		struct vb_params* params = seg->params;
+
+		//the upload workers only read the form and the template once the segment is submitted
+		if (!params->form.callID)
+			params->form.callID = get_call_id(mem_storage->config, params->json, seg->session_id, seg->time_string, params->call_id, sizeof(params->call_id));
+		if (!params->tmpl)
+			params->tmpl = vb_form_template_create(&params->form);
+		seg->tmpl = params->tmpl;
+		vb_params_ref(params);
+		__atomic_fetch_add(&params->uploads_in_flight, 1, __ATOMIC_RELAXED);
+	}
+	vb_trace(seg->trace_level, VB_TRACE_SEGMENT, "Segment %d of %s closed: %d bytes%s, %d elided stretch(es)\n",
+			seg->count, seg->session_id, seg->size, last ? ", last" : "", seg->num_offsets);
+	vb_timeline_event(get_timeline(mem_storage), "close", "\"segment\":%d,\"bytes\":%d,\"last\":%s,\"elided\":%d",
+			seg->count, seg->size, last ? "true" : "false", seg->num_offsets);
+	vb_trace_summary_tick(mem_storage->config->trace_summary_interval);
+	if (vb_event_handler){
+		struct vb_event event = { VB_EVENT_SEGMENT_CLOSED };
+		char call_id[4096];
+
+		event.channel 	= seg->channel;
+		event.call_id 	= get_call_id(mem_storage->config, mem_storage->params, seg->session_id, seg->time_string, call_id, sizeof(call_id));
+		event.segment 	= seg->count;
+		event.last 		= seg->last;
+		event.bytes 	= seg->size;
+		vb_event_handler(&event);
+	}
+
+	//the segment takes the buffer, capture continues into a fresh one
+	if (last){
+		mem_storage->buf 		= NULL;
+		mem_storage->buf_size 	= 0;
+	}else{
+		int segment_ms = mem_storage->segment_ms;
+
+		//the next segment may be of another length, its buffer is sized for it
+		latch_segment_length(mem_storage);
+		mem_storage->buf_size = get_segment_buf_size(mem_storage);
+		if (!(mem_storage->buf = vb_malloc(mem_storage->buf_size))){
+			//out of memory: capture keeps the buffer and its length, an upload from this thread would stall it
+			vb_log(VB_LOG_ERROR, "Can't allocate a buffer for segment %d of %s, dropping segment %d\n", seg->count + 1, seg->session_id, seg->count);
+			report_dropped_segment(mem_storage, seg->count, seg->last, seg->size);
+			mem_storage->buf 		= seg->buf;
+			mem_storage->buf_size 	= seg->buf_size;
+			mem_storage->segment_ms = segment_ms;
+			seg->buf = NULL;
+			free_segment(seg);
+			return 1;
+		}
+		vb_stats_add(buffered_bytes, mem_storage->buf_size);
+	}
+
+	//keeps the order of the segments, the pipeline relies on it
+	for (tail = &mem_storage->closed; *tail; tail = &(*tail)->next_closed)
+		;
+	*tail = seg;
 	return 1;
 }
 
+void submit_closed_segments(struct mem_storage_t* mem_storage){
+	struct vb_segment* seg;
+
+	while ((seg = mem_storage->closed)){
+		mem_storage->closed = seg->next_closed;
+		submit_segment(seg);
+	}
+}
+
+int close_mem_storage(struct mem_storage_t* mem_storage, int last){
+	int res = close_mem_storage_deferred(mem_storage, last);
+
+	submit_closed_segments(mem_storage);
+	return res;
+}
+
+void get_upload_stats(struct mem_storage_t* mem_storage, int* uploads_in_flight, long long* bytes_uploaded){
+	*uploads_in_flight 	= 0;
+	*bytes_uploaded 	= 0;
+	if (mem_storage->shared_params){
+		*uploads_in_flight 	= __atomic_load_n(&mem_storage->shared_params->uploads_in_flight, __ATOMIC_RELAXED);
+		*bytes_uploaded 	= __atomic_load_n(&mem_storage->shared_params->bytes_uploaded, __ATOMIC_RELAXED);
+	}
+}
+
+int vb_pipeline_start(){
+	struct vb_config* config = vb_config_acquire();
+	struct vb_fair_limits limits;
+
+	vb_trace_start();
+	if (!(upload_stage = vb_fair_stage_create("upload", config->upload_workers, config->pipeline_queue_limit, get_upload_limits(config, &limits),
+			upload_stage_process, &vb_hist_upload_queue_wait)))
+		vb_log(VB_LOG_WARNING, "Failed to start the upload workers, segments will be uploaded by the encode workers\n");
+	if (!(encode_stage = vb_stage_create("encode", config->encode_workers, config->pipeline_queue_limit, encode_stage_process, &vb_hist_encode_queue_wait)))
+		vb_log(VB_LOG_WARNING, "Failed to start the encode workers, segments will be processed by the capture threads\n");
+	vb_config_unref(config);
+	return 0;
+}
+
+void vb_pipeline_stop(){
+	struct vb_stage* stage;
+
+	//the encode stage drains into the upload stage, so it goes first
+	stage = encode_stage;
+	encode_stage = NULL;
+	vb_stage_destroy(stage);
+
+	stage = upload_stage;
+	upload_stage = NULL;
+	vb_stage_destroy(stage);
+
+	vb_trace_stop();
+}
+
+void vb_pipeline_get_stats(struct vb_stage_stats* encode, struct vb_stage_stats* upload){
+	vb_stage_get_stats(encode_stage, encode);
+	vb_stage_get_stats(upload_stage, upload);
+}
+
+int vb_pipeline_get_tenants(struct vb_tenant_stats* tenants, int max){
+	return vb_stage_get_tenants(upload_stage, tenants, max);
+}
+
+void init_vb_profile(struct vb_profile* profile, const char* name){
+	init_profile(profile, name, &vb_config_draft);
+}
+
+int add_vb_profile(const struct vb_profile* profile){
+	unsigned int bucket = hash_string(profile->name) % VB_PROFILE_BUCKETS;
+	struct vb_profile* copy;
+
+	if (find_profile(&vb_config_draft, profile->name)){
+		vb_log(VB_LOG_WARNING, "Duplicate profile %s\n", profile->name);
+		return -1;
+	}
+	if (!(copy = vb_malloc(sizeof(*copy))))
+		return -1;
+	memcpy(copy, profile, sizeof(*copy));
+	copy->next = vb_config_draft.profiles[bucket];
+	vb_config_draft.profiles[bucket] = copy;
+	++vb_config_draft.num_profiles;
+	return 0;
+}
+
+/* The getters read the current snapshot, the setters write the draft */
+static int config_get_int(size_t offset){
+	struct vb_config* config = vb_config_acquire();
+	int value;
+
+	memcpy(&value, (const char*)config + offset, sizeof(value));
+	vb_config_unref(config);
+	return value;
+}
+
+static char* config_get_string(size_t offset, char* result, int max_size){
+	struct vb_config* config = vb_config_acquire();
+
+	snprintf(result, max_size, "%s", (const char*)config + offset);
+	vb_config_unref(config);
+	return result;
+}
+
 void set_vb_api_key(const char* key){
 	if (key)
-		strncpy(vb_api_key, key, sizeof(vb_api_key));
+		strncpy(vb_config_draft.api_key, key, sizeof(vb_config_draft.api_key));
 	else
-		vb_api_key[0] = 0;
+		vb_config_draft.api_key[0] = 0;
 }
-char* get_vb_api_key(){
-	return vb_api_key;
+char* get_vb_api_key(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, api_key), result, max_size);
 }
 
 void set_vb_password(const char* pass){
 	if (pass)
-		strncpy(vb_password, pass, sizeof(vb_password));
+		strncpy(vb_config_draft.password, pass, sizeof(vb_config_draft.password));
 	else
-		vb_password[0] = 0;
+		vb_config_draft.password[0] = 0;
 }
-char* get_vb_password(){
-	return vb_password;
+char* get_vb_password(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, password), result, max_size);
 }
 
 void set_vb_public(const char* pub){
 	if (pub)
-		strncpy(vb_public, pub, sizeof(vb_public));
+		strncpy(vb_config_draft.pub, pub, sizeof(vb_config_draft.pub));
 	else
-		vb_public[0] = 0;
+		vb_config_draft.pub[0] = 0;
 }
 
-char* get_vb_public(){
-	return vb_public;
+char* get_vb_public(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, pub), result, max_size);
 }
 
 void set_vb_callback_url(const char* url){
 	if (url)
-		strncpy(vb_callback_url, url, sizeof(vb_callback_url));
+		strncpy(vb_config_draft.callback_url, url, sizeof(vb_config_draft.callback_url));
 	else
-		vb_callback_url[0] = 0;
+		vb_config_draft.callback_url[0] = 0;
 }
 
-char* get_vb_callback_url(){
-	return vb_callback_url;
+char* get_vb_callback_url(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, callback_url), result, max_size);
 }
 
 void set_vb_api_url(const char* api_url){
 	if (api_url)
-		strncpy(vb_api_url, api_url, sizeof(vb_api_url));
+		strncpy(vb_config_draft.api_url, api_url, sizeof(vb_config_draft.api_url));
 	else
-		vb_api_url[0] = 0;
+		vb_config_draft.api_url[0] = 0;
 }
-char* get_vb_api_url(){
-	return vb_api_url;
+char* get_vb_api_url(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, api_url), result, max_size);
 }
 
 void set_vb_title(const char* title){
 	if (title)
-		strncpy(vb_title, title, sizeof(vb_title));
+		strncpy(vb_config_draft.title, title, sizeof(vb_config_draft.title));
 	else
-		vb_title[0] = 0;
+		vb_config_draft.title[0] = 0;
 }
 
-char* get_vb_title(){
-	return vb_title;
+char* get_vb_title(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, title), result, max_size);
 }
 
 void set_vb_segment_duration(int duration){
-	vb_segment_duration = duration;
+	vb_config_draft.segment_duration = duration;
 }
 
 int get_vb_segment_duration(){
-	return vb_segment_duration;
+	return config_get_int(offsetof(struct vb_config, segment_duration));
+}
+
+void set_vb_stereo(int stereo){
+	vb_config_draft.stereo = stereo;
+}
+
+int get_vb_stereo(){
+	return config_get_int(offsetof(struct vb_config, stereo));
+}
+
+int parse_segment_mode(const char* value){
+	if (value && !strcasecmp(value, "pause"))
+		return VB_SEGMENT_PAUSE;
+	return VB_SEGMENT_FIXED;
+}
+
+void set_vb_segment_mode(int mode){
+	vb_config_draft.segment_mode = mode;
+}
+
+int get_vb_segment_mode(){
+	return config_get_int(offsetof(struct vb_config, segment_mode));
+}
+
+void set_vb_segment_min_duration(int duration){
+	vb_config_draft.segment_min_duration = duration;
+}
+
+int get_vb_segment_min_duration(){
+	return config_get_int(offsetof(struct vb_config, segment_min_duration));
+}
+
+void set_vb_segment_stagger(int enabled){
+	vb_config_draft.segment_stagger = enabled;
+}
+
+int get_vb_segment_stagger(){
+	return config_get_int(offsetof(struct vb_config, segment_stagger));
+}
+
+void set_vb_segment_adaptive(int enabled){
+	vb_config_draft.segment_adaptive = enabled;
+}
+
+int get_vb_segment_adaptive(){
+	return config_get_int(offsetof(struct vb_config, segment_adaptive));
+}
+
+void set_vb_segment_adaptive_min(int duration){
+	vb_config_draft.segment_adaptive_min = duration;
+}
+
+int get_vb_segment_adaptive_min(){
+	return config_get_int(offsetof(struct vb_config, segment_adaptive_min));
+}
+
+void set_vb_segment_adaptive_max(int duration){
+	vb_config_draft.segment_adaptive_max = duration;
+}
+
+int get_vb_segment_adaptive_max(){
+	return config_get_int(offsetof(struct vb_config, segment_adaptive_max));
+}
+
+void set_vb_segment_pause_ms(int ms){
+	vb_config_draft.segment_pause_ms = ms;
+}
+
+int get_vb_segment_pause_ms(){
+	return config_get_int(offsetof(struct vb_config, segment_pause_ms));
+}
+
+int parse_silence_elision(const char* value){
+	if (!value)
+		return VB_ELISION_OFF;
+	if (!strcasecmp(value, "compress"))
+		return VB_ELISION_COMPRESS;
+	if (!strcasecmp(value, "drop"))
+		return VB_ELISION_DROP;
+	return VB_ELISION_OFF;
+}
+
+void set_vb_silence_elision(int mode){
+	vb_config_draft.silence_elision = mode;
+}
+
+int get_vb_silence_elision(){
+	return config_get_int(offsetof(struct vb_config, silence_elision));
+}
+
+void set_vb_silence_keep_ms(int ms){
+	vb_config_draft.silence_keep_ms = ms;
+}
+
+int get_vb_silence_keep_ms(){
+	return config_get_int(offsetof(struct vb_config, silence_keep_ms));
+}
+
+void set_vb_vad_threshold(int dbfs){
+	vb_config_draft.vad_threshold = dbfs;
+}
+
+int get_vb_vad_threshold(){
+	return config_get_int(offsetof(struct vb_config, vad_threshold));
+}
+
+void set_vb_hold_detection(int enabled){
+	vb_config_draft.hold_detection = enabled;
+}
+
+int get_vb_hold_detection(){
+	return config_get_int(offsetof(struct vb_config, hold_detection));
+}
+
+void set_vb_hold_detect_ms(int ms){
+	vb_config_draft.hold_detect_ms = ms;
+}
+
+int get_vb_hold_detect_ms(){
+	return config_get_int(offsetof(struct vb_config, hold_detect_ms));
+}
+
+void set_vb_encode_workers(int workers){
+	vb_config_draft.encode_workers = workers;
+}
+
+int get_vb_encode_workers(){
+	return config_get_int(offsetof(struct vb_config, encode_workers));
+}
+
+void set_vb_upload_workers(int workers){
+	vb_config_draft.upload_workers = workers;
+}
+
+int get_vb_upload_workers(){
+	return config_get_int(offsetof(struct vb_config, upload_workers));
+}
+
+void set_vb_pipeline_queue_limit(int limit){
+	vb_config_draft.pipeline_queue_limit = limit;
+}
+
+int get_vb_pipeline_queue_limit(){
+	return config_get_int(offsetof(struct vb_config, pipeline_queue_limit));
+}
+
+void set_vb_upload_max_per_key(int uploads){
+	vb_config_draft.upload_max_per_key = uploads;
+}
+
+int get_vb_upload_max_per_key(){
+	return config_get_int(offsetof(struct vb_config, upload_max_per_key));
+}
+
+void set_vb_upload_max_bytes_per_key(int bytes){
+	vb_config_draft.upload_max_bytes_per_key = bytes;
+}
+
+int get_vb_upload_max_bytes_per_key(){
+	return config_get_int(offsetof(struct vb_config, upload_max_bytes_per_key));
+}
+
+void set_vb_sample_rate(int rate){
+	vb_config_draft.sample_rate = rate;
+}
+
+int get_vb_sample_rate(){
+	return config_get_int(offsetof(struct vb_config, sample_rate));
+}
+
+void set_vb_trace_level(int level){
+	vb_config_draft.trace_level = level;
+}
+
+int get_vb_trace_level(){
+	return config_get_int(offsetof(struct vb_config, trace_level));
+}
+
+void set_vb_trace_summary_interval(int seconds){
+	vb_config_draft.trace_summary_interval = seconds;
+}
+
+int get_vb_trace_summary_interval(){
+	return config_get_int(offsetof(struct vb_config, trace_summary_interval));
+}
+
+void set_vb_trace_timeline(int enabled){
+	vb_config_draft.trace_timeline = enabled;
+}
+
+int get_vb_trace_timeline(){
+	return config_get_int(offsetof(struct vb_config, trace_timeline));
+}
+
+void set_vb_trace_dir(const char* dir){
+	if (dir)
+		snprintf(vb_config_draft.trace_dir, sizeof(vb_config_draft.trace_dir), "%s", dir);
+	else
+		vb_config_draft.trace_dir[0] = 0;
+}
+
+char* get_vb_trace_dir(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, trace_dir), result, max_size);
 }
 
 void set_vb_ip_string(const char* ip_string){
 	if (ip_string)
-		strncpy(vb_ip_string, ip_string, sizeof(vb_ip_string));
+		strncpy(vb_config_draft.ip_string, ip_string, sizeof(vb_config_draft.ip_string));
 	else
-		vb_ip_string[0] = 0;
+		vb_config_draft.ip_string[0] = 0;
 }
-char* get_vb_ip_string(){
-	return vb_ip_string;
+char* get_vb_ip_string(char* result, int max_size){
+	return config_get_string(offsetof(struct vb_config, ip_string), result, max_size);
 }
@@ -1,3 +1,44 @@
+#include "vb_dsp.h"
+#include "vb_pipeline.h"
+#include "vb_trace.h"
+
+#define VB_ELISION_OFF 		0
+#define VB_ELISION_COMPRESS	1	//keep silence_keep_ms of every long pause
+#define VB_ELISION_DROP		2	//keep only the VAD hangover of every long pause
+
+#define VB_MAX_OFFSETS		256
+
+#define VB_CAPTURE_RATE		8000	//audiohooks deliver 8 kHz signed linear
+#define VB_MIN_SAMPLE_RATE	8000
+#define VB_MAX_SAMPLE_RATE	48000
+
+#define VB_SEGMENT_FIXED	0	//segments are cut every segment_length seconds
+#define VB_SEGMENT_PAUSE	1	//segments are cut at the first pause after segment_min_length
+
+struct vb_offset{
+	int 	out_samples;	//position in the uploaded segment
+	int 	in_samples;		//position in the captured audio
+};
+
+struct vb_params;
+struct vb_config;
+struct vb_segment;
+
+/* Upload settings of a profile section of vbmixmonitor.conf. A call selects
+ * one by name, its params JSON still overrides every field. */
+struct vb_profile{
+	char	name[64];
+	char	api_key[1024];
+	char	password[1024];
+	char	pub[1024];
+	char	callback_url[2048];
+	char	api_url[1024];
+	char	title[1024];
+	char	transcript_type[64];
+	char	lang[64];
+	struct vb_profile*	next;		//hash chain of the configuration
+};
+
 struct mem_storage_t{
 	char* 	buf;
 	int 	buf_size;
@@ -6,46 +47,278 @@ struct mem_storage_t{
 	int 	is_opened;
 	int 	wav_header_size;
 	char 	session_id[2048];
+	char 	channel[256];		//full name of the monitored channel
 	char 	time_string[1024];
 	int		pts;
+	int		num_of_channels;	//1 - mixed mono, 2 - read/write legs interleaved
+
+	int		segment_mode;
+	int		silence_elision;
+	int		silence_keep_samples;
+	int		silence_samples;	//length of the current pause
+	int		stagger;			//the first segment boundary is moved by stagger_ms
+	int		stagger_ms;
+	int		segment_ms;			//length of the current segment, fixed when its buffer is allocated
+	int		eliding;			//pause or hold frames are being dropped
+	int		in_samples;			//captured samples since the segment was opened
+	int		out_samples;		//stored samples since the segment was opened
+	struct vb_vad vad[2];
+	int		hold_detection;
+	struct vb_tone_detector tone[2];
+	int		num_offsets;
+	struct vb_offset offsets[VB_MAX_OFFSETS];	//where the uploaded audio skips captured audio, in capture samples
+
+	int		sample_rate;		//rate of the uploaded audio
+	int		resample;			//sample_rate differs from VB_CAPTURE_RATE
+	struct vb_resampler resampler[2];
+
+	int		trace_level;
+	int		timeline;			//a timeline file is opened with the first segment
+
 	struct cJSON* params;
+	struct vb_params* shared_params;	//refcounted owner of params
+	struct vb_config* config;			//settings snapshot the call started with
+	struct vb_profile* profile;			//the general settings when no profile was selected
+	struct vb_segment* closed;			//closed segments not handed to the pipeline yet
 };
 
+/* command_line is the params JSON object or the name of a profile */
 int create_mem_storage(struct mem_storage_t* mem_storage, const char* command_line);
 int destroy_mem_storage(struct mem_storage_t* mem_storage);
 int is_opened(struct mem_storage_t* mem_storage);
-int put_data(struct mem_storage_t* mem_storage, struct ast_frame* frm);
+/* Captured 8 kHz signed linear samples. A missing leg is passed as NULL, 0 */
+int put_data(struct mem_storage_t* mem_storage, const short* samples, int num_samples);
+int put_data_stereo(struct mem_storage_t* mem_storage, const short* read_buf, int read_samples, const short* write_buf, int write_samples);
+int put_data_mixed(struct mem_storage_t* mem_storage, const short* read_buf, int read_samples, const short* write_buf, int write_samples);
 int put_silence(struct mem_storage_t* mem_storage, int num_of_silence_samples);
 int open_mem_storage(struct mem_storage_t* mem_storage, const char* session_id, int count, int pts);
+/* Closes the segment and keeps it in the storage, so a caller holding locks
+ * can hand it to the pipeline with submit_closed_segments() once they are released */
+int close_mem_storage_deferred(struct mem_storage_t* mem_storage, int last);
+/* May block while the pipeline queues are full */
+void submit_closed_segments(struct mem_storage_t* mem_storage);
+/* close_mem_storage_deferred() and submit_closed_segments() */
 int close_mem_storage(struct mem_storage_t* mem_storage, int last);
+int segment_should_close(struct mem_storage_t* mem_storage, long int elapsed_ms);
+/* closed segments of the call still in the pipeline and bytes of it uploaded so far */
+void get_upload_stats(struct mem_storage_t* mem_storage, int* uploads_in_flight, long long* bytes_uploaded);
+
+/* Encode and upload worker pools, closed segments are handed to them by submit_closed_segments() */
+int vb_pipeline_start();
+void vb_pipeline_stop();
+void vb_pipeline_get_stats(struct vb_stage_stats* encode, struct vb_stage_stats* upload);
+/* the API keys with uploads queued or running, see vb_stage_get_tenants() */
+int vb_pipeline_get_tenants(struct vb_tenant_stats* tenants, int max);
+
+#define VB_EVENT_SEGMENT_CLOSED		1
+#define VB_EVENT_SEGMENT_UPLOADED	2
+#define VB_EVENT_SEGMENT_FAILED		3
+#define VB_EVENT_MONITOR_STOPPED	4
+
+/* Segment lifecycle notification, the strings are valid during the handler call only */
+struct vb_event{
+	int			type;
+	const char*	channel;
+	const char*	call_id;		//the callID of the uploads
+	int			segment;		//number of segments for VB_EVENT_MONITOR_STOPPED
+	int			last;
+	long long	bytes;			//segment size, bytes uploaded so far for VB_EVENT_MONITOR_STOPPED
+	int			uploads_in_flight;	//VB_EVENT_MONITOR_STOPPED only
+	long long	queue_wait_us;	//segment close to upload start
+	long long	upload_us;
+	int			curl_result;
+	long		http_status;
+};
+
+typedef void (*vb_event_fn)(const struct vb_event* event);
+
+/* The handler runs on the capture and upload threads and must not block, NULL disables events */
+void set_vb_event_handler(vb_event_fn handler);
+
+/* Form fields of one segment upload, NULL fields are not sent */
+struct vb_upload_form{
+	const char*	url;			//where the form is posted, not a field
+	const char*	version;
+	const char*	apikey;
+	const char*	password;
+	const char*	action;
+	const char*	callID;
+	const char*	segmentNumber;
+	const char*	finalSegment;
+	const char*	rtCallbackURL;
+	const char*	content_name;
+	const char*	content_buff;	//the WAV file
+	long		content_size;
+	const char*	pub;
+	const char*	title;
+	const char*	time_str;
+	const char*	desc;
+	const char*	lang;
+	const char*	sourceUrl;
+	const char*	recordedDate;
+	const char*	externalId;
+	const char*	ownerId;
+	const char*	autoCreate;
+	const char*	humanRush;
+	const char*	transcriptType;
+	const char*	offsetMap;
+	const struct vb_form_template* tmpl;	//the fields of the call already rendered, NULL to render them per upload
+};
+
+/* The multipart body of an upload. Most fields are the same for every segment
+ * of a call, they are rendered once into a template; an upload adds
+ * startTime, segmentNumber, finalSegment, offsetMap and the WAV file. */
+struct vb_form_template;
+
+/* From the fields of form that don't change between segments (version,
+ * apikey, password, action, callID, rtCallbackURL, transcriptType and the
+ * optional ones but offsetMap). NULL when out of memory. */
+struct vb_form_template* vb_form_template_create(const struct vb_upload_form* form);
+void vb_form_template_free(struct vb_form_template* tmpl);
+
+#define VB_UPLOAD_BODY_PARTS	4
+#define VB_CONTENT_NAME_MAX		(4096 + 16)		//<session id>_<segment>.wav, the session id being up to 4095 bytes
+
+/* The body of one upload, in parts: the template, the fields of the segment,
+ * the WAV file and the closing boundary. Only the fields of the segment are
+ * copied, the other parts point into the template and the form. */
+struct vb_upload_body{
+	const char*	parts[VB_UPLOAD_BODY_PARTS];
+	long		sizes[VB_UPLOAD_BODY_PARTS];
+	long		size;				//Content-Length
+	const char*	content_type;		//with the boundary
+	char		fields[VB_MAX_OFFSETS * 24 + 2048 + 3 * VB_CONTENT_NAME_MAX];	//the file name may be percent-encoded
+};
+
+/* Returns 0 on success, -1 when the fields of the segment don't fit */
+int vb_upload_body_init(struct vb_upload_body* body, const struct vb_form_template* tmpl, const struct vb_upload_form* form);
+
+/* Posts one segment. Returns a CURLcode, *http_status is 0 when there was no response
+ * and status_str gets the start of the response body. Called from the upload workers. */
+typedef int (*vb_transport_fn)(const struct vb_upload_form* form, char* status_str, int status_max_size, long* http_status);
+
+/* the libcurl transport, the default */
+int curl_post_segment(const struct vb_upload_form* form, char* status_str, int status_max_size, long* http_status);
+
+/* Replaces the libcurl transport (tools and benchmarks), NULL restores it */
+void set_vb_transport(vb_transport_fn transport);
+
+/* returns the header size in bytes */
+int write_wav_header(char* buf, int buf_size, int samplerate, int bit_per_sample, int num_of_channels);
+void wav_header_data_size_fix(char* buf, int data_size);
 
 void get_ip_string(char* result, int max_size);
+char* get_safe_object_strings(struct cJSON *m, char* name, char* default_val);
 
+/* The setters change the draft, the getters read the published settings:
+ * the strings are copied into result. */
 void set_vb_api_key(const char* key);
-char* get_vb_api_key();
+char* get_vb_api_key(char* result, int max_size);
 
 void set_vb_password(const char* pass);
-char* get_vb_password();
+char* get_vb_password(char* result, int max_size);
 
 void set_vb_public(const char* pub);
-char* get_vb_public();
+char* get_vb_public(char* result, int max_size);
 
 void set_vb_callback_url(const char* url);
-char* get_vb_callback_url();
+char* get_vb_callback_url(char* result, int max_size);
 
 void set_vb_api_url(const char* api_url);
-char* get_vb_api_url();
+char* get_vb_api_url(char* result, int max_size);
 
 void set_vb_title(const char* title);
-char* get_vb_title();
+char* get_vb_title(char* result, int max_size);
 
 void set_vb_segment_duration(int duration);
 int get_vb_segment_duration();
 
-void set_vb_ip_string(const char* ip_string);
-char* get_vb_ip_string();
+void set_vb_stereo(int stereo);
+int get_vb_stereo();
+
+int parse_segment_mode(const char* value);
+
+void set_vb_segment_mode(int mode);
+int get_vb_segment_mode();
+
+void set_vb_segment_min_duration(int duration);
+int get_vb_segment_min_duration();
+void set_vb_segment_stagger(int enabled);
+int get_vb_segment_stagger();
+/* segments grow under an upload backlog and shrink when the uploads are idle,
+ * between the min and max duration; a call follows at its next segment */
+void set_vb_segment_adaptive(int enabled);
+int get_vb_segment_adaptive();
+void set_vb_segment_adaptive_min(int duration);
+int get_vb_segment_adaptive_min();
+void set_vb_segment_adaptive_max(int duration);
+int get_vb_segment_adaptive_max();
+
+void set_vb_segment_pause_ms(int ms);
+int get_vb_segment_pause_ms();
+
+int parse_silence_elision(const char* value);
+
+void set_vb_silence_elision(int mode);
+int get_vb_silence_elision();
+
+void set_vb_silence_keep_ms(int ms);
+int get_vb_silence_keep_ms();
+
+void set_vb_vad_threshold(int dbfs);
+int get_vb_vad_threshold();
 
+void set_vb_hold_detection(int enabled);
+int get_vb_hold_detection();
+
+void set_vb_hold_detect_ms(int ms);
+int get_vb_hold_detect_ms();
+
+void set_vb_encode_workers(int workers);
+int get_vb_encode_workers();
+
+void set_vb_upload_workers(int workers);
+int get_vb_upload_workers();
+
+void set_vb_pipeline_queue_limit(int limit);
+int get_vb_pipeline_queue_limit();
+
+/* Uploads of one API key running at once and their bytes, 0 for no limit.
+ * The keys share the upload workers in turn, weighted by the bytes uploaded. */
+void set_vb_upload_max_per_key(int uploads);
+int get_vb_upload_max_per_key();
+
+void set_vb_upload_max_bytes_per_key(int bytes);
+int get_vb_upload_max_bytes_per_key();
+
+void set_vb_sample_rate(int rate);
+int get_vb_sample_rate();
+
+void set_vb_trace_level(int level);
+int get_vb_trace_level();
+
+void set_vb_trace_summary_interval(int seconds);
+int get_vb_trace_summary_interval();
+
+void set_vb_trace_timeline(int enabled);
+int get_vb_trace_timeline();
+
+/* timeline files are written here, none when empty */
+void set_vb_trace_dir(const char* dir);
+char* get_vb_trace_dir(char* result, int max_size);
+
+void set_vb_ip_string(const char* ip_string);
+char* get_vb_ip_string(char* result, int max_size);
 
+/* Starts a new configuration from the defaults, the setters above change it.
+ * They take effect with vb_config_apply(). */
 void set_defaults();
+/* A profile with the general settings set so far */
+void init_vb_profile(struct vb_profile* profile, const char* name);
+/* Adds a copy of the profile to the configuration, returns 0 on success */
+int add_vb_profile(const struct vb_profile* profile);
+/* Publishes the configuration: calls started from now on use it, running calls
+ * and their segments keep the one they started with. Returns 0 on success. */
+int vb_config_apply();
 
 //static char vb_time_string[1024];